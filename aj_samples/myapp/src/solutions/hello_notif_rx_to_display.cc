@@ -39,11 +39,10 @@ class NotificationReceiverImpl;
 NotificationService* notificationService = 0;
 NotificationReceiverImpl* notificationReceiver = 0;
 ajn::BusAttachment* busAttachment = 0;
+Display* display = 0;
 static volatile sig_atomic_t s_interrupt = false;
 
-int display_str(const char* str) {
-    Display display;
-
+void display_str(Display& display, const char* str) {
     while (*str != 0) {
         display.DrawCharacter(*str);
         usleep(300 * 1000);
@@ -64,6 +63,9 @@ void cleanup()
     if (busAttachment) {
         delete busAttachment;
     }
+    if (display) {
+        delete display;
+    }
     std::cout << "cleanup() - end" << std::endl;
 }
 
@@ -210,7 +212,7 @@ void NotificationReceiverImpl::Receive(Notification const& notification) {
 
         for (std::vector<NotificationText>::const_iterator vecMessage_it = vecMessages.begin(); vecMessage_it != vecMessages.end(); ++vecMessage_it) {
             std::cout << "Language: " << vecMessage_it->getLanguage().c_str() << "  Message: " << vecMessage_it->getText().c_str() << std::endl;
-            display_str(vecMessage_it->getText().c_str());
+            display_str(*display, vecMessage_it->getText().c_str());
         }
 
         // Print out any other parameters sent in
@@ -302,6 +304,9 @@ int main()
     // change loglevel to debug:
     QCC_SetDebugLevel(logModules::NOTIFICATION_MODULE_LOG_NAME, logModules::ALL_LOG_LEVELS);
 
+    // Open the display link once rather than for every notification
+    display = new Display();
+
     notificationReceiver = new NotificationReceiverImpl(false);
     busAttachment = new BusAttachment("NotificationConsumer", true);
 
@@ -0,0 +1 @@
+../../../linino/smsg/inc/aj_tutorial/checksum.h
\ No newline at end of file
@@ -21,9 +21,111 @@
 
 #include "SMsg.h"
 
-#define RD_TO 500
+/*
+ * Inter-byte timeout in bit times, so that it scales with the link speed.
+ * 125 bit times is 500 us at the base rate.
+ */
+#define RD_TO_BITS 125
+
+/*
+ * Link speeds, indexed the same way on both sides.  The base rate comes
+ * first.
+ */
+static const long BAUD_RATES[] = { 250000, 500000, 1000000 };
+
+#define BAUD_COUNT (sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]))
+#define BAUD_BASE_INDEX 0
+
+/*
+ * After switching speed, go back to the base rate if no sync frame comes in
+ * within BAUD_CONFIRM_MS, or if BAUD_MAX_ERRORS bad frames come in a row.
+ */
+#define BAUD_CONFIRM_MS 100
+#define BAUD_MAX_ERRORS 8
+
+/*
+ * Credit byte: tells the Linino side that n bytes have been pulled out of the
+ * receive buffer so that it can send more without overflowing it.
+ */
+#define CTRL_CREDIT 0x80
+#define CREDIT_MASK 0x3f
+
+/*
+ * Sync frame: the Linino side sends CTRL_SYNC, SYNC_MAGIC, a nonce and the
+ * link capabilities it supports when it opens the link, and expects the same
+ * frame back with CTRL_SYNC_ACK and the capabilities both sides will use.
+ */
+#define CTRL_SYNC 0xc1
+#define CTRL_SYNC_ACK 0xc2
+#define SYNC_LEN 6
+
+/*
+ * Baud frame: the Linino side sends CTRL_BAUD, a speed index and its
+ * complement to change speed.  The reply is CTRL_BAUD_ACK and the index, or
+ * BAUD_REFUSED, at the old speed.
+ */
+#define CTRL_BAUD 0xc3
+#define CTRL_BAUD_ACK 0xc4
+#define BAUD_REFUSED 0xff
+
+/*
+ * Resync request: sent when the sketch starts, and for every bad frame until
+ * a sync frame comes in.  After a reset the Linino side may still be using
+ * the checksum and capabilities agreed to before, which make every frame
+ * look bad here, so it has to open the link again.
+ */
+#define CTRL_RESYNC 0xc5
+
+#define CAP_CRC16 0x01
+#define CAP_FRAG 0x02
+#define CAP_BAUD 0x04
+#define CAP_BATCH 0x08
+#define CAP_PACK 0x10
+
+/*
+ * Define SMSG_NO_CRC16 to save the flash space of the CRC-16 code and stay
+ * with the plain position weighted sum.
+ */
+#ifdef SMSG_NO_CRC16
+#define LINK_CAPS (CAP_FRAG | CAP_BAUD | CAP_BATCH | CAP_PACK)
+#else
+#define LINK_CAPS (CAP_CRC16 | CAP_FRAG | CAP_BAUD | CAP_BATCH | CAP_PACK)
+#endif
+
+static const byte SYNC_MAGIC[] = { 'S', 'y', 'n' };
+
+/*
+ * Frames are [length][type][payload][sum MSB][sum LSB].  The low nibble of
+ * the type byte is the channel and the high nibble holds flags.  TYPE_FRAG
+ * marks one fragment of a longer message, with a payload that starts with
+ * [message ID][fragment index], and TYPE_FRAG_LAST marks the last one.
+ * TYPE_BATCH marks several short messages coalesced into one frame, each as
+ * [length][message].  TYPE_PACKED marks a message that is run-length
+ * encoded, and with TYPE_PACKED_DELTA, XORed with the last message read
+ * from a plain or packed frame first.  A delta payload starts with a tag of
+ * the message it is the difference from.
+ */
+#define TYPE_CHANNEL_MASK 0x0f
+#define TYPE_FLAGS_MASK 0xf0
+#define TYPE_FRAG 0x10
+#define TYPE_FRAG_LAST 0x20
+#define TYPE_BATCH 0x40
+#define TYPE_PACKED 0x80
+#define TYPE_PACKED_DELTA 0x20
+
+/*
+ * Run-length codes: 0nnnnnnn is followed by n + 1 bytes as they are,
+ * 10nnnnnn stands for n + 1 zero bytes, and 11nnnnnn is followed by a byte
+ * to repeat n + 2 times.
+ */
+#define RLE_ZEROS 0x80
+#define RLE_REPEAT 0xc0
+#define RLE_COUNT_MASK 0x3f
+
+#define FRAG_HEADER_LEN 2
+#define FRAG_DATA_LEN (MAX_MSG_LEN - FRAG_HEADER_LEN)
 
-#define BAUDRATE 250000
+#define NO_MSG -2
 
 static char waitRX(long ms)
 {
@@ -42,8 +144,41 @@ static void _write(int c)
     Serial1.write(c);
 }
 
+static byte refTag(const byte* ref, int len)
+{
+    byte tag = len;
+    for (int i = 0; i < len; ++i) {
+        tag = ((tag << 1) | (tag >> 7)) ^ ref[i];
+    }
+    return tag;
+}
 
-SMsg::SMsg()
+
+SMsg::SMsg(byte channel):
+    rebooting(0),
+    channel(channel),
+    caps(0),
+    synced(false),
+    maxBaud(BAUD_BASE),
+    baud(BAUD_BASE_INDEX),
+    baudPending(false),
+    baudTime(0),
+    rdTO(RD_TO_BITS * 1000000L / BAUD_BASE),
+    rxErrors(0),
+    sumMode(CheckSum::SUM),
+    rxCount(0),
+    rxFragActive(false),
+    rxFragId(0),
+    rxFragNext(0),
+    rxFragLen(0),
+    txFragId(0),
+    rxBatchLen(0),
+    rxBatchPos(0),
+    rxRefLen(0),
+    txBatchLen(0),
+    txBatchCount(0),
+    txBatchTime(0),
+    txBatchWindow(0)
 {
 }
 
@@ -51,9 +186,18 @@ SMsg::~SMsg()
 {
 }
 
-void SMsg::begin(void)
+void SMsg::begin(long maxBaud)
 {
-    Serial1.begin(BAUDRATE);
+    this->maxBaud = maxBaud;
+    Serial1.begin(BAUD_RATES[BAUD_BASE_INDEX]);
+    _write(CTRL_RESYNC);
+}
+
+int SMsg::available(void)
+{
+    checkBaud();
+    checkBatch();
+    return (rxBatchLen - rxBatchPos) + Serial1.available();
 }
 
 
@@ -61,100 +205,460 @@ int SMsg::read(byte* buf, int len)
 {
     int ret;
     do {
+        checkBatch();
+        if (rxBatchPos < rxBatchLen) {
+            return readBatched(buf, len);
+        }
+        checkBaud();
         ret = readMsg(buf, len);
-    } while (ret == 0);
+        sendCredits();
+    } while (ret == NO_MSG);
     return ret;
 }
 
 int SMsg::write(const byte* buf, int len)
 {
-    if ((len < 1) || (len > MAX_MSG_LEN)) {
+    if ((len < 1) || (len > MAX_LARGE_MSG_LEN) ||
+        ((len > MAX_MSG_LEN) && !(caps & CAP_FRAG))) {
         return 0;
     }
 
+    if (txBatchWindow && (caps & CAP_BATCH) && (len < MAX_MSG_LEN)) {
+        if ((txBatchLen + 1 + len) > MAX_MSG_LEN) {
+            flush();
+        }
+        if (txBatchCount == 0) {
+            txBatchTime = millis();
+        }
+        txBatch[txBatchLen++] = len;
+        memcpy(&txBatch[txBatchLen], buf, len);
+        txBatchLen += len;
+        ++txBatchCount;
+        checkBatch();
+        return len;
+    }
+
+    flush();
     int ret = writeMsg(buf, len);
     return ret;
 }
 
+void SMsg::setCoalescing(unsigned long ms)
+{
+    txBatchWindow = ms;
+    checkBatch();
+}
+
+/*
+ * A batch of one goes as a plain frame, and so does everything if the
+ * Linino side has since synced without agreeing to coalescing.
+ */
+void SMsg::flush(void)
+{
+    if ((txBatchCount > 1) && (caps & CAP_BATCH)) {
+        writeFrame(TYPE_BATCH, NULL, 0, txBatch, txBatchLen);
+    } else {
+        for (int i = 0; i < txBatchLen; i += 1 + txBatch[i]) {
+            writeFrame(0, NULL, 0, &txBatch[i + 1], txBatch[i]);
+        }
+    }
+    txBatchLen = 0;
+    txBatchCount = 0;
+}
+
+/*
+ * Send the waiting batch if it is full or its time is up.
+ */
+void SMsg::checkBatch(void)
+{
+    if ((txBatchCount > 0) &&
+        (((txBatchLen + 2) > MAX_MSG_LEN) || ((millis() - txBatchTime) >= txBatchWindow))) {
+        flush();
+    }
+}
+
 int SMsg::readMsg(byte* buf, int len)
 {
-    uint16_t sum = 0;
-    uint8_t pos = 0;
+    CheckSum sum(sumMode);
     int plen;
+    int type;
     int psumbuf;
+    bool mine;
+    bool frag;
+    bool batch;
+    bool packed;
+    byte fragId = 0;
+    byte fragIndex = 0;
     uint8_t i;
 
-    plen = readTO(RD_TO);
+    plen = readTO(rdTO);
     if (plen < 0) {
         /* no flushing */
-        return 0;
+        return NO_MSG;
     }
 
     if (plen == '[') {
-        char c;
         // Linux kernal message -- ignore
         flushRX();
-        return 0;
+        return NO_MSG;
     }
 
-    if ((plen > MAX_MSG_LEN) || (plen > len)) {
-        return -1;
+    if (plen == CTRL_SYNC) {
+        return readSync() ? 0 : -1;
+    }
+
+    if (plen == CTRL_BAUD) {
+        readBaud();
+        return NO_MSG;
+    }
+
+    if (plen > MAX_MSG_LEN) {
+        goto error;
+    }
+    sum.AddByte(plen);
+
+    type = readTO(rdTO * 2);
+    if (type < 0) {
+        goto error;
+    }
+    sum.AddByte(type);
+
+    // Messages for other channels still have to be read to stay in step.
+    frag = ((type & TYPE_FLAGS_MASK & ~TYPE_FRAG_LAST) == TYPE_FRAG);
+    batch = ((type & TYPE_FLAGS_MASK) == TYPE_BATCH);
+    packed = ((type & TYPE_FLAGS_MASK & ~TYPE_PACKED_DELTA) == TYPE_PACKED);
+    mine = ((type & TYPE_CHANNEL_MASK) == channel) &&
+        (frag || batch || packed || ((type & TYPE_FLAGS_MASK) == 0));
+    if (mine && (frag ? (plen < FRAG_HEADER_LEN) : (!batch && !packed && (plen > len)))) {
+        goto error;
     }
-    sum += plen * (++pos);
 
     for (i = 0; i < plen; ++i) {
         int c;
-        c = readTO(RD_TO * 2);
+        c = readTO(rdTO * 2);
         if (c < 0) {
-            return -1;
+            goto error;
+        }
+        sum.AddByte(c);
+        if (!mine) {
+            continue;
+        }
+        if (batch || packed) {
+            rxFrame[i] = c;
+        } else if (!frag) {
+            buf[i] = c;
+        } else if (i == 0) {
+            fragId = c;
+        } else if (i == 1) {
+            fragIndex = c;
+            if (fragIndex == 0) {
+                rxFragLen = 0;
+            }
+        } else if ((rxFragLen + i - FRAG_HEADER_LEN) < len) {
+            buf[rxFragLen + i - FRAG_HEADER_LEN] = c;
         }
-        buf[i] = c;
-        sum += c * (++pos);
     }
 
-    psumbuf = readTO(RD_TO);
-    if ((psumbuf < 0) || (((sum >> 8) & 0xff) != psumbuf)) {
-        return -1;
+    psumbuf = readTO(rdTO);
+    if ((psumbuf < 0) || (sum.GetSumMSB() != psumbuf)) {
+        goto error;
+    }
+
+    psumbuf = readTO(rdTO);
+    if ((psumbuf < 0) || (sum.GetSumLSB() != psumbuf)) {
+        goto error;
     }
+    rxErrors = 0;
 
-    psumbuf = readTO(RD_TO);
-    if ((psumbuf < 0) || ((sum & 0xff) != psumbuf)) {
+    // No flushing on success - the Linino side may have already sent the
+    // next message.
+    if (!mine) {
+        return NO_MSG;
+    }
+    if (!frag) {
+        rxFragActive = false;
+        if (batch) {
+            // read() hands the messages out from here.
+            rxBatchLen = plen;
+            rxBatchPos = 0;
+            return NO_MSG;
+        }
+        if (packed) {
+            plen = unpack(buf, len, plen, type & TYPE_PACKED_DELTA);
+            if (plen < 0) {
+                return -1;
+            }
+        }
+        if (caps & CAP_PACK) {
+            memcpy(rxRef, buf, plen);
+            rxRefLen = plen;
+        }
+        return plen;
+    }
+
+    if (fragIndex == 0) {
+        rxFragActive = true;
+        rxFragId = fragId;
+        rxFragNext = 0;
+        rxFragLen = 0;
+    } else if (!rxFragActive) {
+        // Rest of a message that was already given up on.
+        return NO_MSG;
+    }
+    plen -= FRAG_HEADER_LEN;
+    if ((fragId != rxFragId) || (fragIndex != rxFragNext) || ((rxFragLen + plen) > len)) {
+        rxFragActive = false;
         return -1;
     }
+    rxFragLen += plen;
+    ++rxFragNext;
+    if (!(type & TYPE_FRAG_LAST)) {
+        return NO_MSG;
+    }
+    rxFragActive = false;
+    return rxFragLen;
 
-exit:
+error:
+    rxFragActive = false;
     flushRX();
+    if (!synced) {
+        _write(CTRL_RESYNC);
+    }
+    if ((baud != BAUD_BASE_INDEX) && (++rxErrors >= BAUD_MAX_ERRORS)) {
+        // The new speed is not working out (or Linux rebooted and is
+        // talking at the base rate).
+        setBaud(BAUD_BASE_INDEX);
+    }
+    return -1;
+}
+
+/*
+ * Hand out the next message of a batch read earlier.  A length that is 0 or
+ * runs past the end of the batch throws away the rest of it.
+ */
+int SMsg::readBatched(byte* buf, int len)
+{
+    int n = rxFrame[rxBatchPos++];
+    if ((n == 0) || (n > (rxBatchLen - rxBatchPos))) {
+        rxBatchLen = 0;
+        rxBatchPos = 0;
+        return -1;
+    }
 
-    return plen;
+    byte* msg = &rxFrame[rxBatchPos];
+    rxBatchPos += n;
+    if (n > len) {
+        return -1;
+    }
+    memcpy(buf, msg, n);
+    return n;
+}
+
+/*
+ * Decode the plen byte packed frame in rxFrame into buf.  Returns the
+ * message length, or -1 if it does not decode, is longer than len, or is
+ * the difference from a message this side does not have.
+ */
+int SMsg::unpack(byte* buf, int len, int plen, bool delta)
+{
+    int pos = 0;
+    int n = 0;
+
+    if (delta) {
+        if ((plen < 1) || (rxFrame[0] != refTag(rxRef, rxRefLen))) {
+            return -1;
+        }
+        pos = 1;
+    }
+    if (len > MAX_MSG_LEN) {
+        len = MAX_MSG_LEN;
+    }
+
+    while (pos < plen) {
+        byte code = rxFrame[pos++];
+        int count;
+        if (!(code & RLE_ZEROS)) {
+            count = code + 1;
+            if (((n + count) > len) || ((pos + count) > plen)) {
+                return -1;
+            }
+            memcpy(&buf[n], &rxFrame[pos], count);
+            pos += count;
+        } else if ((code & RLE_REPEAT) == RLE_ZEROS) {
+            count = (code & RLE_COUNT_MASK) + 1;
+            if ((n + count) > len) {
+                return -1;
+            }
+            memset(&buf[n], 0, count);
+        } else {
+            count = (code & RLE_COUNT_MASK) + 2;
+            if (((n + count) > len) || (pos >= plen)) {
+                return -1;
+            }
+            memset(&buf[n], rxFrame[pos++], count);
+        }
+        n += count;
+    }
+
+    if (delta) {
+        if (n != rxRefLen) {
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            buf[i] ^= rxRef[i];
+        }
+    }
+    return n;
 }
 
 
 int SMsg::writeMsg(const byte* buf, int len)
 {
-    uint16_t sum = 0;
-    byte pos = 0;
+    if (len <= MAX_MSG_LEN) {
+        writeFrame(0, NULL, 0, buf, len);
+        return len;
+    }
+
+    byte hdr[FRAG_HEADER_LEN] = { txFragId++, 0 };
+    int off = 0;
+    while (off < len) {
+        int n = len - off;
+        byte flags = TYPE_FRAG;
+        if (n > FRAG_DATA_LEN) {
+            n = FRAG_DATA_LEN;
+        } else {
+            flags |= TYPE_FRAG_LAST;
+        }
+        writeFrame(flags, hdr, sizeof(hdr), &buf[off], n);
+        ++hdr[1];
+        off += n;
+    }
+    return len;
+}
+
+void SMsg::writeFrame(byte flags, const byte* hdr, int hdrLen, const byte* buf, int len)
+{
+    CheckSum sum(sumMode);
+    byte type = flags | channel;
     int i;
 
-    _write(len);
-    sum += ((len) * (++pos));
+    _write(hdrLen + len);
+    sum.AddByte(hdrLen + len);
+    _write(type);
+    sum.AddByte(type);
+
+    for (i = 0; i < hdrLen; ++i) {
+        _write(hdr[i]);
+        sum.AddByte(hdr[i]);
+    }
 
     for (i = 0; i < len; ++i) {
         _write(buf[i]);
-        sum += buf[i] * (++pos);
+        sum.AddByte(buf[i]);
+    }
+
+    _write(sum.GetSumMSB());
+    _write(sum.GetSumLSB());
+}
+
+/*
+ * The Linino side (re)opened the link.  Everything before the sync frame has
+ * already been read and thrown away, so echo the frame back to mark where the
+ * new session starts, with the last byte cut down to the capabilities both
+ * sides support.  The Linino side starts over with a full credit window, so
+ * forget any credits not yet returned.
+ */
+bool SMsg::readSync(void)
+{
+    byte frame[SYNC_LEN];
+    uint8_t i;
+
+    frame[0] = CTRL_SYNC_ACK;
+    for (i = 1; i < SYNC_LEN; ++i) {
+        int c = readTO(rdTO);
+        if ((c < 0) || ((i <= sizeof(SYNC_MAGIC)) && (c != SYNC_MAGIC[i - 1]))) {
+            flushRX();
+            return false;
+        }
+        frame[i] = c;
     }
 
-    _write((sum >> 8) & 0xff);
-    _write(sum & 0xff);
+    caps = frame[SYNC_LEN - 1] & LINK_CAPS;
+    frame[SYNC_LEN - 1] = caps;
+    sumMode = (caps & CAP_CRC16) ? CheckSum::CRC16 : CheckSum::SUM;
 
-    delayMicroseconds(RD_TO * 2);
+    for (i = 0; i < SYNC_LEN; ++i) {
+        _write(frame[i]);
+    }
+    rxCount = 0;
+    rxErrors = 0;
+    rxRefLen = 0;
+    baudPending = false;
+    synced = true;
+    return true;
+}
 
-    return len;
+/*
+ * The Linino side wants to change the link speed.  Ack at the old speed,
+ * then switch.  The new speed is only kept once a sync frame gets through
+ * at it.
+ */
+void SMsg::readBaud(void)
+{
+    int index = readTO(rdTO);
+    int check = readTO(rdTO);
+    if ((index < 0) || (check < 0) || (check != (~index & 0xff))) {
+        flushRX();
+        return;
+    }
+
+    _write(CTRL_BAUD_ACK);
+    if ((index >= (int)BAUD_COUNT) || (BAUD_RATES[index] > maxBaud)) {
+        _write(BAUD_REFUSED);
+        return;
+    }
+    _write(index);
+
+    // The Linino side starts over with a full credit window once it has
+    // synced at the new speed.
+    rxCount = 0;
+    setBaud(index);
+    baudPending = (index != BAUD_BASE_INDEX);
+    baudTime = millis();
+}
+
+void SMsg::setBaud(byte index)
+{
+    Serial1.flush();    // let the ack go out at the old speed
+    Serial1.end();
+    Serial1.begin(BAUD_RATES[index]);
+    baud = index;
+    baudPending = false;
+    rdTO = RD_TO_BITS * 1000000L / BAUD_RATES[index];
+    rxErrors = 0;
+}
+
+void SMsg::checkBaud(void)
+{
+    if (baudPending && ((millis() - baudTime) > BAUD_CONFIRM_MS)) {
+        setBaud(BAUD_BASE_INDEX);
+    }
+}
+
+void SMsg::sendCredits(void)
+{
+    while (rxCount > 0) {
+        int n = (rxCount > CREDIT_MASK) ? CREDIT_MASK : rxCount;
+        _write(CTRL_CREDIT | n);
+        rxCount -= n;
+    }
 }
 
 int SMsg::readTO(long to)
 {
     if (waitRX(to)) {
         int c = Serial1.read();
+        ++rxCount;
         detectReboot(c);
         return c;
     }
@@ -163,8 +667,9 @@ int SMsg::readTO(long to)
 
 void SMsg::flushRX(void)
 {
-    while (waitRX(RD_TO)) {
+    while (waitRX(rdTO)) {
         int c = Serial1.read();
+        ++rxCount;
         detectReboot(c);
     }
 }
@@ -23,40 +23,68 @@
 #define _SMSG_H_
 
 #include "Arduino.h"
+#include "CheckSum.h"
 
 class SMsg
 {
   public:
     static const int MAX_MSG_LEN = 31;
 
-    SMsg();
+    /*
+     * Longer messages are sent and received as a run of fragments, up to
+     * this size, if the Linino side supports it.
+     */
+    static const int MAX_LARGE_MSG_LEN = 4096;
+
+    /*
+     * Serial link speeds in bits per second.  The link starts at BAUD_BASE
+     * and the Linino side may step it up to any speed up to the maximum
+     * given to begin().
+     */
+    static const long BAUD_BASE = 250000;
+    static const long BAUD_MAX = 1000000;
+
+    /*
+     * Well known channels.  The Linino side uses the same numbers.  Messages
+     * for other channels are dropped.
+     */
+    static const byte CHANNEL_DEFAULT = 0;
+    static const byte CHANNEL_DISPLAY = 1;
+    static const byte CHANNEL_JOYSTICK = 2;
+
+    SMsg(byte channel = CHANNEL_DEFAULT);
     ~SMsg();
 
     /**
      * This must be called in setup().
+     *
+     * @param maxBaud  Fastest link speed to agree to, in bits per second
      */
-    void begin();
+    void begin(long maxBaud = BAUD_MAX);
 
     void waitLinuxBoot();
     byte linuxRebooting() { return rebooting; }
 
-    int available() { return Serial1.available(); }
+    int available();
 
     /**
      * This reads a message in to buf provided that the message payload is
      * less than or equal to len in size.  The memory pointed to by buf must
-     * be at least len in size.  If the message size is too large the sender
-     * will receive a NACK response.
+     * be at least len in size.  A message sent in fragments is put back
+     * together in buf, so len may be more than MAX_MSG_LEN.
      *
      * @param buf      Buffer to hold the message payload
      * @param len      Size of the buffer (and largest acceptable payload)
      *
-     * @returns  number of bytes read on success, -1 otherwise (contents of buf may be altered)
+     * @returns  number of bytes read on success, 0 if the Linino side just
+     *           (re)opened the link, -1 otherwise (contents of buf may be
+     *           altered)
      */
     int read(byte* buf, int len);
 
     /**
      * This writes a message using the contents of buf as the payload.
+     * Messages longer than MAX_MSG_LEN are sent in fragments.
      *
      * @param buf      Buffer with the message payload
      * @param len      Number of bytes to send
@@ -65,13 +93,77 @@ class SMsg
      */
     int write(const byte* buf, int len);
 
+    /**
+     * Coalesce short messages.  If the Linino side agreed to it, messages
+     * written within ms milliseconds of the first one still waiting are
+     * packed into a single frame, which goes out once the time is up, the
+     * frame is full or flush() is called.  Waiting messages are only sent
+     * from available(), read() and write(), so keep calling them.
+     *
+     * @param ms       Longest a message waits for others to share its frame,
+     *                 or 0 (the default) to send every message straight away
+     */
+    void setCoalescing(unsigned long ms);
+
+    /**
+     * Send any coalesced messages still waiting.
+     */
+    void flush();
+
   private:
     byte rebooting;
+    byte channel;
+    byte caps;          // capabilities agreed to in the sync handshake
+    bool synced;        // a sync frame has come in since begin()
+    long maxBaud;
+    byte baud;          // index into the table of link speeds
+    bool baudPending;   // no sync frame has come in at the new speed yet
+    unsigned long baudTime;
+    long rdTO;          // inter-byte timeout in microseconds
+    byte rxErrors;      // bad frames in a row
+    CheckSum::Mode sumMode;
+    int rxCount;        // bytes read since credits were last sent
+
+    // Fragmented message being put back together.  All of its fragments
+    // are read within a single call to read().
+    bool rxFragActive;
+    byte rxFragId;
+    byte rxFragNext;
+    int rxFragLen;
+
+    byte txFragId;
+
+    // Payload of a batch or packed frame.  A batch of coalesced messages,
+    // each as [length][message], is handed out by read() one message at a
+    // time.
+    byte rxFrame[MAX_MSG_LEN];
+    byte rxBatchLen;
+    byte rxBatchPos;
+
+    // Last message read from a plain or packed frame, which the next packed
+    // frame may be the difference from.
+    byte rxRef[MAX_MSG_LEN];
+    byte rxRefLen;
+
+    byte txBatch[MAX_MSG_LEN];
+    byte txBatchLen;
+    byte txBatchCount;
+    unsigned long txBatchTime;
+    unsigned long txBatchWindow;
 
     int readMsg(byte* buf, int len);
+    int readBatched(byte* buf, int len);
+    int unpack(byte* buf, int len, int plen, bool delta);
+    void checkBatch(void);
+    bool readSync(void);
+    void readBaud(void);
+    void setBaud(byte index);
+    void checkBaud(void);
     int writeMsg(const byte* buf, int len);
+    void writeFrame(byte flags, const byte* hdr, int hdrLen, const byte* buf, int len);
     int readTO(long to);
     void flushRX(void);
+    void sendCredits(void);
     void detectReboot(uint8_t c);
 
 };
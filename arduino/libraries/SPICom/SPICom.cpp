@@ -19,6 +19,8 @@
  *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  ******************************************************************************/
 
+#include <CheckSum.h>
+
 #include "SPICom.h"
 #include "StreamSPI.h"
 
@@ -29,12 +31,44 @@
 #define SPICOM_ACK_MASK (SPICOM_ACK | SPICOM_NACK)
 #define SPICOM_SEQ_MASK (~SPICOM_ACK_MASK)
 
-#define RD_TO 20
+#define SPICOM_ACK_FOLLOWS 0x40
+
+/*
+ * A message numbered up to SEQ_BEHIND before the expected one is a
+ * duplicate.  The Linino side may have this many messages in flight.
+ */
+#define SEQ_BEHIND 32
+
+/*
+ * Timeouts in microseconds.  The Linino side writes each frame in one go,
+ * so its bytes come in close together and RD_TO only has to cover the
+ * driver handing them over.  After a bad frame the line has to be quiet for
+ * QUIET_TO before the nack goes out.  The Linino side will not resend
+ * sooner than these two add up to, so they are kept short.  ACK_TO is how
+ * long to wait for the Linino side to answer a message.
+ */
+#define RD_TO 5000
+#define QUIET_TO 2000
+#define ACK_TO 40000
 
-static int waitRX(long ms)
+/*
+ * Define SPICOM_TRACE to have every byte read, written and flushed printed
+ * to Serial.  This slows the link down a lot.
+ */
+#ifdef SPICOM_TRACE
+#define TRACE(tag, c) do { Serial.print(tag); Serial.print(c, HEX); } while (0)
+#define TRACE_BEGIN(tag) Serial.print(tag)
+#define TRACE_END() Serial.println()
+#else
+#define TRACE(tag, c) do { (void)(c); } while (0)
+#define TRACE_BEGIN(tag) do { } while (0)
+#define TRACE_END() do { } while (0)
+#endif
+
+static int waitRX(long us)
 {
-    long expire = (long)millis() + ms;
-    while (expire - (long)millis() > 0) {
+    long expire = (long)micros() + us;
+    while (expire - (long)micros() > 0) {
         if (StreamSPI0.available()) {
             return 1;
         }
@@ -44,10 +78,9 @@ static int waitRX(long ms)
 
 static void flushRX(void)
 {
-    while (waitRX(10)) {
+    while (waitRX(QUIET_TO)) {
         int c = StreamSPI0.read();
-        Serial.print(" f");
-        Serial.print(c, HEX);
+        TRACE(" f", c);
     }
 }
 
@@ -56,8 +89,7 @@ static int readTO(long to)
 {
     if (waitRX(to)) {
         int c = StreamSPI0.read();
-        Serial.print(" r");
-        Serial.print(c, HEX);
+        TRACE(" r", c);
         return c;
     }
     return -1;
@@ -66,14 +98,17 @@ static int readTO(long to)
 static void _write(int c)
 {
     StreamSPI0.write(c);
-    Serial.print(" w");
-    Serial.print(c, HEX);
+    TRACE(" w", c);
 }
 
 
 SPICom::SPICom():
     rxseq(0),
-    txseq(0)
+    txseq(0),
+    rxNacked(false),
+    ackHeld(0),
+    ackDue(0),
+    ackDelay(0)
 {
 }
 
@@ -87,13 +122,20 @@ void SPICom::begin(void)
 }
 
 
+int SPICom::available(void)
+{
+    flushAck();
+    return StreamSPI0.available();
+}
+
 int SPICom::read(byte* buf, int len)
 {
     int ret;
     do {
-        Serial.print("RD:");
+        flushAck();
+        TRACE_BEGIN("RD:");
         ret = readMsg(buf, len);
-        Serial.println();
+        TRACE_END();
     } while (ret == 0);
     return ret;
 }
@@ -104,17 +146,23 @@ int SPICom::write(const byte* buf, int len)
         return 0;
     }
 
-    Serial.print("WR:");
+    TRACE_BEGIN("WR:");
     int ret = writeMsg(buf, len);
-    Serial.println();
+    TRACE_END();
     return ret;
 }
 
 
+/*
+ * The Linino side may send several messages without waiting for acks, so
+ * only a bad message flushes the input.  Messages out of sequence are
+ * skipped: a repeat of one already received is acked again, and the first
+ * one after a gap is nacked so that the sender goes back to the missing one.
+ * Acks and nacks are cumulative, so any of them also covers a held back ack.
+ */
 int SPICom::readMsg(byte* buf, int len)
 {
-    uint16_t sum = 0;
-    int pos = 0;
+    CheckSum sum;
     int ack = SPICOM_NACK | rxseq;
     int plen;
     int pseq;
@@ -130,16 +178,30 @@ int SPICom::readMsg(byte* buf, int len)
     if ((plen > MAX_MSG_LEN) || (plen > len)) {
         goto exit;
     }
-    sum += plen * (++pos);
+    sum.AddByte(plen);
 
     pseq = readTO(RD_TO);
-    if ((pseq < -1) || (pseq != rxseq)) {
-        if ((pseq >= 0) && (pseq <= MAX_SEQ_NUMBER)) {
-            rxseq = pseq;  // assume that our rxseq value is wrong.
-        }
+    if ((pseq < 0) || (pseq > MAX_SEQ_NUMBER)) {
         goto exit;
     }
-    sum += pseq * (++pos);
+    if (pseq != rxseq) {
+        for (i = 0; i < plen + 2; ++i) {
+            if (readTO(RD_TO) < 0) {
+                return 0;
+            }
+        }
+        if (((rxseq - pseq) & MAX_SEQ_NUMBER) <= SEQ_BEHIND) {
+            sendAck(SPICOM_ACK | ((rxseq - 1) & MAX_SEQ_NUMBER));
+            return 0;
+        }
+        if (rxNacked) {
+            return 0;
+        }
+        rxNacked = true;
+        sendAck(ack);
+        return -1;
+    }
+    sum.AddByte(pseq);
 
     for (i = 0; i < plen; ++i) {
         int c;
@@ -148,63 +210,112 @@ int SPICom::readMsg(byte* buf, int len)
             goto exit;
         }
         buf[i] = c;
-        sum += c * (++pos);
+        sum.AddByte(c);
     }
 
     psumbuf = readTO(RD_TO);
-    if ((psumbuf < 0) || (((sum >> 8) & 0xff) != psumbuf)) {
+    if ((psumbuf < 0) || (sum.GetSumMSB() != psumbuf)) {
         goto exit;
     }
 
     psumbuf = readTO(RD_TO);
-    if ((psumbuf < 0) || ((sum & 0xff) != psumbuf)) {
+    if ((psumbuf < 0) || (sum.GetSumLSB() != psumbuf)) {
         goto exit;
     }
 
-    ack |= SPICOM_ACK;
+    if ((ackDelay > 0) && !ackHeld) {
+        ackHeld = SPICOM_ACK | rxseq;
+        ackDue = millis() + ackDelay;
+    } else {
+        sendAck(SPICOM_ACK | rxseq);
+    }
     ++rxseq;
     rxseq &= MAX_SEQ_NUMBER;
+    rxNacked = false;
+    return plen;
 
 exit:
     flushRX();
-    _write(ack);
-
-    return ((ack & SPICOM_ACK_MASK) == SPICOM_ACK) ? plen : -1;
+    sendAck(ack);
+    rxNacked = true;
+    return -1;
 }
 
+/*
+ * Messages from this side still go out one at a time.  An ack or nack that
+ * does not match means the Linino side lost track of the sequence (e.g. it
+ * restarted), so pick up from the sequence number it expects and let the
+ * caller try again.  A held back ack goes out with the message.
+ */
 int SPICom::writeMsg(const byte* buf, int len)
 {
-    uint16_t sum = 0;
-    byte pos = 0;
+    CheckSum sum;
     int ack;
+    int expected;
+    bool ok;
     int i;
 
-    sum += ((len) * (++pos));
+    sum.AddByte(len);
     _write(len);
 
-    sum += txseq * (++pos);
-    _write(txseq);
+    if (ackHeld) {
+        sum.AddByte(txseq | SPICOM_ACK_FOLLOWS);
+        _write(txseq | SPICOM_ACK_FOLLOWS);
+        sum.AddByte(ackHeld);
+        _write(ackHeld);
+        ackHeld = 0;
+    } else {
+        sum.AddByte(txseq);
+        _write(txseq);
+    }
 
     for (i = 0; i < len; ++i) {
-        sum += buf[i] * (++pos);
+        sum.AddByte(buf[i]);
         _write(buf[i]);
     }
 
-    _write((sum >> 8) & 0xff);
-    _write(sum & 0xff);
+    _write(sum.GetSumMSB());
+    _write(sum.GetSumLSB());
 
-    ack = readTO(2 * RD_TO);
+    // A repeated ack for the previous message may come first.
+    do {
+        ack = readTO(ACK_TO);
+    } while ((ack >= 0) && (ack == (SPICOM_ACK | ((txseq - 1) & MAX_SEQ_NUMBER))));
 
-    if ((ack < 0) || ((ack & SPICOM_ACK_MASK) != SPICOM_ACK) || ((ack & SPICOM_SEQ_MASK) != txseq)) {
-        if ((ack & SPICOM_ACK_MASK) == 0) {
+    if ((ack < 0) || !(ack & SPICOM_NACK)) {
+        if (ack >= 0) {
             flushRX();
         }
         return -1;
     }
 
-    ++txseq;
-    txseq &= MAX_SEQ_NUMBER;
+    // Whatever it is, the reply gives the sequence number the Linino side
+    // expects next.
+    expected = ack & SPICOM_SEQ_MASK;
+    if ((ack & SPICOM_ACK_MASK) == SPICOM_ACK) {
+        expected = (expected + 1) & MAX_SEQ_NUMBER;
+    }
+    ok = (expected == ((txseq + 1) & MAX_SEQ_NUMBER));
+    txseq = expected;
+
+    return ok ? len : -1;
+}
 
-    return len;
+/*
+ * Send an ack or nack now.  It covers any ack being held back.
+ */
+void SPICom::sendAck(byte ack)
+{
+    ackHeld = 0;
+    _write(ack);
 }
 
+/*
+ * Send the held back ack if it is due.
+ */
+void SPICom::flushAck(void)
+{
+    if (ackHeld && ((long)(millis() - ackDue) >= 0)) {
+        sendAck(ackHeld);
+    }
+}
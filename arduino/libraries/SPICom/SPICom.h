@@ -38,7 +38,24 @@ class SPICom
      */
     void begin();
 
-    int available() { return StreamSPI0.available(); }
+    /**
+     * Check for input.  This also sends a held back ack once it is due (see
+     * setAckDelay()).
+     */
+    int available();
+
+    /**
+     * Hold the ack for each received message back for up to ms milliseconds
+     * so that it can go out with the next message written instead of on its
+     * own.  A second message arriving in the meantime is acked right away.
+     * Held acks only go out from available(), read() and write(), so only
+     * use this if the sketch calls one of them at least that often.  The
+     * default of 0 sends every ack straight away.
+     *
+     * @param ms       Longest time to hold an ack.  Keep this under the
+     *                 Linino side's 7 ms minimum retransmission timeout.
+     */
+    void setAckDelay(int ms) { ackDelay = ms; }
 
     /**
      * This reads a message in to buf provided that the message payload is
@@ -66,9 +83,15 @@ class SPICom
   private:
     byte rxseq;
     byte txseq;
+    bool rxNacked;      // the gap in the sequence was already reported
+    byte ackHeld;       // ack to go out with the next message, 0 if none
+    unsigned long ackDue;
+    int ackDelay;
 
     int readMsg(byte* buf, int len);
     int writeMsg(const byte* buf, int len);
+    void sendAck(byte ack);
+    void flushAck(void);
 };
 
 
@@ -15,6 +15,7 @@
  ******************************************************************************/
 
 #include <Joystick.h>
+#include <CheckSum.h>
 #include <SMsg.h>
 
 #define CMD_BUF_SIZE 5
@@ -32,7 +33,7 @@ const uint8_t buttonMap[]= { 7, 6, 5, 4, 3, 8, 9 };
 Joystick js(A1, A0, 0, 990, 0, 990,
             buttonMap, sizeof(buttonMap) / sizeof(buttonMap[0]), 0);
 
-SMsg smsg;
+SMsg smsg(SMsg::CHANNEL_JOYSTICK);
 
 void setup() {
   Serial.begin(115200);
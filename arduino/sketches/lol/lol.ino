@@ -14,14 +14,20 @@
  *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  ******************************************************************************/
 
+#include <CheckSum.h>
 #include <SMsg.h>
 #include <LOL.h>
 
-SMsg smsg;
+SMsg smsg(SMsg::CHANNEL_DISPLAY);
 
 long refreshtime = 0;
 const long scan = 500;
 
+// What is on the display.  Updates from the Linino side either replace all
+// of it (18 bytes, each row MSB first) or just some rows (a row mask MSB
+// first, then those rows).
+uint16_t bitmap[9];
+
 void setup() {
   Serial.begin(115200);
   smsg.begin();
@@ -30,16 +36,48 @@ void setup() {
 }
 
 
+bool applyUpdate(const byte* buf, int len) {
+  int i;
+  if (len == 2 * 9) {
+    for (i = 0; i < 9; ++i) {
+      bitmap[i] = ((uint16_t)buf[2 * i] << 8) | buf[2 * i + 1];
+    }
+    return true;
+  }
+  if (len < 2) {
+    return false;
+  }
+
+  // Check the whole update before applying any of it.
+  uint16_t mask = ((uint16_t)buf[0] << 8) | buf[1];
+  int pos = 2;
+  if (mask >> 9) {
+    return false;
+  }
+  for (i = 0; i < 9; ++i) {
+    if (mask & (1 << i)) {
+      pos += 2;
+    }
+  }
+  if (pos != len) {
+    return false;
+  }
+
+  pos = 2;
+  for (i = 0; i < 9; ++i) {
+    if (mask & (1 << i)) {
+      bitmap[i] = ((uint16_t)buf[pos] << 8) | buf[pos + 1];
+      pos += 2;
+    }
+  }
+  return true;
+}
+
 void loop() {
-  uint16_t bitmap[9];
   byte buf[sizeof(bitmap)];
   if (smsg.available()) {
     int r = smsg.read(buf, sizeof(buf));
-    if (r == sizeof(buf)) {
-      int i;
-      for (i = 0; i < 9; ++i) {
-        bitmap[i] = ((uint16_t)buf[2 * i] << 8) | buf[2 * i + 1];
-      }
+    if ((r > 0) && applyUpdate(buf, r)) {
       LOL.render(bitmap);
       Serial.println("render bitmap");
     } else {
@@ -49,7 +87,7 @@ void loop() {
         smsg.waitLinuxBoot();
         Serial.println("reboot done");
         LOL.begin();
-      } else {
+      } else if (r != 0) {
         Serial.println("bad msg");
       }
     }
@@ -15,6 +15,7 @@
  ******************************************************************************/
 
 #include <Joystick.h>
+#include <CheckSum.h>
 #include <SMsg.h>
 
 SMsg smsg;
@@ -34,7 +35,7 @@ void invert(byte* buffer, int size)
 
 void loop() {
   if (smsg.available()) {
-    byte buffer[SMsg::MAX_MSG_LEN];
+    byte buffer[SMsg::MAX_MSG_LEN + 10];  // same as the Linino side's test buffer
     int ret;
     memset(buffer, 0, sizeof(buffer));
     ret = smsg.read(buffer, sizeof(buffer));
@@ -15,6 +15,7 @@
  ******************************************************************************/
 
 #include <Joystick.h>
+#include <CheckSum.h>
 #include <SPICom.h>
 #include <StreamSPI.h>
 
@@ -48,6 +48,9 @@ class AJDisplay :
         //pthread_create(&handle, NULL, &AJJoystick::MovePointThread, this);
         pthread_mutex_init(&mutex, NULL);
 
+        // Position signals can come much faster than the display needs.
+        display.SetRenderRate(60);
+
         const InterfaceDescription* intf = bus.GetInterface(JS_INTERFACE_NAME);
         if (!intf) {
             printf("failed to create interface\n");
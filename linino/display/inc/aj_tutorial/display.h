@@ -22,18 +22,43 @@
 #ifndef _DISPLAY_H_
 #define _DISPLAY_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
 #if !defined(HOST_BUILD)
+#include <aj_tutorial/reactor.h>
 #include <aj_tutorial/smsg.h>
 #endif
 
+/*
+ * Any number of threads may draw at once.  Each *Buffer() call, or each run
+ * of them between BeginFrame() and EndFrame(), is applied as a whole before
+ * another thread's draws.  Calls made inside a frame skip the lock, so
+ * drawing a lot at once is cheaper in a frame.  The buffer is read for
+ * sending through a sequence lock, so sending never holds up drawing and
+ * never picks up half a frame.
+ */
 class Display
 {
   public:
     Display();
-    ~Display() { }
+    ~Display();
+
+    /**
+     * Start composing a frame out of several *Buffer() calls.  Until the
+     * matching EndFrame(), draws from other threads wait and the frame is
+     * not sent.  Calls may nest.  Don't call SendDisplay() or the DrawX()
+     * convenience methods in between, since they would send the frame half
+     * drawn.
+     */
+    void BeginFrame();
+
+    /**
+     * Finish a frame started with BeginFrame().  Call SendDisplay() to send
+     * it.
+     */
+    void EndFrame();
 
 #if !defined(HOST_BUILD)
     /**
@@ -102,6 +127,57 @@ class Display
         return DrawBoxBuffer(x1, y1, x2, y2, on, fill) && SendDisplay();
     }
 
+    /**
+     * Turns a circle of LEDs on or off.  Parts of the circle beyond the edge
+     * of the display are left out.
+     *
+     * @param x     X coordinate of the center of the circle
+     * @param y     y coordinate of the center of the circle
+     * @param r     radius of the circle (0 for a single LED)
+     * @param on    whether to turn the LED on or off (default = on)
+     * @param fill  whether to draw just the outline of the circle or the full circle (default = full circle)
+     *
+     * @return  true if successfully drawn, false otherwise (bad coordinate or communication error)
+     */
+    bool DrawCircleBuffer(uint8_t x, uint8_t y, uint8_t r, bool on = true, bool fill = true);
+    bool DrawCircle(uint8_t x, uint8_t y, uint8_t r, bool on = true, bool fill = true)
+    {
+        return DrawCircleBuffer(x, y, r, on, fill) && SendDisplay();
+    }
+
+    /**
+     * Turns a polygon of LEDs on or off.  The last corner is joined back to
+     * the first.  Filling follows the even-odd rule, so the inside of a
+     * polygon that crosses itself may be left out.
+     *
+     * @param xs    X coordinates of the corners of the polygon
+     * @param ys    y coordinates of the corners of the polygon
+     * @param count number of corners
+     * @param on    whether to turn the LED on or off (default = on)
+     * @param fill  whether to draw just the outline of the polygon or the full polygon (default = full polygon)
+     *
+     * @return  true if successfully drawn, false otherwise (bad coordinate or communication error)
+     */
+    bool DrawPolygonBuffer(const uint8_t* xs, const uint8_t* ys, uint8_t count, bool on = true, bool fill = true);
+    bool DrawPolygon(const uint8_t* xs, const uint8_t* ys, uint8_t count, bool on = true, bool fill = true)
+    {
+        return DrawPolygonBuffer(xs, ys, count, on, fill) && SendDisplay();
+    }
+
+    /**
+     * Turns on or off the area around an LED: the LED and every LED in the
+     * same state that can be reached from it through its neighbors above,
+     * below, left and right.
+     *
+     * @param x     X coordinate of an LED in the area
+     * @param y     y coordinate of an LED in the area
+     * @param on    whether to turn the LEDs on or off (default = on)
+     *
+     * @return  true if successfully drawn, false otherwise (bad coordinate or communication error)
+     */
+    bool FloodFillBuffer(uint8_t x, uint8_t y, bool on = true);
+    bool FloodFill(uint8_t x, uint8_t y, bool on = true) { return FloodFillBuffer(x, y, on) && SendDisplay(); }
+
     /**
      * Sends a bitmap directly to the LOL shield for display.
      *
@@ -148,25 +224,141 @@ class Display
      *
      * @param bitmapBuffer  Pointer to an array of at lease 9 uint16_t's to store the display bitmap
      */
-    void SaveDisplayBitmap(uint16_t* bitmapBuffer) const
-    {
-        memcpy(bitmapBuffer, display, sizeof(display));
-    }
+    void SaveDisplayBitmap(uint16_t* bitmapBuffer) const;
 
     /**
-     * Send the display buffer to the Arduino side for display.
+     * Send the display buffer to the Arduino side for display.  Only the
+     * rows that changed since the last send go out, except that every half
+     * second, and after a failed send, the whole bitmap is sent so that the
+     * sketch gets back in step after a lost update or a reset.  Nothing is
+     * sent if the buffer has not changed, unless the whole bitmap is due.
      *
      * @return  true if successfully sent, false otherwise (communication error)
      */
     bool SendDisplay();
 
+    /**
+     * Get the number of sends skipped because the display buffer was the
+     * same as the last one sent.
+     */
+    uint32_t GetSuppressedCount() const { return suppressed; }
+
+    /**
+     * Render from a thread of its own at up to maxFps frames per second.
+     * SendDisplay(), TrySendDisplay() and the DrawX() methods then only note
+     * that the buffer changed and return straight away.  The thread sends
+     * the buffer as it is when the next frame is due, so a burst of draws
+     * costs one frame and the display is never more than a frame behind.
+     * Only the thread may touch the link while it runs.
+     *
+     * @param maxFps    Most frames per second, or 0 to stop the thread and
+     *                  go back to sending from SendDisplay().
+     *
+     * @return  true if set, false if the thread could not be started or the
+     *          last frame failed to go out when stopping it.
+     */
+    bool SetRenderRate(uint32_t maxFps);
+
+#if !defined(HOST_BUILD)
+    /**
+     * Queue the display buffer for the Arduino side without blocking.  Use
+     * TryFlush() or a DisplayEndpoint to keep it moving.
+     *
+     * @return  1 if queued or unchanged, 0 if the link is backed up, -1 on
+     *          error
+     */
+    int TrySendDisplay();
+
+    /**
+     * Push out queued display updates without blocking.
+     *
+     * @return  true if nothing is left queued, false otherwise
+     */
+    bool TryFlush() { return smsg.TryFlush(); }
+
+    bool TxPending() const { return smsg.TxPending(); }
+#endif
+
   private:
 #if !defined(HOST_BUILD)
     SMsg smsg;
 #endif
     uint16_t display[9];
+    mutable pthread_mutex_t drawLock;   // recursive, held while drawing
+    volatile uint32_t drawSeq;  // odd while display is being drawn on
+    uint8_t drawDepth;          // BeginFrame() nesting
+    const void* volatile drawOwner;     // thread in a frame, or NULL
+
+    pthread_mutex_t sendLock;   // held while sending
+    uint16_t sent[9];           // bitmap as of the last update sent
+    bool sentValid;             // false until a whole bitmap has gone out
+    uint32_t fullTime;          // when the last whole bitmap went out
+    uint32_t suppressed;        // sends skipped as unchanged
+
+    pthread_t renderThread;
+    pthread_mutex_t renderLock;
+    pthread_cond_t renderCond;
+    uint32_t renderInterval;    // microseconds per frame, 0 for no thread
+    bool renderDirty;           // the buffer changed since the last frame
+    bool renderStop;
+
+    /*
+     * Brackets a *Buffer() call as a frame of its own, unless the calling
+     * thread is already in one.
+     */
+    class FrameGuard {
+      public:
+        FrameGuard(Display& display) : display(display), nested(display.InFrame())
+        {
+            if (!nested) {
+                display.BeginFrame();
+            }
+        }
+        ~FrameGuard()
+        {
+            if (!nested) {
+                display.EndFrame();
+            }
+        }
+
+      private:
+        Display& display;
+        bool nested;
+    };
+
+    bool InFrame() const;
 
     void _DrawPoint(uint8_t x, uint8_t y, bool on);
+    void _DrawRow(uint8_t y, uint16_t mask, bool on);
+    void _DrawSpan(int y, int x1, int x2, bool on);
+    void ReadFrame(uint16_t* frame) const;
+    bool FullFrameDue() const;
+    bool Unchanged(const uint16_t* frame) const;
+    bool QueueRender();
+    bool Render(const uint16_t* frame);
+    static void* RenderThread(void* arg);
+    uint8_t PackUpdate(const uint16_t* frame, uint8_t* msg) const;
+    void UpdateSent(const uint16_t* frame, uint8_t len, bool ok);
 };
 
+#if !defined(HOST_BUILD)
+/**
+ * Services a Display from a Reactor.  The LOL sketch sends nothing but flow
+ * control, so there is no listener.
+ */
+class DisplayEndpoint : public Reactor::Endpoint {
+  public:
+    DisplayEndpoint(Display& display) : display(display) { }
+
+    int GetFD() const { return display.GetFD(); }
+    bool TxPending() const { return display.TxPending(); }
+
+    void Readable() { display.TryFlush(); }
+    void Writable() { display.TryFlush(); }
+
+  private:
+    Display& display;
+};
+#endif
+
 #endif
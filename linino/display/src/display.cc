@@ -23,10 +23,13 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <aj_tutorial/clock.h>
 #include <aj_tutorial/display.h>
 
 #if !defined(HOST_BUILD)
@@ -39,6 +42,19 @@
 #define dbg 0
 #endif
 
+/*
+ * Updates for the LOL sketch carry only the rows that changed: a 16 bit mask
+ * of the rows followed by their new values, all MSB first.  A whole bitmap
+ * is sent instead once FULL_FRAME_TO microseconds have gone by since the
+ * last one, after a failed send, and whenever more than MAX_UPDATE_ROWS rows
+ * changed.  Updates are then always shorter than a whole bitmap, which is
+ * how the sketch tells them apart.  Counting time rather than updates bounds
+ * how long a sketch that reset shows a stale picture at any frame rate.
+ */
+#define FULL_FRAME_LEN 18
+#define FULL_FRAME_TO 500000
+#define MAX_UPDATE_ROWS 7
+
 using namespace std;
 
 static const uint16_t font9x14[][9] = {
@@ -139,27 +155,150 @@ static const uint16_t font9x14[][9] = {
     { 0x0000, 0x0000, 0x0000, 0x0000, 0x0004, 0x0000, 0x0000, 0x0000, 0x0000 }  // '~'
 };
 
+/*
+ * Row masks.  Column x is bit 13 - x of its row, so columnBit[x] is a single
+ * LED and fromColumn[x1] & toColumn[x2] is the run of LEDs from x1 to x2.
+ */
+static const uint16_t columnBit[14] = {
+    0x2000, 0x1000, 0x0800, 0x0400, 0x0200, 0x0100, 0x0080,
+    0x0040, 0x0020, 0x0010, 0x0008, 0x0004, 0x0002, 0x0001
+};
+static const uint16_t fromColumn[14] = {
+    0x3fff, 0x1fff, 0x0fff, 0x07ff, 0x03ff, 0x01ff, 0x00ff,
+    0x007f, 0x003f, 0x001f, 0x000f, 0x0007, 0x0003, 0x0001
+};
+static const uint16_t toColumn[14] = {
+    0x2000, 0x3000, 0x3800, 0x3c00, 0x3e00, 0x3f00, 0x3f80,
+    0x3fc0, 0x3fe0, 0x3ff0, 0x3ff8, 0x3ffc, 0x3ffe, 0x3fff
+};
+
 bool Valid(uint8_t x, uint8_t y)
 {
     return (x < 14) && (y < 9);
 }
 
+/*
+ * Its address tells threads apart for InFrame().  Unlike a pthread_t it has
+ * a value no thread can have, NULL.
+ */
+static __thread char threadMark;
+
 
-Display::Display()
+#if defined(HOST_BUILD)
+Display::Display() :
+#else
+Display::Display() :
+    smsg(SMsg::CHANNEL_DISPLAY),
+#endif
+    drawSeq(0),
+    drawDepth(0),
+    drawOwner(NULL),
+    sentValid(false),
+    fullTime(0),
+    suppressed(0),
+    renderInterval(0),
+    renderDirty(false),
+    renderStop(false)
 {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t attr;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&drawLock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_mutex_init(&sendLock, NULL);
+
+    pthread_mutex_init(&renderLock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&renderCond, &attr);
+    pthread_condattr_destroy(&attr);
+
     ClearDisplay();
 }
 
+Display::~Display()
+{
+    SetRenderRate(0);
+    pthread_cond_destroy(&renderCond);
+    pthread_mutex_destroy(&renderLock);
+    pthread_mutex_destroy(&sendLock);
+    pthread_mutex_destroy(&drawLock);
+}
+
+void Display::BeginFrame()
+{
+    pthread_mutex_lock(&drawLock);
+    if (drawDepth++ == 0) {
+        drawOwner = &threadMark;
+        ++drawSeq;
+        __sync_synchronize();
+    }
+}
+
+void Display::EndFrame()
+{
+    if (--drawDepth == 0) {
+        drawOwner = NULL;
+        __sync_synchronize();
+        ++drawSeq;
+    }
+    pthread_mutex_unlock(&drawLock);
+}
+
+/*
+ * Whether the calling thread is in a frame, and so already holds drawLock.
+ * Only a thread that is in a frame leaves its own mark in drawOwner, and it
+ * clears it itself before leaving, so no other thread ever sees its own
+ * mark there.
+ */
+bool Display::InFrame() const
+{
+    return drawOwner == &threadMark;
+}
+
+void Display::SaveDisplayBitmap(uint16_t* bitmapBuffer) const
+{
+    pthread_mutex_lock(&drawLock);
+    memcpy(bitmapBuffer, display, sizeof(display));
+    pthread_mutex_unlock(&drawLock);
+}
+
+/*
+ * Copy the display buffer as of the last finished frame without holding up
+ * anyone drawing: copy it between two reads of drawSeq and start over if a
+ * frame was in progress at either end.  Only the render thread, which never
+ * draws, may use this.  Others would spin on their own unfinished frame.
+ */
+void Display::ReadFrame(uint16_t* frame) const
+{
+    while (true) {
+        uint32_t seq = drawSeq;
+        __sync_synchronize();
+        if (!(seq & 1)) {
+            memcpy(frame, display, sizeof(display));
+            __sync_synchronize();
+            if (drawSeq == seq) {
+                return;
+            }
+        }
+        sched_yield();
+    }
+}
+
 
 
 bool Display::ClearDisplayBuffer()
 {
+    FrameGuard guard(*this);
     memset(display, 0, sizeof(display));
     return true;
 }
 
 bool Display::DrawPointBuffer(uint8_t x, uint8_t y, bool on)
 {
+    FrameGuard guard(*this);
     if (!Valid(x, y)) {
         return false;
     }
@@ -168,43 +307,75 @@ bool Display::DrawPointBuffer(uint8_t x, uint8_t y, bool on)
     return true;
 }
 
-const static int32_t SCALE = 1024 * 1024;
-
-static int32_t ComputeScaledSlope(int32_t d1, int32_t d2)
-{
-    return (SCALE * d1) / d2;
-}
-
-static uint8_t ComputeCoordinate(int32_t slope, uint8_t c, uint8_t i1, uint8_t i2, uint8_t j1, uint8_t j2)
-{
-    int32_t factor = (slope < 0) ? -1 : 1;
-    uint8_t b = (i1 > i2) ? j2 : j1;
-    return (((slope * c) + (factor * SCALE / 2)) / SCALE) + b;
-}
-
-
+/*
+ * Run-slice Bresenham: rather than stepping LED by LED, each row's run of
+ * LEDs is worked out whole and drawn with a single mask.  Halfway cases
+ * round away from the end with the lower x (shallow lines) or y (steep
+ * lines), as the per-pixel code did where its scaled slope was exact.
+ */
 bool Display::DrawLineBuffer(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, bool on)
 {
+    FrameGuard guard(*this);
     if (!Valid(x1, y1) || !Valid(x2, y2)) {
         return false;
     }
 
-    uint8_t x;
-    uint8_t y;
-
     if (abs(x2 - x1) > abs(y2 - y1)) {
-        // stick to integer math - Yuns don't have FP HW
-        int32_t slope = ComputeScaledSlope((int32_t)y2 - y1, (int32_t)x2 - x1);
-        for (x = min(x1, x2); x <= max(x1, x2); ++x) {
-            y = ComputeCoordinate(slope, x, x1, x2, y1, y2);
-            _DrawPoint(x, y, on);
+        if (x1 > x2) {
+            swap(x1, x2);
+            swap(y1, y2);
+        }
+        int dx = x2 - x1;
+        int dy = abs(y2 - y1);
+        int sy = (y1 < y2) ? 1 : -1;
+        if (dy == 0) {
+            _DrawRow(y1, fromColumn[x1] & toColumn[x2], on);
+            return true;
+        }
+
+        // Row j of the line ends at LED floor(((2j + 1) * dx - 1) / 2dy) from
+        // its left end.  Step that along a row at a time.
+        int den = 2 * dy;
+        int end = 0;
+        int rem = dx - 1;
+        int x = x1;
+        int y = y1;
+        for (int j = 0; j < dy; ++j) {
+            while (rem >= den) {
+                rem -= den;
+                ++end;
+            }
+            _DrawRow(y, fromColumn[x] & toColumn[x1 + end], on);
+            x = x1 + end + 1;
+            y += sy;
+            rem += 2 * dx;
         }
+        _DrawRow(y, fromColumn[x] & toColumn[x2], on);
     } else {
-        // stick to integer math - Yuns don't have FP HW
-        int32_t slope = ComputeScaledSlope((int32_t)x2 - x1, (int32_t)y2 - y1);
-        for (y = min(y1, y2); y <= max(y1, y2); ++y) {
-            x = ComputeCoordinate(slope, y, y1, y2, x1, x2);
-            _DrawPoint(x, y, on);
+        if (y1 > y2) {
+            swap(x1, x2);
+            swap(y1, y2);
+        }
+        int dx = abs(x2 - x1);
+        int dy = y2 - y1;
+        int sx = (x1 < x2) ? 1 : -1;
+        if (dy == 0) {
+            _DrawRow(y1, columnBit[x1], on);
+            return true;
+        }
+
+        // A single LED per row, floor((2j * dx + dy) / 2dy) across from the
+        // top end on row j.
+        int den = 2 * dy;
+        int across = 0;
+        int rem = dy;
+        for (int y = y1; y <= y2; ++y) {
+            if (rem >= den) {
+                rem -= den;
+                ++across;
+            }
+            _DrawRow(y, columnBit[x1 + (sx * across)], on);
+            rem += 2 * dx;
         }
     }
     return true;
@@ -212,46 +383,168 @@ bool Display::DrawLineBuffer(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, boo
 
 bool Display::DrawBoxBuffer(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, bool on, bool fill)
 {
+    FrameGuard guard(*this);
     if (!Valid(x1, y1) || !Valid(x2, y2)) {
         return false;
     }
 
-    uint16_t topbottom = 0;
-    uint16_t sides = (1 << x1) | (1 << x2);
-    uint8_t x;
-    uint8_t y;
+    uint16_t topbottom = fromColumn[min(x1, x2)] & toColumn[max(x1, x2)];
+    uint16_t sides = fill ? topbottom : (columnBit[x1] | columnBit[x2]);
+    uint8_t top = min(y1, y2);
+    uint8_t bottom = max(y1, y2);
 
-    for (x = min(x1, x2); x <= max(x1, x2); ++x) {
-        topbottom |= 1 << x;
+    _DrawRow(top, topbottom, on);
+    _DrawRow(bottom, topbottom, on);
+    for (uint8_t y = top + 1; y < bottom; ++y) {
+        _DrawRow(y, sides, on);
     }
+    return true;
+}
 
-    if (fill) {
-        sides = topbottom;
+/*
+ * Half the width of the row d rows from the middle of a circle of radius r,
+ * or -1 if the circle does not reach that row.  A row takes in the LEDs
+ * whose centres are within r + 1/2 of the circle's centre, as the midpoint
+ * circle algorithm would.
+ */
+static int HalfWidth(int r, int d)
+{
+    int n = (r * r) + r - (d * d);
+    int w = 0;
+
+    if (n < 0) {
+        return -1;
+    }
+    while (((w + 1) * (w + 1)) <= n) {
+        ++w;
     }
+    return w;
+}
 
-    if (on) {
-        display[y1] |= topbottom;
-        display[y2] |= topbottom;
-    } else {
-        topbottom = ~topbottom;
-        sides = ~sides;
-        display[y1] &= topbottom;
-        display[y2] &= topbottom;
+bool Display::DrawCircleBuffer(uint8_t x, uint8_t y, uint8_t r, bool on, bool fill)
+{
+    FrameGuard guard(*this);
+    if (!Valid(x, y)) {
+        return false;
     }
 
-    for (y = min(y1, y2) + 1; y <= max(y1, y2) - 1; ++y) {
-        if (on) {
-            display[y] |= sides;
+    for (int row = 0; row < 9; ++row) {
+        int d = abs(row - y);
+        int w = HalfWidth(r, d);
+        if (w < 0) {
+            continue;
+        }
+        if (fill) {
+            _DrawSpan(row, x - w, x + w, on);
         } else {
-            display[y] &= sides;
+            // The outline is whatever this row has beyond the row outside
+            // it, but at least one LED a side so that it stays connected.
+            int inner = min(HalfWidth(r, d + 1) + 1, w);
+            _DrawSpan(row, x - w, x - inner, on);
+            _DrawSpan(row, x + inner, x + w, on);
+        }
+    }
+    return true;
+}
+
+bool Display::DrawPolygonBuffer(const uint8_t* xs, const uint8_t* ys, uint8_t count, bool on, bool fill)
+{
+    FrameGuard guard(*this);
+    uint8_t i;
+
+    if (count == 0) {
+        return false;
+    }
+    for (i = 0; i < count; ++i) {
+        if (!Valid(xs[i], ys[i])) {
+            return false;
+        }
+    }
+
+    if (fill) {
+        // Even-odd scan conversion: fill between pairs of the points where
+        // the edges cross the middle of each row, in 1/256ths of an LED.
+        int32_t cross[255];
+        for (int row = 0; row < 9; ++row) {
+            uint8_t n = 0;
+            for (i = 0; i < count; ++i) {
+                uint8_t j = (i + 1) % count;
+                int ya = ys[i];
+                int yb = ys[j];
+                if ((ya <= row) == (yb <= row)) {
+                    continue;
+                }
+                cross[n++] = (xs[i] << 8) + (((row - ya) * (xs[j] - xs[i]) * 256) / (yb - ya));
+            }
+            sort(cross, cross + n);
+            for (uint8_t k = 0; (k + 1) < n; k += 2) {
+                _DrawSpan(row, (cross[k] + 255) >> 8, cross[k + 1] >> 8, on);
+            }
         }
     }
 
+    // The edges, which also fill in what the scan conversion leaves out.
+    for (i = 0; i < count; ++i) {
+        uint8_t j = (i + 1) % count;
+        DrawLineBuffer(xs[i], ys[i], xs[j], ys[j], on);
+    }
+    return true;
+}
+
+bool Display::FloodFillBuffer(uint8_t x, uint8_t y, bool on)
+{
+    FrameGuard guard(*this);
+    if (!Valid(x, y)) {
+        return false;
+    }
+
+    uint16_t open[9];           // LEDs not yet in the state being filled in
+    uint16_t region[9];
+    uint8_t i;
+
+    for (i = 0; i < 9; ++i) {
+        open[i] = (on ? ~display[i] : display[i]) & 0x3fff;
+        region[i] = 0;
+    }
+    region[y] = columnBit[x] & open[y];
+    if (!region[y]) {
+        return true;
+    }
+
+    // Grow the region a row at a time: in from the rows above and below,
+    // then along the row, until it stops growing.
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (i = 0; i < 9; ++i) {
+            uint16_t r = region[i];
+            uint16_t prev;
+            if (i > 0) {
+                r |= region[i - 1] & open[i];
+            }
+            if (i < 8) {
+                r |= region[i + 1] & open[i];
+            }
+            do {
+                prev = r;
+                r |= ((r << 1) | (r >> 1)) & open[i];
+            } while (r != prev);
+            if (r != region[i]) {
+                region[i] = r;
+                grew = true;
+            }
+        }
+    }
+
+    for (i = 0; i < 9; ++i) {
+        _DrawRow(i, region[i], on);
+    }
     return true;
 }
 
 bool Display::DrawBitmapBuffer(const uint16_t* bitmap)
 {
+    FrameGuard guard(*this);
     memcpy(display, bitmap, sizeof(display));
     return true;
 }
@@ -294,6 +587,7 @@ bool Display::DrawScoreBoardBuffer(uint8_t left, uint8_t right, bool highlightLe
         { 0x0000, 0x002e, 0x002a, 0x002a, 0x002e, 0x002a, 0x002a, 0x002e, 0x0000 }, // 18
         { 0x0000, 0x002e, 0x002a, 0x002a, 0x002e, 0x0022, 0x0022, 0x002e, 0x0000 }  // 19
     };
+    FrameGuard guard(*this);
     uint16_t leftBitmap[9];
     uint16_t rightBitmap[9];
 
@@ -323,36 +617,273 @@ bool Display::DrawCharacterBuffer(char c) {
 
 bool Display::SendDisplay()
 {
-    uint8_t buf[sizeof(display)];
+    if (QueueRender()) {
+        return true;
+    }
+
+    uint16_t frame[9];
+    SaveDisplayBitmap(frame);
+    return Render(frame);
+}
+
+#if !defined(HOST_BUILD)
+int Display::TrySendDisplay()
+{
+    if (QueueRender()) {
+        return 1;
+    }
+    if (pthread_mutex_trylock(&sendLock) != 0) {
+        return 0;
+    }
+
+    uint16_t frame[9];
+    int r = 1;
+    SaveDisplayBitmap(frame);
+    if (Unchanged(frame)) {
+        ++suppressed;
+    } else {
+        uint8_t msg[FULL_FRAME_LEN];
+        uint8_t len = PackUpdate(frame, msg);
+        r = smsg.TryWrite(msg, len);
+        if (r != 0) {
+            UpdateSent(frame, len, r == len);
+        }
+    }
+    pthread_mutex_unlock(&sendLock);
+    return (r > 0) ? 1 : r;
+}
+#endif
+
+bool Display::SetRenderRate(uint32_t maxFps)
+{
+    pthread_mutex_lock(&renderLock);
+    bool running = (renderInterval > 0);
+    renderInterval = maxFps ? max(1000000 / maxFps, (uint32_t)1) : 0;
+    renderStop = (maxFps == 0);
+    if (maxFps && !running) {
+        if (pthread_create(&renderThread, NULL, &Display::RenderThread, this) != 0) {
+            renderInterval = 0;
+            pthread_mutex_unlock(&renderLock);
+            return false;
+        }
+    }
+    pthread_cond_signal(&renderCond);
+    pthread_mutex_unlock(&renderLock);
+
+    if (!maxFps && running) {
+        pthread_join(renderThread, NULL);
+        // Send whatever the thread did not get to.
+        if (renderDirty) {
+            uint16_t frame[9];
+            renderDirty = false;
+            SaveDisplayBitmap(frame);
+            return Render(frame);
+        }
+    }
+    return true;
+}
+
+/*
+ * Hand the display buffer to the render thread if there is one.
+ */
+bool Display::QueueRender()
+{
+    pthread_mutex_lock(&renderLock);
+    bool threaded = (renderInterval > 0);
+    if (threaded) {
+        renderDirty = true;
+        pthread_cond_signal(&renderCond);
+    }
+    pthread_mutex_unlock(&renderLock);
+    return threaded;
+}
+
+/*
+ * Send frame to the sketch unless it is what the sketch already shows.
+ */
+bool Display::Render(const uint16_t* frame)
+{
+    pthread_mutex_lock(&sendLock);
+    if (Unchanged(frame)) {
+        ++suppressed;
+        pthread_mutex_unlock(&sendLock);
+        return true;
+    }
+
     if (dbg) printf("        +--------------+\n");
-    for (size_t i = 0; i < 9; ++i) {
-        // MSB
-        buf[2 * i] = display[i] >> 8;
-        // LSB
-        buf[2 * i + 1] = display[i] & 0xff;
-        if (dbg) printf("%u: %04x |", (unsigned int)i, display[i]);
-        if (dbg) for (int j = 0; j < 14; ++j) {
-            printf("%c", (display[i] & (1 << (13 - j))) ? '*' : ' ');
+    if (dbg) for (size_t i = 0; i < 9; ++i) {
+        printf("%u: %04x |", (unsigned int)i, frame[i]);
+        for (int j = 0; j < 14; ++j) {
+            printf("%c", (frame[i] & (1 << (13 - j))) ? '*' : ' ');
         }
-        if (dbg) printf("| %02x %02x\n", buf[2 * i] , buf[2 * i + 1]);
+        printf("| %02x %02x\n", frame[i] >> 8, frame[i] & 0xff);
     }
     if (dbg) printf("        +--------------+\n");
 
 #if defined(HOST_BUILD)
+    UpdateSent(frame, FULL_FRAME_LEN, true);
+    pthread_mutex_unlock(&sendLock);
     return true;
 #else
-    int r = smsg.Write(buf, sizeof(buf));
-    return (r == sizeof(buf));
+    uint8_t msg[FULL_FRAME_LEN];
+    uint8_t len = PackUpdate(frame, msg);
+    int r = smsg.Write(msg, len);
+    UpdateSent(frame, len, r == len);
+    pthread_mutex_unlock(&sendLock);
+    return (r == len);
 #endif
 }
 
+/*
+ * Send the display buffer whenever it has changed, but no sooner than
+ * renderInterval after the last frame.  Whatever is drawn in between is
+ * only seen if it is still there when the next frame is due.  A frame that
+ * fails to go out is tried again a frame later.
+ */
+void* Display::RenderThread(void* arg)
+{
+    Display* self = reinterpret_cast<Display*>(arg);
+    uint16_t frame[9];
+
+    pthread_mutex_lock(&self->renderLock);
+    uint32_t last = GetTimeUS() - self->renderInterval;
+    while (!self->renderStop) {
+        if (!self->renderDirty) {
+            pthread_cond_wait(&self->renderCond, &self->renderLock);
+            continue;
+        }
+
+        uint32_t now = GetTimeUS();
+        if ((now - last) < self->renderInterval) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t ns = ts.tv_nsec + (uint64_t)(self->renderInterval - (now - last)) * 1000;
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&self->renderCond, &self->renderLock, &ts);
+            continue;
+        }
+
+        self->renderDirty = false;
+        last = now;
+        pthread_mutex_unlock(&self->renderLock);
+
+        // Anything drawn from here on marks the buffer dirty again.
+        self->ReadFrame(frame);
+        bool ok = self->Render(frame);
+
+        pthread_mutex_lock(&self->renderLock);
+        if (!ok) {
+            self->renderDirty = true;
+        }
+    }
+    pthread_mutex_unlock(&self->renderLock);
+    return NULL;
+}
+
+/*
+ * Build the message that brings the sketch up to date with frame.
+ */
+uint8_t Display::PackUpdate(const uint16_t* frame, uint8_t* msg) const
+{
+    uint16_t mask = 0;
+    uint8_t changed = 0;
+    uint8_t len;
+    size_t i;
+
+    if (!FullFrameDue()) {
+        for (i = 0; i < 9; ++i) {
+            if (frame[i] != sent[i]) {
+                mask |= 1 << i;
+                ++changed;
+            }
+        }
+    } else {
+        changed = 9;
+    }
+
+    if (changed > MAX_UPDATE_ROWS) {
+        for (i = 0; i < 9; ++i) {
+            msg[2 * i] = frame[i] >> 8;
+            msg[2 * i + 1] = frame[i] & 0xff;
+        }
+        return FULL_FRAME_LEN;
+    }
+
+    msg[0] = mask >> 8;
+    msg[1] = mask & 0xff;
+    len = 2;
+    for (i = 0; i < 9; ++i) {
+        if (mask & (1 << i)) {
+            msg[len++] = frame[i] >> 8;
+            msg[len++] = frame[i] & 0xff;
+        }
+    }
+    return len;
+}
+
+/*
+ * Note how the update PackUpdate() built for frame went.  After a failure
+ * nothing is known about what the sketch shows, so the next update is a
+ * whole bitmap.
+ */
+void Display::UpdateSent(const uint16_t* frame, uint8_t len, bool ok)
+{
+    if (!ok) {
+        sentValid = false;
+        return;
+    }
+    memcpy(sent, frame, sizeof(sent));
+    sentValid = true;
+    if (len == FULL_FRAME_LEN) {
+        fullTime = GetTimeUS();
+    }
+}
+
+/*
+ * Check if the next update has to be a whole bitmap no matter what changed.
+ */
+bool Display::FullFrameDue() const
+{
+    return !sentValid || ((GetTimeUS() - fullTime) >= FULL_FRAME_TO);
+}
+
+/*
+ * Check if frame is what the sketch already shows.  Once a whole bitmap is
+ * due it is sent even for an unchanged frame.
+ */
+bool Display::Unchanged(const uint16_t* frame) const
+{
+    return !FullFrameDue() && (memcmp(frame, sent, sizeof(sent)) == 0);
+}
+
 void Display::_DrawPoint(uint8_t x, uint8_t y, bool on)
 {
     assert(x < 14);
     assert(y < 9);
+    _DrawRow(y, columnBit[x], on);
+}
+
+void Display::_DrawRow(uint8_t y, uint16_t mask, bool on)
+{
     if (on) {
-        display[y] |= 1 << (13 - x);
+        display[y] |= mask;
     } else {
-        display[y] &= ~(1 << (13 - x));
+        display[y] &= ~mask;
+    }
+}
+
+/*
+ * Draw the LEDs from x1 to x2 of row y, leaving out any off the display.
+ */
+void Display::_DrawSpan(int y, int x1, int x2, bool on)
+{
+    if ((y < 0) || (y > 8)) {
+        return;
+    }
+    x1 = max(x1, 0);
+    x2 = min(x2, 13);
+    if (x1 <= x2) {
+        _DrawRow(y, fromColumn[x1] & toColumn[x2], on);
     }
 }
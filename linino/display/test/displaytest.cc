@@ -126,6 +126,37 @@ int main(void)
         msleep(200);
     }
 
+    msleep(2000);
+    display.ClearDisplayBuffer();
+    printf("Draw circles\n");
+    for (uint8_t r = 0; r < 7; ++r) {
+        display.DrawCircle(6, 4, r, true, false);
+        msleep(300);
+        display.DrawCircleBuffer(6, 4, r, false, false);
+    }
+    display.DrawCircle(6, 4, 4);
+
+    msleep(2000);
+    display.ClearDisplayBuffer();
+    printf("Draw polygons\n");
+    static const uint8_t starX[] = { 6, 8, 13, 9, 11, 6, 1, 3, 0, 4 };
+    static const uint8_t starY[] = { 0, 3, 3, 5, 8, 6, 8, 5, 3, 3 };
+    display.DrawPolygon(starX, starY, sizeof(starX), true, false);
+    msleep(1000);
+    display.DrawPolygon(starX, starY, sizeof(starX));
+
+    msleep(2000);
+    display.ClearDisplayBuffer();
+    printf("Flood fill\n");
+    display.DrawBoxBuffer(0, 0, 13, 8, true, false);
+    display.DrawLine(0, 8, 13, 0);
+    msleep(500);
+    display.FloodFill(1, 1);
+    msleep(500);
+    display.FloodFill(12, 7);
+    msleep(500);
+    display.FloodFill(6, 4, false);
+
     msleep(2000);
     display.ClearDisplayBuffer();
     printf("Draw scores\n");
@@ -146,8 +177,8 @@ int main(void)
 
 
     msleep(2000);
-    printf("Done\n");
     display.ClearDisplay();
+    printf("Done, %u unchanged frames not sent\n", display.GetSuppressedCount());
 
     return 0;
 }
@@ -0,0 +1,253 @@
+/**
+ * @file
+ * Times the row mask line and box drawing in Display against the per-pixel
+ * code it replaced, and checks that both light the same LEDs.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <aj_tutorial/clock.h>
+#include <aj_tutorial/display.h>
+
+#define ROUNDS 50
+
+using namespace std;
+
+/*
+ * The per-pixel drawing Display used before, on a bitmap of its own.  The
+ * line offsets are taken from the start of the line, which the old code
+ * only got right for lines starting at 0.
+ */
+static void PixelPoint(uint16_t* bitmap, uint8_t x, uint8_t y, bool on)
+{
+    if (on) {
+        bitmap[y] |= 1 << (13 - x);
+    } else {
+        bitmap[y] &= ~(1 << (13 - x));
+    }
+}
+
+const static int32_t SCALE = 1024 * 1024;
+
+static int32_t ComputeScaledSlope(int32_t d1, int32_t d2)
+{
+    return (SCALE * d1) / d2;
+}
+
+static uint8_t ComputeCoordinate(int32_t slope, uint8_t c, uint8_t i1, uint8_t i2, uint8_t j1, uint8_t j2)
+{
+    int32_t factor = (slope < 0) ? -1 : 1;
+    uint8_t b = (i1 > i2) ? j2 : j1;
+    return (((slope * c) + (factor * SCALE / 2)) / SCALE) + b;
+}
+
+static void PixelLine(uint16_t* bitmap, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, bool on)
+{
+    uint8_t x;
+    uint8_t y;
+
+    if ((x1 == x2) && (y1 == y2)) {
+        // the old code divided by zero here
+        PixelPoint(bitmap, x1, y1, on);
+    } else if (abs(x2 - x1) > abs(y2 - y1)) {
+        int32_t slope = ComputeScaledSlope((int32_t)y2 - y1, (int32_t)x2 - x1);
+        for (x = min(x1, x2); x <= max(x1, x2); ++x) {
+            y = ComputeCoordinate(slope, x - min(x1, x2), x1, x2, y1, y2);
+            PixelPoint(bitmap, x, y, on);
+        }
+    } else {
+        int32_t slope = ComputeScaledSlope((int32_t)x2 - x1, (int32_t)y2 - y1);
+        for (y = min(y1, y2); y <= max(y1, y2); ++y) {
+            x = ComputeCoordinate(slope, y - min(y1, y2), y1, y2, x1, x2);
+            PixelPoint(bitmap, x, y, on);
+        }
+    }
+}
+
+/*
+ * Whether a line passes exactly halfway between two LEDs anywhere.  The
+ * per-pixel code rounded those cases one way or the other depending on
+ * the length of the line, so lines with them may differ.
+ */
+static bool Halfway(int x1, int y1, int x2, int y2)
+{
+    int major = max(abs(x2 - x1), abs(y2 - y1));
+    int minor = min(abs(x2 - x1), abs(y2 - y1));
+    for (int k = 0; k <= major; ++k) {
+        if (((2 * k * minor) % (2 * major)) == major) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void PixelBox(uint16_t* bitmap, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, bool on, bool fill)
+{
+    for (uint8_t y = min(y1, y2); y <= max(y1, y2); ++y) {
+        for (uint8_t x = min(x1, x2); x <= max(x1, x2); ++x) {
+            if (fill || (y == y1) || (y == y2) || (x == x1) || (x == x2)) {
+                PixelPoint(bitmap, x, y, on);
+            }
+        }
+    }
+}
+
+static void PrintBitmaps(const uint16_t* a, const uint16_t* b)
+{
+    for (int y = 0; y < 9; ++y) {
+        char row[2][15];
+        for (int x = 0; x < 14; ++x) {
+            row[0][x] = (a[y] & (1 << (13 - x))) ? '@' : '.';
+            row[1][x] = (b[y] & (1 << (13 - x))) ? '@' : '.';
+        }
+        row[0][14] = row[1][14] = '\0';
+        printf("    %s  %s\n", row[0], row[1]);
+    }
+}
+
+int main(void)
+{
+    Display display;
+    uint16_t bitmap[9];
+    uint16_t check[9];
+    uint32_t lineMismatches = 0;
+    uint32_t halfway = 0;
+    uint32_t boxMismatches = 0;
+    uint32_t lines = 0;
+    uint32_t boxes = 0;
+    uint32_t start;
+    uint32_t pixelLineUS;
+    uint32_t maskLineUS;
+    uint32_t pixelBoxUS;
+    uint32_t maskBoxUS;
+    int x1, y1, x2, y2;
+    int i;
+
+    // Every line and every box there is, first for the LEDs they light.
+    for (x1 = 0; x1 < 14; ++x1) {
+        for (y1 = 0; y1 < 9; ++y1) {
+            for (x2 = 0; x2 < 14; ++x2) {
+                for (y2 = 0; y2 < 9; ++y2) {
+                    memset(check, 0, sizeof(check));
+                    PixelLine(check, x1, y1, x2, y2, true);
+                    display.ClearDisplayBuffer();
+                    display.DrawLineBuffer(x1, y1, x2, y2);
+                    display.SaveDisplayBitmap(bitmap);
+                    if (Halfway(x1, y1, x2, y2)) {
+                        ++halfway;
+                    } else if (memcmp(bitmap, check, sizeof(bitmap)) != 0) {
+                        if (lineMismatches++ < 3) {
+                            printf("Line (%d,%d)-(%d,%d) per-pixel / row mask:\n", x1, y1, x2, y2);
+                            PrintBitmaps(check, bitmap);
+                        }
+                    }
+                    ++lines;
+
+                    for (int fill = 0; fill < 2; ++fill) {
+                        memset(check, 0, sizeof(check));
+                        PixelBox(check, x1, y1, x2, y2, true, fill);
+                        display.ClearDisplayBuffer();
+                        display.DrawBoxBuffer(x1, y1, x2, y2, true, fill);
+                        display.SaveDisplayBitmap(bitmap);
+                        if (memcmp(bitmap, check, sizeof(bitmap)) != 0) {
+                            if (boxMismatches++ < 3) {
+                                printf("Box (%d,%d)-(%d,%d) per-pixel / row mask:\n", x1, y1, x2, y2);
+                                PrintBitmaps(check, bitmap);
+                            }
+                        }
+                        ++boxes;
+                    }
+                }
+            }
+        }
+    }
+
+    // Then for time, drawing on and off so that every call has work to do.
+    memset(bitmap, 0, sizeof(bitmap));
+    start = GetTimeUS();
+    for (i = 0; i < ROUNDS; ++i) {
+        for (x1 = 0; x1 < 14; ++x1) {
+            for (y1 = 0; y1 < 9; ++y1) {
+                for (x2 = 0; x2 < 14; ++x2) {
+                    for (y2 = 0; y2 < 9; ++y2) {
+                        PixelLine(bitmap, x1, y1, x2, y2, i & 1);
+                    }
+                }
+            }
+        }
+    }
+    pixelLineUS = GetTimeUS() - start;
+
+    display.BeginFrame();
+    start = GetTimeUS();
+    for (i = 0; i < ROUNDS; ++i) {
+        for (x1 = 0; x1 < 14; ++x1) {
+            for (y1 = 0; y1 < 9; ++y1) {
+                for (x2 = 0; x2 < 14; ++x2) {
+                    for (y2 = 0; y2 < 9; ++y2) {
+                        display.DrawLineBuffer(x1, y1, x2, y2, i & 1);
+                    }
+                }
+            }
+        }
+    }
+    maskLineUS = GetTimeUS() - start;
+
+    start = GetTimeUS();
+    for (i = 0; i < ROUNDS; ++i) {
+        for (x1 = 0; x1 < 14; ++x1) {
+            for (y1 = 0; y1 < 9; ++y1) {
+                for (x2 = 0; x2 < 14; ++x2) {
+                    for (y2 = 0; y2 < 9; ++y2) {
+                        PixelBox(bitmap, x1, y1, x2, y2, i & 1, i & 2);
+                    }
+                }
+            }
+        }
+    }
+    pixelBoxUS = GetTimeUS() - start;
+
+    start = GetTimeUS();
+    for (i = 0; i < ROUNDS; ++i) {
+        for (x1 = 0; x1 < 14; ++x1) {
+            for (y1 = 0; y1 < 9; ++y1) {
+                for (x2 = 0; x2 < 14; ++x2) {
+                    for (y2 = 0; y2 < 9; ++y2) {
+                        display.DrawBoxBuffer(x1, y1, x2, y2, i & 1, i & 2);
+                    }
+                }
+            }
+        }
+    }
+    maskBoxUS = GetTimeUS() - start;
+    display.EndFrame();
+
+    printf("%u lines differ from per-pixel of %u (%u with halfway cases not compared), %u boxes of %u\n",
+           lineMismatches, lines, halfway, boxMismatches, boxes);
+    printf("lines: per-pixel %u us, row mask %u us (%u lines each)\n", pixelLineUS, maskLineUS, lines * ROUNDS);
+    printf("boxes: per-pixel %u us, row mask %u us (%u boxes each)\n", pixelBoxUS, maskBoxUS, lines * ROUNDS);
+
+    return (lineMismatches || boxMismatches) ? 1 : 0;
+}
@@ -25,13 +25,19 @@
 #include <stdint.h>
 
 #if !defined(HOST_BUILD)
+#include <aj_tutorial/reactor.h>
 #include <aj_tutorial/smsg.h>
 #endif
 
 class Joystick
 {
   public:
+#if defined(HOST_BUILD)
     Joystick() { }
+#else
+    // Commands and their replies go ahead of queued display frames.
+    Joystick() : smsg(SMsg::CHANNEL_JOYSTICK) { smsg.SetPriority(SMsg::PRIORITY_URGENT); }
+#endif
     ~Joystick() { }
 
 #if !defined(HOST_BUILD)
@@ -44,6 +50,28 @@ class Joystick
      * @return  file descriptor
      */
     int GetFD() const { return smsg.GetFD(); }
+
+    /**
+     * Read event data from the joystick if any has arrived, without
+     * blocking.
+     *
+     * @param[out] buttons  Bit map of which buttons are pressed.
+     * @param[out] x        X position of the joystick
+     * @param[out] y        Y position of the joystick
+     *
+     * @return  1 if an event was read, 0 if none is waiting, -1 on error
+     */
+    int TryReadJoystick(uint16_t& buttons, int16_t& x, int16_t& y);
+
+    /**
+     * Push out any queued commands without blocking.
+     *
+     * @return  true if nothing is left queued, false otherwise
+     */
+    bool TryFlush() { return smsg.TryFlush(); }
+
+    bool RxBuffered() const { return smsg.RxBuffered(); }
+    bool TxPending() const { return smsg.TxPending(); }
 #endif
 
     /**
@@ -86,4 +114,44 @@ class Joystick
     bool SendGetCmd(uint8_t cmd, int16_t& i1, int16_t& i2);
 };
 
+#if !defined(HOST_BUILD)
+/**
+ * Receives joystick events from a JoystickEndpoint.
+ */
+class JoystickListener {
+  public:
+    virtual ~JoystickListener() { }
+
+    virtual void JoystickEvent(uint16_t buttons, int16_t x, int16_t y) = 0;
+};
+
+/**
+ * Services a Joystick from a Reactor.
+ */
+class JoystickEndpoint : public Reactor::Endpoint {
+  public:
+    JoystickEndpoint(Joystick& js, JoystickListener& listener) : js(js), listener(listener) { }
+
+    int GetFD() const { return js.GetFD(); }
+    bool RxBuffered() const { return js.RxBuffered(); }
+    bool TxPending() const { return js.TxPending(); }
+
+    void Readable()
+    {
+        uint16_t buttons;
+        int16_t x;
+        int16_t y;
+        while (js.TryReadJoystick(buttons, x, y) > 0) {
+            listener.JoystickEvent(buttons, x, y);
+        }
+    }
+
+    void Writable() { js.TryFlush(); }
+
+  private:
+    Joystick& js;
+    JoystickListener& listener;
+};
+#endif
+
 #endif
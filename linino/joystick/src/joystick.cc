@@ -70,6 +70,27 @@ bool Joystick::ReadJoystick(uint16_t& buttons, int16_t& x, int16_t& y)
     return true;
 }
 
+#if !defined(HOST_BUILD)
+int Joystick::TryReadJoystick(uint16_t& buttons, int16_t& x, int16_t& y)
+{
+    uint8_t buf[SMsg::MAX_MSG_LEN];
+    int ret;
+
+    ret = smsg.TryRead(buf, sizeof(buf));
+    if (ret == 0) {
+        return 0;
+    }
+    if ((ret != 7) || (buf[0] != JS_EVENT)) {
+        return -1;
+    }
+    buttons = (buf[1] << 8) | buf[2];
+    x = (buf[3] << 8) | buf[4];
+    y = (buf[5] << 8) | buf[6];
+
+    return 1;
+}
+#endif
+
 bool Joystick::SetOutputRange(int16_t left, int16_t right, int16_t up, int16_t down)
 {
 #if defined(HOST_BUILD)
@@ -113,7 +134,6 @@ bool Joystick::SendSetCmd(uint8_t cmd, int16_t i1, int16_t i2)
     buf[3] = i2 >> 8;
     buf[4] = i2 & 0xff;
     int ret = smsg.Write(buf, sizeof(buf));
-    usleep(2000);
     return (ret == CMD_BUF_SIZE);
 #endif
 }
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * Just enough of the Arduino core for the SMsg and SPICom libraries to run
+ * on a host under the link simulator.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _ARDUINO_H_
+#define _ARDUINO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEC 10
+#define HEX 16
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class SimLink;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+/*
+ * A serial port.  Ports attached to a SimLink talk to the program under
+ * test.  The console (Serial) is not attached and prints to stderr.
+ */
+class HardwareSerial {
+  public:
+    HardwareSerial() : link(NULL) { }
+
+    void attach(SimLink* link) { this->link = link; }
+
+    /*
+     * Open the port.  A baud of 0 keeps the link's own speed, which is what
+     * StreamSPI does.
+     */
+    void begin(unsigned long baud = 0);
+    void end(void);
+    void flush(void);
+    int available(void);
+    int read(void);
+    size_t write(uint8_t c);
+
+    void print(const char* s);
+    void print(char c);
+    void print(int n, int base = DEC);
+    void println(void);
+    void println(const char* s);
+    void println(int n, int base = DEC);
+
+  private:
+    SimLink* link;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif
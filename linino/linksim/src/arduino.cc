@@ -0,0 +1,137 @@
+/**
+ * @file
+ * Arduino core stand-in for running the Arduino side libraries on a host.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "StreamSPI.h"
+
+#include "simlink.h"
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+StreamSPI StreamSPI0;
+
+
+unsigned long millis(void)
+{
+    return micros() / 1000;
+}
+
+unsigned long micros(void)
+{
+    return SimLink::GetTime();
+}
+
+void delay(unsigned long ms)
+{
+    unsigned long start = micros();
+    while ((micros() - start) < (ms * 1000)) {
+        // Keep the link moving while the sketch sleeps.
+        Serial1.available();
+        StreamSPI0.available();
+    }
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    unsigned long start = micros();
+    while ((micros() - start) < us) {
+    }
+}
+
+
+void HardwareSerial::begin(unsigned long baud)
+{
+    if (link) {
+        link->Start(baud);
+    }
+}
+
+void HardwareSerial::end(void)
+{
+    if (link) {
+        link->Stop();
+    }
+}
+
+void HardwareSerial::flush(void)
+{
+    if (link) {
+        link->Flush();
+    }
+}
+
+int HardwareSerial::available(void)
+{
+    return link ? link->Available() : 0;
+}
+
+int HardwareSerial::read(void)
+{
+    return link ? link->Read() : -1;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    if (link) {
+        link->Write(c);
+    } else {
+        fputc(c, stderr);
+    }
+    return 1;
+}
+
+void HardwareSerial::print(const char* s)
+{
+    while (*s) {
+        write(*s++);
+    }
+}
+
+void HardwareSerial::print(char c)
+{
+    write(c);
+}
+
+void HardwareSerial::print(int n, int base)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), (base == HEX) ? "%X" : "%d", n);
+    print(buf);
+}
+
+void HardwareSerial::println(void)
+{
+    print("\r\n");
+}
+
+void HardwareSerial::println(const char* s)
+{
+    print(s);
+    println();
+}
+
+void HardwareSerial::println(int n, int base)
+{
+    print(n, base);
+    println();
+}
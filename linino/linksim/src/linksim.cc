@@ -0,0 +1,331 @@
+/**
+ * @file
+ * Link simulator: plays the Arduino side of SMsg or SPICom on a pty so that
+ * the Linino side can be run, benchmarked and tested on any Linux host.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * The Arduino side is the real SMsg or SPICom library from arduino/libraries
+ * built against a small stand-in for the Arduino core (see the arduino
+ * directory), so the simulator follows the protocol exactly as the sketches
+ * do.  The built in sketch reads messages and, like the smsgtest and
+ * spicomtest sketches, sends each one back with its bytes inverted.
+ *
+ * Run a program under test with
+ *
+ *   linksim [options] -- smsgtest
+ *   linksim -p spicom [options] -- spitest
+ *
+ * It gets SMSG_DEV or SPICOM_DEV pointing at the pty, and the simulator
+ * exits with its exit status once it is done.  Without a program the
+ * simulator prints the device to use and runs until interrupted.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "SMsg.h"
+#include "SPICom.h"
+#include "StreamSPI.h"
+
+#include "simlink.h"
+
+/*
+ * How long the sketch is gone for when the Arduino resets.
+ */
+#define REBOOT_MS 100
+
+#define IDLE_US 50
+
+struct Options {
+    bool spicom;
+    bool echo;
+    uint8_t channel;
+    long maxBaud;
+    unsigned long coalesce;     // milliseconds, 0 for off
+    int ackDelay;
+    uint32_t rebootEvery;       // milliseconds, 0 for never
+};
+
+struct SketchStats {
+    uint32_t msgs;
+    uint32_t bytes;
+    uint32_t readErrors;
+    uint32_t writes;
+    uint32_t writeErrors;
+    uint32_t reboots;
+};
+
+static SimLink* sim;
+static SketchStats sketch;
+static pid_t child = -1;
+static volatile sig_atomic_t stopping = 0;
+
+
+static void Usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [-- program [args]]\n"
+            "  -p smsg|spicom  protocol to play the Arduino side of (default smsg)\n"
+            "  -m echo|sink    send each message back inverted, or just read it (default echo)\n"
+            "  -c CHANNEL      SMsg channel the sketch uses (default 0)\n"
+            "  -B BPS          fastest SMsg speed the sketch agrees to (default %ld)\n"
+            "  -k MS           SMsg coalescing window for the sketch's messages (default 0)\n"
+            "  -a MS           SPICom ack delay (default 0)\n"
+            "  -b BPS          fixed wire speed; SMsg follows the speed both ends set\n"
+            "                  by default and SPICom runs at 1000000\n"
+            "  -d N            drop 1 byte in N\n"
+            "  -f N            flip a bit in 1 byte in N\n"
+            "  -l US           add US microseconds of latency to every byte\n"
+            "  -r MS           reset the Arduino every MS milliseconds\n"
+            "  -s SEED         seed for the fault injection (default 1)\n",
+            prog, SMsg::BAUD_MAX);
+}
+
+static void OnSignal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/*
+ * End the simulation once the program under test exits or we are
+ * interrupted.  This runs from inside the Arduino side's polling loops, so
+ * it leaves by exiting rather than returning.
+ */
+static void CheckStop(void)
+{
+    if (!stopping) {
+        return;
+    }
+
+    int status = 0;
+    if (child > 0) {
+        if (waitpid(child, &status, WNOHANG) == 0) {
+            kill(child, SIGTERM);
+            waitpid(child, &status, 0);
+        }
+    }
+
+    fprintf(stderr, "sketch: %u messages (%u bytes) read, %u read errors, %u written, %u write errors, %u resets\n",
+            sketch.msgs, sketch.bytes, sketch.readErrors, sketch.writes, sketch.writeErrors, sketch.reboots);
+    sim->GetStats().Print(stderr);
+
+    if (WIFEXITED(status)) {
+        exit(WEXITSTATUS(status));
+    }
+    exit(1);
+}
+
+static void Idle(void)
+{
+    sim->Pump();
+    usleep(IDLE_US);
+}
+
+
+template <class Port> static Port* Boot(const Options& opt);
+
+template <> SMsg* Boot<SMsg>(const Options& opt)
+{
+    SMsg* port = new SMsg(opt.channel);
+    port->begin(opt.maxBaud);
+    port->setCoalescing(opt.coalesce);
+    return port;
+}
+
+template <> SPICom* Boot<SPICom>(const Options& opt)
+{
+    SPICom* port = new SPICom();
+    port->begin();
+    port->setAckDelay(opt.ackDelay);
+    return port;
+}
+
+/*
+ * The sketch: loop() from the smsgtest and spicomtest sketches, without the
+ * debug output and delays, plus resets.  Unlike those sketches it tries a
+ * failed echo again, so that one fault on the wire doesn't cost the program
+ * under test a message.  A reset still loses it.
+ */
+template <class Port>
+static void RunSketch(const Options& opt)
+{
+    static uint8_t buf[SMsg::MAX_LARGE_MSG_LEN];
+    int pending = 0;            // echo still to be written
+    Port* port = NULL;
+    unsigned long upAt = millis();
+    unsigned long resetAt = upAt + opt.rebootEvery;
+
+    while (true) {
+        unsigned long now = millis();
+        if (port && opt.rebootEvery && ((long)(now - resetAt) >= 0)) {
+            delete port;
+            port = NULL;
+            Serial1.end();
+            StreamSPI0.end();
+            sim->Discard();
+            pending = 0;
+            upAt = now + REBOOT_MS;
+            resetAt = upAt + opt.rebootEvery;
+            ++sketch.reboots;
+        }
+        if (!port) {
+            if ((long)(now - upAt) < 0) {
+                Idle();
+                continue;
+            }
+            port = Boot<Port>(opt);
+        }
+
+        if (pending > 0) {
+            if (port->write(buf, pending) < 0) {
+                ++sketch.writeErrors;
+            } else {
+                ++sketch.writes;
+                pending = 0;
+            }
+            continue;
+        }
+
+        if (!port->available()) {
+            Idle();
+            continue;
+        }
+
+        int ret = port->read(buf, sizeof(buf));
+        if (ret < 0) {
+            ++sketch.readErrors;
+        } else if (ret > 0) {
+            ++sketch.msgs;
+            sketch.bytes += ret;
+            if (opt.echo) {
+                for (int i = 0; i < ret; ++i) {
+                    buf[i] = ~buf[i];
+                }
+                pending = ret;
+            }
+        }
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    SimLink::Config config;
+    bool fixedBps = false;
+    int c;
+
+    opt.spicom = false;
+    opt.echo = true;
+    opt.channel = SMsg::CHANNEL_DEFAULT;
+    opt.maxBaud = SMsg::BAUD_MAX;
+    opt.coalesce = 0;
+    opt.ackDelay = 0;
+    opt.rebootEvery = 0;
+
+    while ((c = getopt(argc, argv, "p:m:c:B:k:a:b:d:f:l:r:s:h")) != -1) {
+        switch (c) {
+        case 'p':
+            if (strcmp(optarg, "spicom") == 0) {
+                opt.spicom = true;
+            } else if (strcmp(optarg, "smsg") != 0) {
+                Usage(argv[0]);
+                return 2;
+            }
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "sink") == 0) {
+                opt.echo = false;
+            } else if (strcmp(optarg, "echo") != 0) {
+                Usage(argv[0]);
+                return 2;
+            }
+            break;
+
+        case 'c': opt.channel = atoi(optarg); break;
+        case 'B': opt.maxBaud = atol(optarg); break;
+        case 'k': opt.coalesce = strtoul(optarg, NULL, 0); break;
+        case 'a': opt.ackDelay = atoi(optarg); break;
+        case 'b': config.bps = strtoul(optarg, NULL, 0); fixedBps = true; break;
+        case 'd': config.dropEvery = strtoul(optarg, NULL, 0); break;
+        case 'f': config.flipEvery = strtoul(optarg, NULL, 0); break;
+        case 'l': config.latency = strtoul(optarg, NULL, 0); break;
+        case 'r': opt.rebootEvery = strtoul(optarg, NULL, 0); break;
+        case 's': config.seed = strtoul(optarg, NULL, 0); break;
+
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (opt.spicom && !fixedBps) {
+        config.bps = 1000000;
+    }
+
+    SimLink link(config);
+    if (!link.Open()) {
+        return 1;
+    }
+    sim = &link;
+    link.SetPumpHook(CheckStop);
+    Serial1.attach(&link);
+    StreamSPI0.attach(&link);
+
+    const char* var = opt.spicom ? "SPICOM_DEV" : "SMSG_DEV";
+    setenv(var, link.GetDevice(), 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (optind < argc) {
+        child = fork();
+        if (child < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0) {
+            execvp(argv[optind], &argv[optind]);
+            perror(argv[optind]);
+            _exit(127);
+        }
+    } else {
+        fprintf(stderr, "%s=%s\n", var, link.GetDevice());
+    }
+
+    if (opt.spicom) {
+        RunSketch<SPICom>(opt);
+    } else {
+        RunSketch<SMsg>(opt);
+    }
+    return 0;
+}
@@ -0,0 +1,335 @@
+/**
+ * @file
+ * Simulated serial link on a pseudo-terminal pair.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simlink.h"
+
+/*
+ * Speeds the Linino side may set on the tty and what they run at on the Yun
+ * (see smsglink.cc).
+ */
+static const struct {
+    speed_t speed;
+    uint32_t bps;
+} TTY_SPEEDS[] = {
+    { B230400, 250000 },
+    { B460800, 500000 },
+    { B921600, 1000000 }
+};
+
+#define TTY_SPEED_COUNT (sizeof(TTY_SPEEDS) / sizeof(TTY_SPEEDS[0]))
+
+#define BITS_PER_BYTE 10        // start, 8 data, stop
+
+static uint32_t GetTimeUS()
+{
+    return SimLink::GetTime();
+}
+
+static uint32_t ByteTime(uint32_t bps)
+{
+    return bps ? ((BITS_PER_BYTE * 1000000) / bps) : 0;
+}
+
+
+uint64_t SimLink::GetTime()
+{
+    static uint64_t last = 0;
+    static uint64_t sim = 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    if (last != 0) {
+        uint64_t step = now - last;
+        sim += (step > MAX_TIME_STEP) ? MAX_TIME_STEP : step;
+    }
+    last = now;
+    return sim;
+}
+
+
+SimLink::Stats::Stats()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+void SimLink::Stats::Print(FILE* out) const
+{
+    fprintf(out, "wire: %u bytes to the Arduino, %u from it\n", toArduino, fromArduino);
+    fprintf(out, "faults: %u dropped, %u flipped, %u garbled, %u overruns, %u while offline\n",
+            dropped, flipped, garbled, overruns, offline);
+}
+
+
+SimLink::SimLink(const Config& config):
+    config(config),
+    master(-1),
+    slave(-1),
+    pumpHook(NULL),
+    online(false),
+    arduinoBps(config.bps),
+    toArduinoFree(GetTimeUS()),
+    fromArduinoFree(toArduinoFree),
+    inBurst(false),
+    burstEnd(0),
+    rxHead(0),
+    rxCount(0)
+{
+}
+
+SimLink::~SimLink()
+{
+    if (master >= 0) {
+        close(master);
+    }
+    if (slave >= 0) {
+        close(slave);
+    }
+}
+
+bool SimLink::Open()
+{
+    char name[64];
+
+    if (openpty(&master, &slave, name, NULL, NULL) < 0) {
+        perror("openpty");
+        return false;
+    }
+
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    device = name;
+    return true;
+}
+
+
+void SimLink::Start(uint32_t bps)
+{
+    online = true;
+    if (config.bps == 0) {
+        arduinoBps = bps;
+    }
+    Pump();
+}
+
+void SimLink::Stop()
+{
+    Pump();
+    online = false;
+}
+
+int SimLink::Available()
+{
+    Pump();
+    return rxCount;
+}
+
+int SimLink::Read()
+{
+    Pump();
+    if (rxCount == 0) {
+        return -1;
+    }
+    uint8_t c = rxBuf[rxHead];
+    rxHead = (rxHead + 1) % RX_BUFFER_SIZE;
+    --rxCount;
+    return c;
+}
+
+void SimLink::Write(uint8_t c)
+{
+    if (online) {
+        ++stats.fromArduino;
+        Send(fromArduino, fromArduinoFree, c, arduinoBps, GetTimeUS());
+    }
+    // Hold what the sketch writes back from the tty until it stops writing,
+    // so that the host switching the simulator out part way through a frame
+    // cannot leave the program under test with half of it.
+    PumpToArduino(GetTimeUS());
+}
+
+void SimLink::Flush()
+{
+    while ((int32_t)(fromArduinoFree - GetTimeUS()) > 0) {
+        Pump();
+    }
+}
+
+void SimLink::Discard()
+{
+    toArduino.clear();
+    rxHead = 0;
+    rxCount = 0;
+}
+
+void SimLink::Pump()
+{
+    uint32_t now = GetTimeUS();
+
+    if (pumpHook) {
+        pumpHook();
+    }
+    PumpToArduino(now);
+    PumpFromArduino(now);
+}
+
+
+void SimLink::PumpToArduino(uint32_t now)
+{
+    uint8_t buf[256];
+    ssize_t ret = read(master, buf, sizeof(buf));
+    if (ret > 0) {
+        uint32_t bps = GetLininoBps();
+        for (ssize_t i = 0; i < ret; ++i) {
+            ++stats.toArduino;
+            Send(toArduino, toArduinoFree, buf[i], bps, now);
+        }
+    }
+
+    while (!toArduino.empty() && ((int32_t)(now - toArduino.front().due) >= 0)) {
+        Byte b = toArduino.front();
+        toArduino.pop_front();
+        if (!online) {
+            ++stats.offline;
+        } else if (rxCount == RX_BUFFER_SIZE) {
+            ++stats.overruns;
+        } else {
+            rxBuf[(rxHead + rxCount) % RX_BUFFER_SIZE] = Receive(b, arduinoBps);
+            ++rxCount;
+        }
+    }
+}
+
+void SimLink::PumpFromArduino(uint32_t now)
+{
+    uint8_t buf[256];
+
+    // Bytes go to the tty as they come due, and the rest of a burst the tty
+    // has started on goes straight after it, as a UART keeps sending while
+    // the host has the simulator switched out.
+    uint32_t bps = GetLininoBps();
+    size_t len = 0;
+    uint32_t end = burstEnd;
+    while ((len < sizeof(buf)) && (len < fromArduino.size())) {
+        const Byte& b = fromArduino[len];
+        bool due = ((int32_t)(now - b.due) >= 0);
+        bool follows = inBurst && ((b.due - ByteTime(b.bps)) == end);
+        if (!due && !follows) {
+            break;
+        }
+        buf[len] = Receive(b, bps);
+        end = b.due;
+        ++len;
+    }
+    if (len > 0) {
+        // Whatever the tty won't take now stays on the wire for later.
+        ssize_t ret = write(master, buf, len);
+        if (ret > 0) {
+            burstEnd = fromArduino[ret - 1].due;
+            inBurst = true;
+            fromArduino.erase(fromArduino.begin(), fromArduino.begin() + ret);
+        }
+    } else if (fromArduino.empty() && ((int32_t)(now - burstEnd) >= 0)) {
+        inBurst = false;
+    }
+}
+
+
+/*
+ * Get the speed the program under test set on the tty, or 0 if it is not
+ * one the Yun uses.
+ */
+uint32_t SimLink::GetLininoBps() const
+{
+    if (config.bps) {
+        return config.bps;
+    }
+
+    struct termios tio;
+    if (tcgetattr(slave, &tio) == 0) {
+        speed_t speed = cfgetospeed(&tio);
+        for (size_t i = 0; i < TTY_SPEED_COUNT; ++i) {
+            if (TTY_SPEEDS[i].speed == speed) {
+                return TTY_SPEEDS[i].bps;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Put a byte on the wire, unless it gets lost.  Bytes go out one after the
+ * other, so each one starts once the wire is free.
+ */
+void SimLink::Send(std::deque<Byte>& wire, uint32_t& wireFree, uint8_t c, uint32_t bps, uint32_t now)
+{
+    if (Chance(config.dropEvery)) {
+        ++stats.dropped;
+        return;
+    }
+    if (Chance(config.flipEvery)) {
+        c ^= 1 << (rand_r(&config.seed) % 8);
+        ++stats.flipped;
+    }
+
+    uint32_t start = ((int32_t)(wireFree - now) > 0) ? wireFree : now;
+    wireFree = start + ByteTime(bps);
+
+    Byte b;
+    b.due = wireFree + config.latency;
+    b.bps = bps;
+    b.c = c;
+    wire.push_back(b);
+}
+
+/*
+ * Take a byte off the wire at the receiver's speed.  A receiver at the wrong
+ * speed sees some other byte.  A speed of 0 means not known, which is taken
+ * to match anything.
+ */
+uint8_t SimLink::Receive(const Byte& b, uint32_t bps)
+{
+    if (b.bps && bps && (b.bps != bps)) {
+        ++stats.garbled;
+        return b.c ^ (1 + (rand_r(&config.seed) % 0xff));
+    }
+    return b.c;
+}
+
+bool SimLink::Chance(uint32_t every)
+{
+    return every && ((rand_r(&config.seed) % every) == 0);
+}
@@ -0,0 +1,167 @@
+/**
+ * @file
+ * Simulated serial link between a program using SMsg or SPICom and the
+ * Arduino side libraries, on a pseudo-terminal pair.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _SIMLINK_H_
+#define _SIMLINK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <string>
+
+/*
+ * The program under test opens the pty slave as if it were the real tty and
+ * the simulator plays the Arduino on the master.  Bytes written by either
+ * side go onto a simulated wire where they take 10 bit times each at the
+ * link speed plus any added latency, and may be dropped or have a bit
+ * flipped on the way.  Bytes sent at one speed and received at another come
+ * out garbled.  Bytes reaching the Arduino go into a receive buffer the
+ * size of the real one, and bytes arriving while it is full are lost, as on
+ * a sketch that falls behind.
+ */
+class SimLink {
+  public:
+    static const uint16_t RX_BUFFER_SIZE = 64;
+    static const uint32_t MAX_TIME_STEP = 100;
+
+    struct Config {
+        uint32_t bps;           // wire speed, 0 to follow what each end sets
+        uint32_t dropEvery;     // drop 1 byte in this many, 0 for never
+        uint32_t flipEvery;     // flip a bit in 1 byte in this many, 0 never
+        uint32_t latency;       // microseconds added to every byte
+        unsigned int seed;      // for the fault injection
+
+        Config() : bps(0), dropEvery(0), flipEvery(0), latency(0), seed(1) { }
+    };
+
+    struct Stats {
+        uint32_t toArduino;     // bytes written by the program under test
+        uint32_t fromArduino;   // bytes written by the Arduino side
+        uint32_t dropped;
+        uint32_t flipped;
+        uint32_t garbled;       // received at a different speed than sent
+        uint32_t overruns;      // lost to a full Arduino receive buffer
+        uint32_t offline;       // arrived while the Arduino port was closed
+
+        Stats();
+        void Print(FILE* out) const;
+    };
+
+    SimLink(const Config& config);
+    ~SimLink();
+
+    /*
+     * Simulated time in microseconds.  It follows the monotonic clock but
+     * skips any stretch longer than MAX_TIME_STEP between two readings, when
+     * the host had the simulator switched out, so that the Arduino side's
+     * byte timeouts behave as on a dedicated microcontroller.
+     */
+    static uint64_t GetTime();
+
+    /*
+     * Create the pty pair.
+     *
+     * @return  true on success, false otherwise
+     */
+    bool Open();
+
+    /*
+     * Get the tty for the program under test to open.
+     */
+    const char* GetDevice() const { return device.c_str(); }
+
+    const Stats& GetStats() const { return stats; }
+
+    /*
+     * Have Pump() call hook each time, e.g. to notice that the simulation
+     * should end while the Arduino side is busy waiting for input.
+     */
+    void SetPumpHook(void (*hook)(void)) { pumpHook = hook; }
+
+    /*
+     * The Arduino side of the link, used by the serial ports of the Arduino
+     * core stand-in.  Start() opens the port at bps (ignored if the wire has
+     * a fixed speed) and Stop() closes it.
+     */
+    void Start(uint32_t bps);
+    void Stop();
+    int Available();
+    int Read();
+    void Write(uint8_t c);
+
+    /*
+     * Wait for everything the Arduino side wrote to get onto the wire.
+     */
+    void Flush();
+
+    /*
+     * Lose everything on its way to the Arduino side, as when it resets.
+     */
+    void Discard();
+
+    /*
+     * Move bytes along the wire as they come due.  All of the Arduino side
+     * calls other than Write() do this.  Call it while idle too.
+     */
+    void Pump();
+
+  private:
+    struct Byte {
+        uint32_t due;           // when the last bit arrives
+        uint32_t bps;           // speed it was sent at
+        uint8_t c;
+    };
+
+    Config config;
+    Stats stats;
+    std::string device;
+    int master;
+    int slave;                  // so the master outlives the program closing it
+    void (*pumpHook)(void);
+
+    bool online;                // the Arduino port is open
+    uint32_t arduinoBps;
+
+    std::deque<Byte> toArduino;
+    std::deque<Byte> fromArduino;
+    uint32_t toArduinoFree;     // when the wire is free for the next byte
+    uint32_t fromArduinoFree;
+    bool inBurst;               // the tty is partway through an Arduino burst
+    uint32_t burstEnd;          // when the last byte given to the tty was due
+
+    uint8_t rxBuf[RX_BUFFER_SIZE];
+    uint16_t rxHead;
+    uint16_t rxCount;
+
+    void PumpToArduino(uint32_t now);
+    void PumpFromArduino(uint32_t now);
+    uint32_t GetLininoBps() const;
+    void Send(std::deque<Byte>& wire, uint32_t& wireFree, uint8_t c, uint32_t bps, uint32_t now);
+    uint8_t Receive(const Byte& b, uint32_t bps);
+    bool Chance(uint32_t every);
+
+    SimLink(const SimLink& other);
+    SimLink& operator=(const SimLink& other);
+};
+
+#endif
@@ -0,0 +1,43 @@
+/**
+ * @file
+ * Microsecond clock shared by the Linino side libraries and tools.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Get the monotonic clock in microseconds.  The value wraps around about
+ * every 71 minutes, so only differences between readings, taken as
+ * uint32_t, mean anything.  The seconds are cut to 32 bits before they are
+ * scaled since tv_sec * 1000000 overflows where time_t is 32 bits.
+ *
+ * @return  The current time in microseconds.
+ */
+inline uint32_t GetTimeUS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint32_t)ts.tv_sec * 1000000) + ((uint32_t)ts.tv_nsec / 1000);
+}
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * @file
+ * Fixed size log-linear histogram for latency measurements.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Histogram of 32 bit values in the style of HdrHistogram.  Values below
+ * SUB_BUCKETS are counted exactly.  Above that, each power of two range is
+ * split into SUB_BUCKETS buckets, so any value is known to within 1 part in
+ * SUB_BUCKETS (about 6%) no matter how large it is.  Recording is a few
+ * shifts and an increment, and the whole thing is a fixed 1.8 KB with no
+ * allocation.
+ */
+class Histogram {
+  public:
+    static const uint8_t SUB_BUCKET_BITS = 4;
+    static const uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const uint32_t BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    Histogram() { Reset(); }
+
+    void Reset()
+    {
+        memset(counts, 0, sizeof(counts));
+        count = 0;
+        total = 0;
+        min = 0xffffffff;
+        max = 0;
+    }
+
+    void Record(uint32_t value)
+    {
+        ++counts[BucketOf(value)];
+        ++count;
+        total += value;
+        if (value < min) {
+            min = value;
+        }
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    /**
+     * Add the counts from another histogram to this one.
+     */
+    void Add(const Histogram& other)
+    {
+        for (uint32_t i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        count += other.count;
+        total += other.total;
+        if (other.min < min) {
+            min = other.min;
+        }
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    uint32_t GetCount() const { return count; }
+    uint32_t GetMin() const { return count ? min : 0; }
+    uint32_t GetMax() const { return max; }
+    uint32_t GetMean() const { return count ? (uint32_t)(total / count) : 0; }
+
+    /**
+     * Get the value at a percentile.
+     *
+     * @param percentile    0.0 to 100.0
+     *
+     * @return  The highest value that falls in the same bucket as the value
+     *          at the percentile (capped at the largest value recorded), or
+     *          0 if nothing has been recorded.
+     */
+    uint32_t GetPercentile(double percentile) const
+    {
+        if (count == 0) {
+            return 0;
+        }
+
+        uint64_t want = (uint64_t)((percentile / 100.0) * count + 0.5);
+        if (want < 1) {
+            want = 1;
+        }
+
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= want) {
+                uint32_t top = (i + 1 < BUCKETS) ? (LowestOf(i + 1) - 1) : 0xffffffff;
+                return (top < max) ? top : max;
+            }
+        }
+        return max;
+    }
+
+    /**
+     * Print a one line summary.
+     *
+     * @param out   Where to print it.
+     * @param name  What the values are.
+     */
+    void Print(FILE* out, const char* name) const
+    {
+        fprintf(out, "%s: n %u min %u p50 %u p90 %u p99 %u p99.9 %u max %u mean %u\n",
+                name, count, GetMin(), GetPercentile(50.0), GetPercentile(90.0),
+                GetPercentile(99.0), GetPercentile(99.9), max, GetMean());
+    }
+
+    static uint32_t BucketOf(uint32_t value)
+    {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        uint32_t msb = 31 - __builtin_clz(value);
+        uint32_t shift = msb - SUB_BUCKET_BITS;
+        return ((shift + 1) << SUB_BUCKET_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint32_t LowestOf(uint32_t bucket)
+    {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        uint32_t shift = (bucket >> SUB_BUCKET_BITS) - 1;
+        return (SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    }
+
+  private:
+    uint32_t counts[BUCKETS];
+    uint32_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+};
+
+#endif
@@ -0,0 +1,364 @@
+/**
+ * @file
+ * Throughput and latency benchmark for links with the SMsg/SPICom interface.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _LINKBENCH_H_
+#define _LINKBENCH_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <aj_tutorial/clock.h>
+#include <aj_tutorial/histogram.h>
+
+/**
+ * Benchmark for a link to a sketch that sends every message straight back
+ * with its bytes inverted, such as the smsgtest and spicomtest sketches or
+ * the link simulator (linksim).  For each payload size it measures:
+ *
+ *   - round trip latency: one message out and its echo back, one at a time
+ *   - throughput: messages streamed with up to depth echoes outstanding,
+ *     giving frames per second and goodput (payload bytes per second each
+ *     way)
+ *
+ * Echoes that do not come back within the timeout or do not match what was
+ * sent count as lost.  Results go out as a text table, CSV or JSON, one
+ * record per payload size.
+ *
+ * Link needs the non-blocking interface LinkEndpoint uses (TryRead(),
+ * RxBuffered(), TxPending() and GetFD()) plus Write() and WriteAsync().
+ */
+template <class Link>
+class LinkBench {
+  public:
+    enum Format {
+        FORMAT_TEXT,
+        FORMAT_CSV,
+        FORMAT_JSON
+    };
+
+    struct Config {
+        uint16_t minLen;
+        uint16_t maxLen;
+        uint32_t count;         // round trips and streamed messages per size
+        uint8_t depth;          // echoes outstanding while streaming
+        uint32_t timeout;       // microseconds to wait for an echo
+        Format format;
+
+        Config() : minLen(1), maxLen(Link::MAX_MSG_LEN), count(500), depth(4),
+            timeout(200000), format(FORMAT_TEXT) { }
+    };
+
+    struct Result {
+        uint16_t len;
+        Histogram rtt;          // microseconds
+        uint32_t rttLost;
+        uint32_t frames;        // echoes received while streaming
+        uint32_t lost;          // echoes missing or wrong while streaming
+        uint32_t elapsed;       // microseconds spent streaming
+
+        double FramesPerSec() const { return elapsed ? (frames * 1000000.0) / elapsed : 0; }
+        double Goodput() const { return FramesPerSec() * len; }
+    };
+
+    LinkBench(Link& link, const Config& config) :
+        link(link), config(config), txBuf(config.maxLen), rxBuf(config.maxLen), txSeq(0), rxSeq(0)
+    {
+    }
+
+    /**
+     * Run every payload size and print the results.
+     *
+     * @param out   Where to print them.
+     * @param name  Name of the link, for the output.
+     *
+     * @return  Number of lost echoes.
+     */
+    uint32_t Run(FILE* out, const char* name)
+    {
+        uint32_t lost = 0;
+        PrintHeader(out);
+        for (uint16_t len = config.minLen; len <= config.maxLen; ++len) {
+            Result result;
+            result.len = len;
+            Measure(result);
+            PrintResult(out, name, result, len == config.maxLen);
+            lost += result.rttLost + result.lost;
+        }
+        PrintFooter(out);
+        return lost;
+    }
+
+    /**
+     * Parse the options shared by every link's benchmark program.
+     *
+     * @param opt       Option letter from getopt().
+     * @param arg       Its argument.
+     * @param config    Config to update.
+     *
+     * @return  true if the option was one of them, false otherwise
+     */
+    static bool ParseOption(int opt, const char* arg, Config& config)
+    {
+        switch (opt) {
+        case 's': config.minLen = atoi(arg); break;
+        case 'S': config.maxLen = atoi(arg); break;
+        case 'n': config.count = strtoul(arg, NULL, 0); break;
+        case 'd': config.depth = atoi(arg); break;
+        case 't': config.timeout = strtoul(arg, NULL, 0) * 1000; break;
+        case 'o':
+            if (strcmp(arg, "csv") == 0) {
+                config.format = FORMAT_CSV;
+            } else if (strcmp(arg, "json") == 0) {
+                config.format = FORMAT_JSON;
+            } else if (strcmp(arg, "text") == 0) {
+                config.format = FORMAT_TEXT;
+            } else {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    static const char* OPTIONS;
+
+    /**
+     * Print the options ParseOption() takes.
+     *
+     * @param out       Where to print them.
+     * @param config    Defaults to show.
+     */
+    static void PrintOptions(FILE* out, const Config& config)
+    {
+        fprintf(out,
+                "  -s LEN          smallest payload (default %u)\n"
+                "  -S LEN          largest payload (default %u)\n"
+                "  -n COUNT        round trips and streamed messages per size (default %u)\n"
+                "  -d DEPTH        echoes outstanding while streaming (default %u)\n"
+                "  -t MS           time to wait for an echo (default %u)\n"
+                "  -o FORMAT       text, csv or json (default text)\n",
+                config.minLen, config.maxLen, config.count, config.depth,
+                config.timeout / 1000);
+    }
+
+  private:
+    Link& link;
+    Config config;
+    std::vector<uint8_t> txBuf;
+    std::vector<uint8_t> rxBuf;
+    uint32_t txSeq;             // next message to send
+    uint32_t rxSeq;             // next echo expected
+
+    /*
+     * Each message carries its sequence number in every byte, so stale or
+     * out of order echoes do not pass for the one expected.
+     */
+    static uint8_t Pattern(uint32_t seq, uint16_t i)
+    {
+        return (uint8_t)((seq * 31) + (i * 7) + (seq >> 8));
+    }
+
+    void Fill(uint16_t len)
+    {
+        for (uint16_t i = 0; i < len; ++i) {
+            txBuf[i] = Pattern(txSeq, i);
+        }
+        ++txSeq;
+    }
+
+    bool Matches(int ret, uint16_t len)
+    {
+        bool ok = (ret == len);
+        for (uint16_t i = 0; ok && (i < len); ++i) {
+            ok = (rxBuf[i] == (uint8_t)~Pattern(rxSeq, i));
+        }
+        ++rxSeq;
+        return ok;
+    }
+
+    /*
+     * Read a message, waiting at most timeout microseconds for it.
+     *
+     * @return  The number of bytes read, 0 on timeout or -1 on error.
+     */
+    int ReadTimed(uint32_t timeout)
+    {
+        uint32_t start = GetTimeUS();
+        while (true) {
+            int ret = link.TryRead(&rxBuf[0], rxBuf.size());
+            if (ret != 0) {
+                return ret;
+            }
+            uint32_t waited = GetTimeUS() - start;
+            if (waited >= timeout) {
+                return 0;
+            }
+            if (link.RxBuffered()) {
+                continue;
+            }
+
+            // Queued output only moves when the link is polled.
+            uint32_t wait = timeout - waited;
+            if (link.TxPending() && (wait > 1000)) {
+                wait = 1000;
+            }
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(link.GetFD(), &rfds);
+            struct timeval to = { wait / 1000000, wait % 1000000 };
+            if ((select(link.GetFD() + 1, &rfds, NULL, NULL, &to) < 0) && (errno != EINTR)) {
+                return -1;
+            }
+        }
+    }
+
+    /*
+     * Throw away echoes still on their way from an earlier run.
+     */
+    void Drain()
+    {
+        while (ReadTimed(config.timeout / 4) > 0) {
+        }
+        rxSeq = txSeq;
+    }
+
+    void Measure(Result& result)
+    {
+        uint16_t len = result.len;
+
+        Drain();
+        result.rttLost = 0;
+        for (uint32_t i = 0; i < config.count; ++i) {
+            Fill(len);
+            uint32_t start = GetTimeUS();
+            int ret = link.Write(&txBuf[0], len);
+            if (ret == len) {
+                ret = ReadTimed(config.timeout);
+            }
+            uint32_t end = GetTimeUS();
+            if (Matches(ret, len)) {
+                result.rtt.Record(end - start);
+            } else {
+                ++result.rttLost;
+                Drain();
+            }
+        }
+
+        Drain();
+        result.frames = 0;
+        result.lost = 0;
+        uint32_t start = GetTimeUS();
+        uint32_t sent = 0;
+        while ((sent < config.count) || (rxSeq != txSeq)) {
+            if ((sent < config.count) && ((txSeq - rxSeq) < config.depth)) {
+                Fill(len);
+                ++sent;
+                if (link.WriteAsync(&txBuf[0], len) != len) {
+                    // Never sent, so never echoed.
+                    --txSeq;
+                    ++result.lost;
+                }
+                continue;
+            }
+
+            int ret = ReadTimed(config.timeout);
+            if ((ret != 0) && Matches(ret, len)) {
+                ++result.frames;
+            } else {
+                // Whatever was outstanding is gone or out of step.
+                result.lost += txSeq - rxSeq + ((ret != 0) ? 1 : 0);
+                Drain();
+            }
+        }
+        result.elapsed = GetTimeUS() - start;
+    }
+
+    void PrintHeader(FILE* out) const
+    {
+        switch (config.format) {
+        case FORMAT_TEXT:
+            fprintf(out, "%-6s %5s %9s %11s %8s %8s %8s %8s %8s %6s\n",
+                    "link", "len", "frames/s", "goodput B/s", "rtt p50", "p99", "p99.9",
+                    "max", "mean", "lost");
+            break;
+        case FORMAT_CSV:
+            fprintf(out, "link,len,frames,lost,frames_per_s,goodput_bytes_per_s,"
+                    "rtt_count,rtt_lost,rtt_min_us,rtt_p50_us,rtt_p99_us,rtt_p999_us,"
+                    "rtt_max_us,rtt_mean_us\n");
+            break;
+        case FORMAT_JSON:
+            fprintf(out, "[\n");
+            break;
+        }
+    }
+
+    void PrintResult(FILE* out, const char* name, const Result& r, bool last) const
+    {
+        const Histogram& h = r.rtt;
+        switch (config.format) {
+        case FORMAT_TEXT:
+            fprintf(out, "%-6s %5u %9.0f %11.0f %8u %8u %8u %8u %8u %6u\n",
+                    name, r.len, r.FramesPerSec(), r.Goodput(), h.GetPercentile(50.0),
+                    h.GetPercentile(99.0), h.GetPercentile(99.9), h.GetMax(), h.GetMean(),
+                    r.rttLost + r.lost);
+            break;
+        case FORMAT_CSV:
+            fprintf(out, "%s,%u,%u,%u,%.1f,%.1f,%u,%u,%u,%u,%u,%u,%u,%u\n",
+                    name, r.len, r.frames, r.lost, r.FramesPerSec(), r.Goodput(),
+                    h.GetCount(), r.rttLost, h.GetMin(), h.GetPercentile(50.0),
+                    h.GetPercentile(99.0), h.GetPercentile(99.9), h.GetMax(), h.GetMean());
+            break;
+        case FORMAT_JSON:
+            fprintf(out, "  {\"link\": \"%s\", \"len\": %u, \"frames\": %u, \"lost\": %u, "
+                    "\"frames_per_s\": %.1f, \"goodput_bytes_per_s\": %.1f, "
+                    "\"rtt_us\": {\"count\": %u, \"lost\": %u, \"min\": %u, \"p50\": %u, "
+                    "\"p99\": %u, \"p999\": %u, \"max\": %u, \"mean\": %u}}%s\n",
+                    name, r.len, r.frames, r.lost, r.FramesPerSec(), r.Goodput(),
+                    h.GetCount(), r.rttLost, h.GetMin(), h.GetPercentile(50.0),
+                    h.GetPercentile(99.0), h.GetPercentile(99.9), h.GetMax(), h.GetMean(),
+                    last ? "" : ",");
+            break;
+        }
+        fflush(out);
+    }
+
+    void PrintFooter(FILE* out) const
+    {
+        if (config.format == FORMAT_JSON) {
+            fprintf(out, "]\n");
+        }
+    }
+};
+
+template <class Link>
+const char* LinkBench<Link>::OPTIONS = "s:S:n:d:t:o:";
+
+#endif
@@ -0,0 +1,285 @@
+/**
+ * @file
+ * Runs an SMsg or SPICom link on an I/O thread of its own that other threads
+ * hand messages to.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _LINKTHREAD_H_
+#define _LINKTHREAD_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aj_tutorial/reactor.h>
+
+/**
+ * Queue that any number of threads add to and a single thread empties.
+ * Adding takes no lock and never blocks.  The file descriptor becomes
+ * readable when something is added to an empty queue, so the consumer can
+ * wait on it with the rest of its I/O.
+ */
+class SubmitQueue {
+  public:
+    struct Node {
+        Node* next;
+    };
+
+    SubmitQueue();
+    ~SubmitQueue();
+
+    int GetFD() const { return wakeFD[0]; }
+
+    /**
+     * Add a node.  May be called from any thread.
+     */
+    void Push(Node* node);
+
+    /**
+     * Take everything added so far.  Only the consumer may call this.
+     *
+     * @return  The oldest node, linked through next to the newest, or NULL
+     *          if the queue is empty.
+     */
+    Node* TakeAll();
+
+  private:
+    Node* volatile top;         // newest first
+    int wakeFD[2];
+};
+
+
+/**
+ * Told how a message given to LinkThread::Submit() turned out.  Called on
+ * the link's thread, so it must not block.
+ */
+class SubmitListener {
+  public:
+    virtual ~SubmitListener() { }
+
+    /**
+     * @param status    Number of bytes the link queued, or -1 if it failed
+     *                  or the thread was stopped first.
+     * @param context   The context passed to Submit().
+     */
+    virtual void SubmitDone(int status, void* context) = 0;
+};
+
+/**
+ * Result of one Submit() for a caller that wants to wait for it.
+ */
+class SubmitFuture : public SubmitListener {
+  public:
+    SubmitFuture();
+    ~SubmitFuture();
+
+    /**
+     * Wait for the message to be handled.
+     *
+     * @return  The status SubmitDone() was given.
+     */
+    int Get();
+
+    void SubmitDone(int status, void* context);
+
+  private:
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int status;
+};
+
+
+/**
+ * Runs a link (SMsg or SPICom) on a thread of its own.  The thread owns the
+ * link: it reads it, hands received messages to a FrameListener and writes
+ * out the messages other threads Submit().  Any number of threads may call
+ * Submit() at once, including from within the listeners.  Messages from one
+ * thread go out in the order they were submitted.  While the thread runs,
+ * nothing else should read the link.
+ */
+template <class Link>
+class LinkThread : private Reactor::Endpoint {
+  public:
+    LinkThread(Link& link, FrameListener& listener) :
+        endpoint(link, listener), backlog(NULL), running(false), stopping(false) { }
+
+    /**
+     * Stop the thread.  Messages not yet handed to the link fail.
+     */
+    ~LinkThread()
+    {
+        Stop();
+    }
+
+    /**
+     * Start the thread.
+     *
+     * @return  true if started, false otherwise
+     */
+    bool Start()
+    {
+        if (running || (queue.GetFD() < 0)) {
+            return false;
+        }
+        if (!reactor.Add(endpoint)) {
+            return false;
+        }
+        if (!reactor.Add(*this)) {
+            reactor.Remove(endpoint);
+            return false;
+        }
+        stopping = false;
+        if (pthread_create(&thread, NULL, &LinkThread::Run, this) != 0) {
+            reactor.Remove(*this);
+            reactor.Remove(endpoint);
+            return false;
+        }
+        running = true;
+        return true;
+    }
+
+    /**
+     * Stop the thread and wait for it to finish.  Messages it has not yet
+     * handed to the link fail.  Nothing may be submitted once this has been
+     * called.
+     */
+    void Stop()
+    {
+        if (running) {
+            stopping = true;
+            reactor.Stop();
+            pthread_join(thread, NULL);
+            running = false;
+            reactor.Remove(*this);
+            reactor.Remove(endpoint);
+        }
+        Fail(backlog);
+        backlog = NULL;
+        Fail(queue.TakeAll());
+    }
+
+    /**
+     * Queue a message for the thread to write to the link.  Never blocks.
+     *
+     * @param buf       The message payload, copied before returning.
+     * @param len       Size of the payload, 1 to Link::MAX_MSG_LEN.
+     * @param listener  Told on the link's thread once the link has queued
+     *                  the message or failed it, or NULL.
+     * @param context   Passed back to the listener.
+     *
+     * @return  true if submitted, false if len is out of range.
+     */
+    bool Submit(const uint8_t* buf, uint8_t len, SubmitListener* listener = NULL, void* context = NULL)
+    {
+        if ((len < 1) || (len > Link::MAX_MSG_LEN)) {
+            return false;
+        }
+        Submission* sub = new Submission;
+        sub->listener = listener;
+        sub->context = context;
+        sub->len = len;
+        memcpy(sub->data, buf, len);
+        queue.Push(sub);
+        return true;
+    }
+
+  private:
+    struct Submission : public SubmitQueue::Node {
+        SubmitListener* listener;
+        void* context;
+        uint8_t len;
+        uint8_t data[Link::MAX_MSG_LEN];
+    };
+
+    Reactor reactor;
+    LinkEndpoint<Link> endpoint;
+    SubmitQueue queue;
+    SubmitQueue::Node* backlog; // taken from the queue, waiting for room
+    pthread_t thread;
+    bool running;
+    volatile bool stopping;
+
+    static void* Run(void* arg)
+    {
+        LinkThread* lt = reinterpret_cast<LinkThread*>(arg);
+        while (!lt->stopping) {
+            if (lt->reactor.RunOnce() < 0) {
+                break;
+            }
+        }
+        return NULL;
+    }
+
+    // The queue is serviced as a reactor endpoint of its own, so it is
+    // waited on along with the link.
+    int GetFD() const { return queue.GetFD(); }
+    bool TxPending() const { return backlog != NULL; }
+
+    void Readable()
+    {
+        SubmitQueue::Node* taken = queue.TakeAll();
+        if (!backlog) {
+            backlog = taken;
+        } else if (taken) {
+            SubmitQueue::Node* last = backlog;
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = taken;
+        }
+        Writable();
+    }
+
+    /*
+     * Hand the backlog to the link until its transmit queue is full.  The
+     * reactor calls this again on every pass while anything is left.
+     */
+    void Writable()
+    {
+        while (backlog) {
+            Submission* sub = static_cast<Submission*>(backlog);
+            int ret = endpoint.GetLink().TryWrite(sub->data, sub->len);
+            if (ret == 0) {
+                break;
+            }
+            backlog = sub->next;
+            Complete(sub, ret);
+        }
+    }
+
+    static void Complete(Submission* sub, int status)
+    {
+        if (sub->listener) {
+            sub->listener->SubmitDone(status, sub->context);
+        }
+        delete sub;
+    }
+
+    static void Fail(SubmitQueue::Node* node)
+    {
+        while (node) {
+            SubmitQueue::Node* next = node->next;
+            Complete(static_cast<Submission*>(node), -1);
+            node = next;
+        }
+    }
+};
+
+#endif
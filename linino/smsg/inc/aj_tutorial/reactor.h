@@ -0,0 +1,152 @@
+/**
+ * @file
+ * Single threaded epoll based I/O multiplexer for the Arduino Yun links.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+class Reactor {
+  public:
+    /**
+     * Something with a file descriptor that the reactor services.  None of
+     * these methods may block.
+     */
+    class Endpoint {
+      public:
+        virtual ~Endpoint() { }
+
+        virtual int GetFD() const = 0;
+
+        /**
+         * Called when the file descriptor is readable or RxBuffered() is
+         * true.  Should drain everything that can be had without blocking.
+         */
+        virtual void Readable() = 0;
+
+        /**
+         * Called on every pass while TxPending() is true so that queued
+         * output keeps moving as flow control credits come back.
+         */
+        virtual void Writable() { }
+
+        /**
+         * Input that has already been pulled off the file descriptor does
+         * not wake up epoll.  Return true while there is any.
+         */
+        virtual bool RxBuffered() const { return false; }
+
+        virtual bool TxPending() const { return false; }
+    };
+
+    Reactor();
+    ~Reactor();
+
+    /**
+     * Start servicing an endpoint.  The endpoint must stay valid until it is
+     * removed or the reactor is destroyed.  Endpoints may share a file
+     * descriptor; all of them get Readable() calls when it has input.
+     *
+     * @return  true if added, false otherwise
+     */
+    bool Add(Endpoint& ep);
+
+    /**
+     * Stop servicing an endpoint.  Safe to call from within a callback.
+     *
+     * @return  true if removed, false otherwise
+     */
+    bool Remove(Endpoint& ep);
+
+    /**
+     * Wait for and dispatch one round of I/O.
+     *
+     * @param timeout   Longest time to wait in ms, or -1 to wait forever.
+     *
+     * @return  Number of ready file descriptors or -1 on error.
+     */
+    int RunOnce(int timeout = -1);
+
+    /**
+     * Dispatch I/O until Stop() is called.
+     */
+    void Run();
+
+    /**
+     * Make Run() return.  May be called from any thread.
+     */
+    void Stop();
+
+  private:
+    int epfd;
+    int wakeFD[2];
+    volatile bool done;
+    std::vector<Endpoint*> endpoints;
+
+    bool Contains(Endpoint* ep) const;
+    bool HasFD(int fd) const;
+};
+
+
+/**
+ * Receives complete messages from a LinkEndpoint.
+ */
+class FrameListener {
+  public:
+    virtual ~FrameListener() { }
+
+    virtual void FrameReceived(Reactor::Endpoint& ep, const uint8_t* buf, int len) = 0;
+};
+
+/**
+ * Adapts any link with the SMsg/SPICom non-blocking interface (TryRead(),
+ * TryFlush(), RxBuffered(), TxPending() and GetFD()) to the reactor.
+ */
+template <class Link>
+class LinkEndpoint : public Reactor::Endpoint {
+  public:
+    LinkEndpoint(Link& link, FrameListener& listener) : link(link), listener(listener) { }
+
+    Link& GetLink() { return link; }
+
+    int GetFD() const { return link.GetFD(); }
+    bool RxBuffered() const { return link.RxBuffered(); }
+    bool TxPending() const { return link.TxPending(); }
+
+    void Readable()
+    {
+        uint8_t buf[Link::MAX_MSG_LEN];
+        int ret;
+        while ((ret = link.TryRead(buf, sizeof(buf))) > 0) {
+            listener.FrameReceived(*this, buf, ret);
+        }
+    }
+
+    void Writable() { link.TryFlush(); }
+
+  private:
+    Link& link;
+    FrameListener& listener;
+};
+
+#endif
@@ -22,33 +22,345 @@
 #ifndef _SMSG_H_
 #define _SMSG_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
+#include <aj_tutorial/histogram.h>
+
+class SMsgLink;
+
+/**
+ * One channel on the serial link to the Arduino.  Every SMsg in the process
+ * shares a single file descriptor for the tty, and each channel only sees
+ * its own messages, so Display, Joystick and friends can all be used at
+ * once.
+ */
 class SMsg {
   public:
     static const uint8_t MAX_MSG_LEN = 31;
+    static const uint8_t MAX_CHANNELS = 16;
+
+    /*
+     * Messages longer than MAX_MSG_LEN are split into fragments and put back
+     * together on the other side, up to this size, if the Arduino side
+     * supports it.  See GetMaxMsgLen().
+     */
+    static const uint16_t MAX_LARGE_MSG_LEN = 4096;
+
+    /*
+     * Serial link speeds in bits per second.  The link always opens at
+     * BAUD_BASE and then steps up, one supported rate at a time, as far as
+     * both sides can go without errors.
+     */
+    static const uint32_t BAUD_BASE = 250000;
+    static const uint32_t BAUD_MAX = 1000000;
+
+    /*
+     * Well known channels.  Sketches use the same numbers.
+     */
+    static const uint8_t CHANNEL_DEFAULT = 0;
+    static const uint8_t CHANNEL_DISPLAY = 1;
+    static const uint8_t CHANNEL_JOYSTICK = 2;
+
+    /*
+     * Transmit priorities, see SetPriority().
+     */
+    enum Priority {
+        PRIORITY_BULK,
+        PRIORITY_URGENT,
+        PRIORITY_COUNT
+    };
+
+    /**
+     * Counters for the whole link, shared by every channel on the tty.  They
+     * count from when the tty was opened or from the last ResetStats().
+     */
+    struct Stats {
+        uint32_t txFrames;
+        uint32_t txBytes;           // including framing
+        uint32_t txCoalesced;       // messages sent sharing a frame
+        uint32_t txPacked;          // frames sent compressed
+        uint32_t txPackSaved;       // bytes compression saved
+        uint32_t rxFrames;          // frames with a good checksum
+        uint32_t rxBytes;           // everything read from the tty
+        uint32_t rxCoalesced;       // messages received sharing a frame
+        uint32_t rxChecksumErrors;
+        uint32_t rxLengthErrors;    // length bytes too big to be a frame
+        uint32_t rxTimeouts;        // frames cut off by the inter-byte timeout
+        uint32_t rxDropped;         // messages lost to a full queue, a short
+                                    // read buffer or a broken fragment run
+        uint32_t creditTimeouts;    // credits assumed back after CREDIT_TO
+        uint32_t syncs;             // sync handshakes completed
+        uint32_t reconnects;        // times the link was opened again after
+                                    // losing the Arduino
+        uint32_t resyncs;           // times the parser went back over the
+                                    // bytes of a bad frame
+        uint32_t flushedBytes;      // bytes thrown away to get back in step
+
+        /*
+         * Microseconds from a frame being handed to the tty to the Arduino
+         * returning the credits for it, which it does once the sketch has
+         * read the frame.
+         */
+        Histogram ackLatency;
+
+        /*
+         * Microseconds between good frames arriving.  Frames picked up by the
+         * same read count as arriving together.
+         */
+        Histogram rxGap;
+
+        Stats() { Reset(); }
+        void Reset();
 
-    SMsg();
+        /**
+         * Print the counters and histograms, a few lines of text.
+         *
+         * @param out   Where to print them.
+         */
+        void Print(FILE* out) const;
+    };
+
+    /**
+     * Open a channel, opening the tty as well if this is the first channel
+     * in use.
+     *
+     * @param channel   Channel number, 0 to MAX_CHANNELS - 1.
+     * @param maxBaud   Fastest link speed to try, in bits per second.  Only
+     *                  the SMsg that opens the tty gets to set this.  Use
+     *                  BAUD_BASE to stay at the base rate.
+     */
+    SMsg(uint8_t channel = CHANNEL_DEFAULT, uint32_t maxBaud = BAUD_MAX);
     ~SMsg();
 
     /**
-     * Read a message from the Arduino side of the SPI bus.
+     * Read a message from the Arduino side of the SPI bus.  Messages keep
+     * coming in while nobody reads the channel, and once its receive queue
+     * is full the oldest are dropped.  The read that gets to where they
+     * were returns -1.
      *
      * @param[out] buf  Pointer to a buffer to store the message payload.
      * @param[in]  len  Size of the buffer for storing the message payload.
      *
      * @return  The actual number of bytes read or -1 on error.
      */
-    int Read(uint8_t* buf, uint8_t len);
+    int Read(uint8_t* buf, uint16_t len);
 
     /**
-     * Send a message to the Arduino side of the SPI bus.
+     * Send a message to the Arduino side of the SPI bus.  This blocks until
+     * the message has been handed to the tty.  Messages longer than
+     * MAX_MSG_LEN go out as a series of fragments.
      *
      * @param buf   Pointer to a buffer with the message payload to send.
      * @param len   Size of the message payload to send.
      *
      * @return  The actual number of bytes sent or -1 on error.
      */
-    int Write(const uint8_t* buf, uint8_t len);
+    int Write(const uint8_t* buf, uint16_t len);
+
+    /**
+     * Send a message gathered from several buffers to the Arduino side of
+     * the SPI bus.  The pieces are framed straight into the transmit queue
+     * and the whole frame goes to the tty in one system call.  This blocks
+     * until the message has been handed to the tty.
+     *
+     * @param iov       Array of buffers making up the message payload.
+     * @param iovcnt    Number of entries in iov.
+     *
+     * @return  The actual number of bytes sent or -1 on error.
+     */
+    int WriteV(const struct iovec* iov, int iovcnt);
+
+    /**
+     * Queue a message for the Arduino side and return without waiting for
+     * it to go out.  Queued messages are sent back-to-back as fast as the
+     * Arduino hands back receive buffer credits.  This only blocks if the
+     * transmit queue is full, which a message longer than MAX_MSG_LEN may
+     * well fill.
+     *
+     * @param buf   Pointer to a buffer with the message payload to send.
+     * @param len   Size of the message payload to send.
+     *
+     * @return  The number of bytes queued or -1 on error.
+     */
+    int WriteAsync(const uint8_t* buf, uint16_t len);
+
+    /**
+     * Read a message if one can be had without blocking.  Pairs with
+     * select()/epoll() on GetFD().
+     *
+     * @param[out] buf  Pointer to a buffer to store the message payload.
+     * @param[in]  len  Size of the buffer for storing the message payload.
+     *
+     * @return  The actual number of bytes read, 0 if no complete message is
+     *          available yet, or -1 on error.
+     */
+    int TryRead(uint8_t* buf, uint16_t len);
+
+    /**
+     * Queue a message if there is room in the transmit queue without
+     * blocking.  Queued messages go out as the Arduino returns credits;
+     * call TryFlush() (or Read()/TryRead()) to keep them moving.  Messages
+     * longer than MAX_MSG_LEN can only be sent with Write(), WriteV() or
+     * WriteAsync().
+     *
+     * @param buf   Pointer to a buffer with the message payload to send.
+     * @param len   Size of the message payload to send.
+     *
+     * @return  The number of bytes queued, 0 if the queue is full or the
+     *          link is being opened again, or -1 on error.
+     */
+    int TryWrite(const uint8_t* buf, uint8_t len);
+
+    /**
+     * Push queued messages to the tty as far as credits allow without
+     * blocking.
+     *
+     * @return  true if the transmit queue is empty, false otherwise.
+     */
+    bool TryFlush();
+
+    /**
+     * Wait for all queued messages to be handed to the tty.
+     *
+     * @return  true if the transmit queue was drained, false on error.
+     */
+    bool Flush();
+
+    /**
+     * Coalesce short messages on this channel.  Messages queued within
+     * window microseconds of the first one still waiting are packed into a
+     * single frame, each with a length byte in front, and handed out one by
+     * one again on the other side, so they share the cost of the framing.
+     * The frame goes out once the window is up or it is full, or straight
+     * away on Write(), WriteV() or Flush(), so this mostly pays off with
+     * WriteAsync() and TryWrite().  Messages of MAX_MSG_LEN bytes or more
+     * go out as before.  A frame lost on the wire takes all of its
+     * messages with it.  The setting is shared by every SMsg on the
+     * channel.
+     *
+     * @param window    Longest a message waits for others to share its
+     *                  frame, in microseconds, or 0 to turn coalescing off.
+     *
+     * @return  true if set, false if the Arduino side did not agree to
+     *          coalescing in the sync handshake.
+     */
+    bool SetCoalescing(uint32_t window);
+
+    /**
+     * Compress messages sent on this channel.  Each message that goes out
+     * in a frame of its own is run-length encoded, or sent as the XOR
+     * difference from the previous one if it is the same length, whenever
+     * that makes the frame shorter.  This suits payloads that are mostly
+     * zeros or change little from one message to the next, such as display
+     * frames.  Every few messages one goes out that does not depend on the
+     * one before so that the Arduino gets back in step after a lost frame.
+     * Messages coalesced with others or sent in fragments are not
+     * compressed.  The setting is shared by every SMsg on the channel.
+     *
+     * @param on    Whether to compress.
+     *
+     * @return  true if set, false if the Arduino side did not agree to
+     *          compression in the sync handshake.
+     */
+    bool SetCompression(bool on);
+
+    /**
+     * Set how this channel's output is scheduled against other channels.
+     * Queued frames from urgent channels go out ahead of those from bulk
+     * channels, so commands need not wait behind a backlog of display
+     * frames.  After a run of urgent frames a waiting bulk frame gets a
+     * turn, so bulk output is slowed but never stopped.  Frames already
+     * handed to the tty are not overtaken.  Channels start out as bulk.
+     * The setting is shared by every SMsg on the channel.
+     *
+     * @param priority  PRIORITY_URGENT or PRIORITY_BULK.
+     */
+    void SetPriority(Priority priority);
+
+    /**
+     * Check if received messages or bytes have already been pulled off the
+     * tty.  select() and epoll() will not report these so callers that wait
+     * on GetFD() must drain them with Read() first.
+     *
+     * @return  true if buffered data is pending, false otherwise
+     */
+    bool RxBuffered() const;
+
+    /**
+     * Check if messages are still waiting in the transmit queue, if a frame
+     * is part way in and must be timed out should the rest not come, or if
+     * the link is being opened again and its handshake must be timed out.
+     *
+     * @return  true if the link needs polling, false otherwise
+     */
+    bool TxPending() const;
+
+    /**
+     * Check if the Arduino side answered the sync handshake.  Sketches built
+     * against an older SMsg library do not answer it and do not speak the
+     * current framing either, so both sides have to be updated together.
+     * Until the handshake succeeds the link tries it again every second,
+     * which is also what happens after the Arduino resets.
+     *
+     * @return  true if synchronized, false otherwise
+     */
+    bool IsSynced() const;
+
+    /**
+     * Get the longest message that can be sent or received.  This is
+     * MAX_LARGE_MSG_LEN if the Arduino side agreed to fragmentation in the
+     * sync handshake and MAX_MSG_LEN otherwise.
+     *
+     * @return  maximum message payload size
+     */
+    uint16_t GetMaxMsgLen() const;
+
+    /**
+     * Get the link speed settled on when the tty was opened.
+     *
+     * @return  bits per second
+     */
+    uint32_t GetBaudRate() const;
+
+    /**
+     * Get the time the constructor spent getting the link ready.
+     *
+     * @return  time in microseconds
+     */
+    uint32_t GetSyncTime() const;
+
+    /**
+     * Get the number of stale or corrupt bytes that have been thrown away
+     * while resynchronizing with the Arduino side.
+     *
+     * @return  number of bytes discarded
+     */
+    uint32_t GetDiscardedBytes() const;
+
+    /**
+     * Get a snapshot of the link statistics.  Setting the SMSG_STATS
+     * environment variable to a number of seconds also has them printed to
+     * stderr that often while the link is in use.
+     *
+     * @param[out] stats    Filled in with the counters so far.
+     */
+    void GetStats(Stats& stats) const;
+
+    /**
+     * Start the link statistics over from zero.  This affects every channel
+     * on the tty.
+     */
+    void ResetStats();
+
+    /**
+     * Print the link statistics.
+     *
+     * @param out   Where to print them.
+     */
+    void DumpStats(FILE* out = stderr) const;
 
     /**
      * Get access to the underlying file descriptor used to communicate with
@@ -56,19 +368,16 @@ class SMsg {
      * descriptor with select() or epoll().  Use the methods in this class for
      * actual communication.
      */
-    int GetFD() const { return fd; }
+    int GetFD() const;
+
+    uint8_t GetChannel() const { return channel; }
 
   private:
-    uint8_t txseq;
-    uint8_t rxseq;
-    int fd;
-
-    int ReadMsg(uint8_t* buf, uint8_t len);
-    int WriteMsg(const uint8_t* buf, uint8_t len);
-    bool ReadByte(uint8_t* buf);
-    bool WriteByte(const uint8_t buf);
-    void FlushRead();
-    bool WaitForMsg(uint32_t timeout);
+    SMsgLink* link;
+    uint8_t channel;
+
+    SMsg(const SMsg& other);
+    SMsg& operator=(const SMsg& other);
 };
 
 
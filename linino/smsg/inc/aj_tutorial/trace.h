@@ -0,0 +1,140 @@
+/**
+ * @file
+ * Low overhead event tracing for the serial link drivers.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <aj_tutorial/clock.h>
+
+/*
+ * Tracing is compiled in only when AJ_TUTORIAL_TRACE is defined, e.g. with
+ * EXTRA_CFLAGS=-DAJ_TUTORIAL_TRACE.  Otherwise the TRACE macros expand to
+ * nothing and their arguments are not evaluated.
+ *
+ *   TRACE(what, value)        record an event
+ *   TRACE_ERROR(what, value)  record an event and dump what was recorded
+ *                             since the last dump to stderr
+ *
+ * what must be a string literal (only the pointer is kept).  Events go into
+ * a ring of AJ_TUTORIAL_TRACE_SIZE entries shared by everything in the
+ * process.  Recording is lock free so it can be done from any thread,
+ * including with a driver's lock held.  Trace::Dump() prints the ring,
+ * which stays empty unless the libraries were built with tracing.
+ */
+#ifndef AJ_TUTORIAL_TRACE_SIZE
+#define AJ_TUTORIAL_TRACE_SIZE 4096
+#endif
+
+#ifdef AJ_TUTORIAL_TRACE
+#define TRACE(what, value) Trace::Record((what), (value))
+#define TRACE_ERROR(what, value) do { Trace::Record((what), (value)); Trace::Dump(stderr, true); } while (0)
+#else
+#define TRACE(what, value) do { } while (0)
+#define TRACE_ERROR(what, value) do { } while (0)
+#endif
+
+/*
+ * The ring lives in static members of a class template so that this header
+ * is all there is to it and every library in the process shares one ring.
+ */
+template <uint32_t SIZE>
+class TraceRing {
+  public:
+    struct Entry {
+        volatile uint32_t stamp;    // index + 1 once written, 0 while writing
+        uint32_t time;              // microseconds
+        const char* what;
+        uint32_t value;
+    };
+
+    static void Record(const char* what, uint32_t value)
+    {
+        uint32_t index = __sync_fetch_and_add(&head, 1);
+        Entry& e = entries[index % SIZE];
+
+        e.stamp = 0;
+        __sync_synchronize();
+        e.time = GetTimeUS();
+        e.what = what;
+        e.value = value;
+        __sync_synchronize();
+        e.stamp = index + 1;
+    }
+
+    /*
+     * Print the recorded events, oldest first, one per line.  Events being
+     * overwritten while they are printed are skipped.
+     *
+     * @param out       Where to print them.
+     * @param newOnly   Only print events recorded since the last dump.
+     */
+    static void Dump(FILE* out, bool newOnly = false)
+    {
+        uint32_t end = head;
+        uint32_t start = (end > SIZE) ? (end - SIZE) : 0;
+        if (newOnly && ((int32_t)(dumped - start) > 0)) {
+            start = dumped;
+        }
+        dumped = end;
+
+        for (uint32_t i = start; i != end; ++i) {
+            const Entry& e = entries[i % SIZE];
+            uint32_t stamp = e.stamp;
+            __sync_synchronize();
+            uint32_t time = e.time;
+            const char* what = e.what;
+            uint32_t value = e.value;
+            __sync_synchronize();
+            if ((stamp != i + 1) || (e.stamp != stamp)) {
+                continue;
+            }
+            fprintf(out, "%u.%06u %s %x\n", time / 1000000, time % 1000000, what, value);
+        }
+    }
+
+    /*
+     * Forget everything recorded so far.  Only call this while nothing else
+     * is recording.
+     */
+    static void Clear()
+    {
+        for (uint32_t i = 0; i < SIZE; ++i) {
+            entries[i].stamp = 0;
+        }
+        head = 0;
+        dumped = 0;
+    }
+
+  private:
+    static Entry entries[SIZE];
+    static volatile uint32_t head;
+    static uint32_t dumped;
+};
+
+template <uint32_t SIZE> typename TraceRing<SIZE>::Entry TraceRing<SIZE>::entries[SIZE];
+template <uint32_t SIZE> volatile uint32_t TraceRing<SIZE>::head = 0;
+template <uint32_t SIZE> uint32_t TraceRing<SIZE>::dumped = 0;
+
+typedef TraceRing<AJ_TUTORIAL_TRACE_SIZE> Trace;
+
+#endif
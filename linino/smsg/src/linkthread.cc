@@ -0,0 +1,123 @@
+/**
+ * @file
+ * Lock-free submit queue and completions for LinkThread.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <aj_tutorial/linkthread.h>
+
+/*
+ * Producers push onto a stack with compare and swap.  The consumer never
+ * pops single nodes, it swaps the whole stack out and reverses it, so there
+ * is no ABA problem and no node is touched by more than one thread at once.
+ */
+
+SubmitQueue::SubmitQueue(): top(NULL)
+{
+    if (pipe(wakeFD) < 0) {
+        perror("pipe");
+        wakeFD[0] = wakeFD[1] = -1;
+    } else {
+        fcntl(wakeFD[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFD[1], F_SETFL, O_NONBLOCK);
+    }
+}
+
+SubmitQueue::~SubmitQueue()
+{
+    if (wakeFD[0] >= 0) {
+        close(wakeFD[0]);
+        close(wakeFD[1]);
+    }
+}
+
+void SubmitQueue::Push(Node* node)
+{
+    Node* old;
+    do {
+        old = top;
+        node->next = old;
+    } while (!__sync_bool_compare_and_swap(&top, old, node));
+
+    // Only the push that finds the queue empty has to wake the consumer.
+    if (!old && (wakeFD[1] >= 0)) {
+        char c = 0;
+        if (write(wakeFD[1], &c, 1) < 0) {
+            // pipe already full - the consumer is awake anyway
+        }
+    }
+}
+
+SubmitQueue::Node* SubmitQueue::TakeAll()
+{
+    // Drain the wake up first, so that a push finding the queue empty
+    // after the swap below always leaves the consumer something to see.
+    if (wakeFD[0] >= 0) {
+        char buf[16];
+        while (read(wakeFD[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+
+    Node* node = __sync_lock_test_and_set(&top, (Node*)NULL);
+    Node* oldest = NULL;
+    while (node) {
+        Node* next = node->next;
+        node->next = oldest;
+        oldest = node;
+        node = next;
+    }
+    return oldest;
+}
+
+
+SubmitFuture::SubmitFuture(): done(false), status(-1)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+SubmitFuture::~SubmitFuture()
+{
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+int SubmitFuture::Get()
+{
+    pthread_mutex_lock(&lock);
+    while (!done) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    int ret = status;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void SubmitFuture::SubmitDone(int result, void* context)
+{
+    (void)context;
+    pthread_mutex_lock(&lock);
+    status = result;
+    done = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
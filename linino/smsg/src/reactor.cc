@@ -0,0 +1,188 @@
+/**
+ * @file
+ * Single threaded epoll based I/O multiplexer for the Arduino Yun links.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <aj_tutorial/reactor.h>
+
+#define MAX_EVENTS 8
+
+/*
+ * How often to poll endpoints with queued output.  Flow control credits
+ * arrive as input so this only matters when credits get lost.
+ */
+#define TX_POLL_TO 5
+
+using namespace std;
+
+Reactor::Reactor(): epfd(epoll_create(MAX_EVENTS)), done(false)
+{
+    if (epfd < 0) {
+        perror("epoll_create");
+    }
+    if (pipe(wakeFD) < 0) {
+        perror("pipe");
+        wakeFD[0] = wakeFD[1] = -1;
+    } else {
+        fcntl(wakeFD[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFD[1], F_SETFL, O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFD[0];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFD[0], &ev);
+    }
+}
+
+Reactor::~Reactor()
+{
+    if (wakeFD[0] >= 0) {
+        close(wakeFD[0]);
+        close(wakeFD[1]);
+    }
+    if (epfd >= 0) {
+        close(epfd);
+    }
+}
+
+bool Reactor::Add(Endpoint& ep)
+{
+    if ((ep.GetFD() < 0) || Contains(&ep)) {
+        return false;
+    }
+
+    // SMsg channels all share one file descriptor, which epoll only takes
+    // once.
+    if (!HasFD(ep.GetFD())) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = ep.GetFD();
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ep.GetFD(), &ev) < 0) {
+            return false;
+        }
+    }
+    endpoints.push_back(&ep);
+    return true;
+}
+
+bool Reactor::Remove(Endpoint& ep)
+{
+    vector<Endpoint*>::iterator it = find(endpoints.begin(), endpoints.end(), &ep);
+    if (it == endpoints.end()) {
+        return false;
+    }
+    endpoints.erase(it);
+    if (!HasFD(ep.GetFD())) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, ep.GetFD(), NULL);
+    }
+    return true;
+}
+
+int Reactor::RunOnce(int timeout)
+{
+    vector<Endpoint*>::iterator it;
+    for (it = endpoints.begin(); it != endpoints.end(); ++it) {
+        if ((*it)->RxBuffered()) {
+            timeout = 0;
+        } else if ((*it)->TxPending() && ((timeout < 0) || (timeout > TX_POLL_TO))) {
+            timeout = TX_POLL_TO;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    // Callbacks may add or remove endpoints so work from a copy.
+    vector<Endpoint*> eps(endpoints);
+    for (int i = 0; i < n; ++i) {
+        if (events[i].data.fd == wakeFD[0]) {
+            char buf[16];
+            while (read(wakeFD[0], buf, sizeof(buf)) > 0) {
+            }
+            continue;
+        }
+        for (it = eps.begin(); it != eps.end(); ++it) {
+            if (Contains(*it) && ((*it)->GetFD() == events[i].data.fd)) {
+                (*it)->Readable();
+            }
+        }
+    }
+
+    for (it = eps.begin(); it != eps.end(); ++it) {
+        if (!Contains(*it)) {
+            continue;
+        }
+        if ((*it)->RxBuffered()) {
+            (*it)->Readable();
+        }
+        if ((*it)->TxPending()) {
+            (*it)->Writable();
+        }
+    }
+
+    return n;
+}
+
+void Reactor::Run()
+{
+    done = false;
+    while (!done) {
+        if (RunOnce() < 0) {
+            break;
+        }
+    }
+}
+
+void Reactor::Stop()
+{
+    done = true;
+    if (wakeFD[1] >= 0) {
+        char c = 0;
+        if (write(wakeFD[1], &c, 1) < 0) {
+            // pipe already full - Run() will wake up anyway
+        }
+    }
+}
+
+bool Reactor::Contains(Endpoint* ep) const
+{
+    return find(endpoints.begin(), endpoints.end(), ep) != endpoints.end();
+}
+
+bool Reactor::HasFD(int fd) const
+{
+    vector<Endpoint*>::const_iterator it;
+    for (it = endpoints.begin(); it != endpoints.end(); ++it) {
+        if ((*it)->GetFD() == fd) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -20,227 +20,206 @@
  ******************************************************************************/
 
 
-#include <errno.h>
-#include <fcntl.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>
-#include <sys/select.h>
-#include <sys/stat.h>
+#include <stdlib.h>
 #include <sys/types.h>
-#include <termios.h>
-#include <time.h>
-#include <unistd.h>
+#include <sys/uio.h>
 
 #include <aj_tutorial/smsg.h>
 
-#define RD_TO 500
+#include "smsglink.h"
 
-#define BAUDRATE B230400
-
-
-#if !defined(HOST_BUILD)
 #define TTY_DEV "/dev/ttyATH0"
+
+/*
+ * SMSG_DEV points the link at another tty, such as the pty the link
+ * simulator (linksim) plays the Arduino side on.  Host builds have no
+ * Arduino to talk to, so without it they run with the link closed.
+ */
+static const char* GetDevice()
+{
+    const char* dev = getenv("SMSG_DEV");
+#if defined(HOST_BUILD)
+    return dev ? dev : "";
+#else
+    return dev ? dev : TTY_DEV;
 #endif
+}
 
-class CheckSum {
-  public:
-    CheckSum() : sum(0), pos(0) { }
 
-    void AddByte(uint8_t b) { sum += (++pos * b); }
-    uint8_t GetSumMSB() const { return (sum >> 8) & 0xff; }
-    uint8_t GetSumLSB() const { return sum & 0xff; }
+void SMsg::Stats::Reset()
+{
+    txFrames = 0;
+    txBytes = 0;
+    txCoalesced = 0;
+    txPacked = 0;
+    txPackSaved = 0;
+    rxFrames = 0;
+    rxBytes = 0;
+    rxCoalesced = 0;
+    rxChecksumErrors = 0;
+    rxLengthErrors = 0;
+    rxTimeouts = 0;
+    rxDropped = 0;
+    creditTimeouts = 0;
+    syncs = 0;
+    reconnects = 0;
+    resyncs = 0;
+    flushedBytes = 0;
+    ackLatency.Reset();
+    rxGap.Reset();
+}
 
-  private:
-    uint16_t sum;
-    uint8_t pos;
-};
+void SMsg::Stats::Print(FILE* out) const
+{
+    fprintf(out, "tx: %u frames %u bytes, %u messages coalesced, %u frames packed saving %u bytes, credit timeouts %u\n",
+            txFrames, txBytes, txCoalesced, txPacked, txPackSaved, creditTimeouts);
+    fprintf(out, "rx: %u frames %u bytes, %u messages coalesced, checksum errors %u, length errors %u, timeouts %u, dropped %u\n",
+            rxFrames, rxBytes, rxCoalesced, rxChecksumErrors, rxLengthErrors, rxTimeouts, rxDropped);
+    fprintf(out, "syncs %u, reconnects %u, resyncs %u, flushed %u bytes\n",
+            syncs, reconnects, resyncs, flushedBytes);
+    ackLatency.Print(out, "write to ack (us)");
+    rxGap.Print(out, "rx gap (us)");
+}
 
 
-SMsg::SMsg(void): fd(-1)
+SMsg::SMsg(uint8_t channel, uint32_t maxBaud):
+    link(SMsgLink::Acquire(GetDevice(), channel, maxBaud)),
+    channel(channel)
 {
-#if !defined(HOST_BUILD)
-    fd = open(TTY_DEV, O_RDWR | O_NONBLOCK | O_NOCTTY);
-    if (fd < 0) {
-        perror("opening " TTY_DEV);
-    } else {
-        struct termios tio;
-        memset(&tio, 0, sizeof(tio));
-        tio.c_iflag = 0;
-        tio.c_oflag = 0;
-        tio.c_cflag = CS8 | CREAD | CLOCAL;
-        tio.c_lflag = 0;
-        tio.c_cc[VMIN] = 0;
-        tio.c_cc[VTIME] = 5;
-        cfsetspeed(&tio, BAUDRATE);
-        tcsetattr(fd, TCSANOW, &tio);
-    }
-#endif
-
-    while (WaitForMsg(10 * RD_TO)) {
-        FlushRead();
-    }
 }
 
 SMsg::~SMsg(void)
 {
-    if (fd > 0) {
-        close(fd);
+    if (link) {
+        link->Release(channel);
     }
 }
 
 
-int SMsg::Read(uint8_t* buf, uint8_t len)
+int SMsg::Read(uint8_t* buf, uint16_t len)
 {
-    int ret = -1;
-
-    if (fd > 0) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        ret = select(fd + 1, &rfds, NULL, NULL, NULL);
-
-        if (ret > 0) {
-            ret = ReadMsg(buf, len);
-        }
-    }
-    return ret;
+    return link ? link->Read(channel, buf, len) : -1;
 }
 
-int SMsg::Write(const uint8_t* buf, uint8_t len)
+int SMsg::Write(const uint8_t* buf, uint16_t len)
 {
-    if ((len < 1) || (len > MAX_MSG_LEN)) {
-        return -1;
-    }
-    int ret = WriteMsg(buf, len);
-    return ret;
+    struct iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(buf);
+    iov.iov_len = len;
+    return WriteV(&iov, 1);
 }
 
-int SMsg::ReadMsg(uint8_t* buf, uint8_t len)
+int SMsg::WriteV(const struct iovec* iov, int iovcnt)
 {
-    uint8_t plen;
-    uint8_t psumbuf;
-    CheckSum sum;
-    uint8_t i;
-
-
-    if (!ReadByte(&plen)) {
-        return 0;
-    }
-    if ((plen > MAX_MSG_LEN) || (plen > len)) {
-        return -1;
-    }
-    sum.AddByte(plen);
+    return link ? link->WriteV(channel, iov, iovcnt, true) : -1;
+}
 
-    for (i = 0; i < plen; ++i) {
-        if (!ReadByte(&buf[i])) {
-            return -1;
-        }
-        sum.AddByte(buf[i]);
-    }
+int SMsg::WriteAsync(const uint8_t* buf, uint16_t len)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(buf);
+    iov.iov_len = len;
+    return link ? link->WriteV(channel, &iov, 1, false) : -1;
+}
 
-    if (!ReadByte(&psumbuf)) {
-        return -1;
-    }
-    if (sum.GetSumMSB() != psumbuf) {
-        return -1;
-    }
+int SMsg::TryRead(uint8_t* buf, uint16_t len)
+{
+    return link ? link->TryRead(channel, buf, len) : -1;
+}
 
-    if (!ReadByte(&psumbuf)) {
-        return -1;
-    }
-    if (sum.GetSumLSB() != psumbuf) {
-        return -1;
-    }
+int SMsg::TryWrite(const uint8_t* buf, uint8_t len)
+{
+    return link ? link->TryWrite(channel, buf, len) : -1;
+}
 
-    FlushRead();
+bool SMsg::TryFlush()
+{
+    return link && link->TryFlush(channel);
+}
 
-    return plen;
+bool SMsg::Flush()
+{
+    return link && link->Flush(channel);
 }
 
+bool SMsg::SetCoalescing(uint32_t window)
+{
+    return link && link->SetCoalescing(channel, window);
+}
 
-int SMsg::WriteMsg(const uint8_t* buf, uint8_t len)
+bool SMsg::SetCompression(bool on)
 {
-    CheckSum sum;
-    uint8_t sumbuf;
-    uint8_t i;
+    return link && link->SetCompression(channel, on);
+}
 
-    if (!WriteByte(len)) {
-        return -1;
+void SMsg::SetPriority(Priority priority)
+{
+    if (link) {
+        link->SetPriority(channel, priority);
     }
-    sum.AddByte(len);
+}
 
-    for (i = 0; i < len; ++i) {
-        if (!WriteByte(buf[i])) {
-            return -3;
-        }
-        sum.AddByte(buf[i]);
-    }
+bool SMsg::RxBuffered() const
+{
+    return link && link->RxBuffered(channel);
+}
 
-    sumbuf = sum.GetSumMSB();
-    if (!WriteByte(sumbuf)) {
-        return -4;
-    }
+bool SMsg::TxPending() const
+{
+    return link && link->TxPending(channel);
+}
 
-    sumbuf = sum.GetSumLSB();
-    if (!WriteByte(sumbuf)) {
-        return -5;
-    }
+bool SMsg::IsSynced() const
+{
+    return link && link->IsSynced();
+}
 
-    usleep(RD_TO * 2);
+uint16_t SMsg::GetMaxMsgLen() const
+{
+    return link ? link->GetMaxMsgLen() : SMsg::MAX_MSG_LEN;
+}
 
-    return len;
+uint32_t SMsg::GetBaudRate() const
+{
+    return link ? link->GetBaudRate() : 0;
 }
 
+uint32_t SMsg::GetSyncTime() const
+{
+    return link ? link->GetSyncTime() : 0;
+}
 
-bool SMsg::ReadByte(uint8_t* buf)
+uint32_t SMsg::GetDiscardedBytes() const
 {
-    if (WaitForMsg(RD_TO)) {
-        if (fd > 0) {
-            ssize_t ret = read(fd, buf, 1);
-            if (ret > 0) {
-                //printf(" r%02x", *buf); fflush(stdout);
-                return true;
-            }
-        }
-    }
-    return false;
+    return link ? link->GetDiscardedBytes() : 0;
 }
 
-bool SMsg::WriteByte(const uint8_t buf)
+void SMsg::GetStats(Stats& stats) const
 {
-    if (fd > 0) {
-        //printf(" w%02x", buf); fflush(stdout);
-        ssize_t ret = write(fd, &buf, 1);
-        return (ret > 0);
+    if (link) {
+        link->GetStats(stats);
+    } else {
+        stats.Reset();
     }
-    return false;
 }
 
-
-void SMsg::FlushRead()
+void SMsg::ResetStats()
 {
-    uint8_t buf;
-
-    while (WaitForMsg(RD_TO)) {
-        if (fd > 0) {
-            ssize_t ret = read(fd, &buf, 1);
-            ret++; // suppress compiler warning.
-            //printf(" f%02x", buf); fflush(stdout);
-        }
+    if (link) {
+        link->ResetStats();
     }
 }
 
+void SMsg::DumpStats(FILE* out) const
+{
+    Stats stats;
+    GetStats(stats);
+    stats.Print(out);
+}
 
-bool SMsg::WaitForMsg(uint32_t timeout)
+int SMsg::GetFD() const
 {
-    if (fd > 0) {
-        fd_set rfds;
-        struct timeval to = { 0, timeout };
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        return (select(fd + 1, &rfds, NULL, NULL, &to) > 0);
-    }
-    return false;
+    return link ? link->GetFD() : -1;
 }
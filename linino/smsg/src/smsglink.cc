@@ -0,0 +1,2220 @@
+/**
+ * @file
+ * Shared serial link behind SMsg channels - Linino side.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include <aj_tutorial/checksum.h>
+#include <aj_tutorial/clock.h>
+#include <aj_tutorial/trace.h>
+
+#include "smsglink.h"
+
+/*
+ * Inter-byte timeout.  It is kept in bit times so that it scales with the
+ * link speed (125 bit times is 500 us at the base rate), but never drops
+ * below RD_TO_MIN microseconds to leave room for scheduling delays.
+ */
+#define RD_TO_BITS 125
+#define RD_TO_MIN 200
+
+/*
+ * Link speeds, indexed the same way on both sides.  The Yun's UART driver
+ * runs B230400 at the 250000 baud the Arduino uses, and the faster settings
+ * scale the same way.  The base rate comes first: the link only ever steps
+ * up from it, so slower settings would never be used.
+ */
+static const struct {
+    speed_t speed;
+    uint32_t bps;
+} BAUD_RATES[] = {
+    { B230400, 250000 },
+    { B460800, 500000 },
+    { B921600, 1000000 }
+};
+
+#define BAUD_COUNT ((uint8_t)(sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0])))
+#define BAUD_BASE_INDEX 0
+
+/*
+ * Frames are [length][type][payload][sum MSB][sum LSB].  The low nibble of
+ * the type byte is the channel and the high nibble holds flags:
+ *
+ *   TYPE_FRAG       the payload is one fragment of a longer message and
+ *                   starts with [message ID][fragment index]
+ *   TYPE_FRAG_LAST  with TYPE_FRAG, the last fragment of the message
+ *   TYPE_BATCH      the payload is several short messages coalesced into
+ *                   one frame, each as [length][message]
+ *   TYPE_PACKED     the payload is one message, run-length encoded
+ *   TYPE_PACKED_DELTA  with TYPE_PACKED, the message was XORed with the
+ *                   reference before encoding, and the payload starts with
+ *                   the reference's tag
+ *
+ * Fragments of a message are numbered from 0 and sent in order on their
+ * channel, though frames of other channels may come in between.  The
+ * reference for a delta is the last message, of the same length, sent on
+ * the channel in a plain or packed frame.  Receivers check its tag, and
+ * after PACK_KEY_EVERY deltas in a row the sender sends a frame that stands
+ * on its own, so a lost frame only spoils a few deltas.  Only the Linino
+ * side sends packed frames.  Frames with any other flags are dropped.
+ */
+#define TYPE_CHANNEL_MASK 0x0f
+#define TYPE_FLAGS_MASK 0xf0
+#define TYPE_FRAG 0x10
+#define TYPE_FRAG_LAST 0x20
+#define TYPE_BATCH 0x40
+#define TYPE_PACKED 0x80
+#define TYPE_PACKED_DELTA 0x20
+
+/*
+ * Run-length codes.  Each starts with a control byte:
+ *
+ *   0nnn nnnn  n + 1 bytes follow as they are
+ *   10nn nnnn  n + 1 zero bytes
+ *   11nn nnnn  n + 2 copies of the byte that follows
+ *
+ * Zero runs get their own code since sparse payloads and deltas are mostly
+ * zeros.
+ */
+#define RLE_ZEROS 0x80
+#define RLE_REPEAT 0xc0
+#define RLE_COUNT_MASK 0x3f
+#define RLE_MAX_RUN (RLE_COUNT_MASK + 1)
+
+#define PACK_KEY_EVERY 8
+
+#define FRAG_HEADER_LEN 2
+#define FRAG_DATA_LEN (SMsg::MAX_MSG_LEN - FRAG_HEADER_LEN)
+
+/*
+ * Control bytes only show up where a length byte is expected and always have
+ * the MSB set, which a valid length never does.
+ *
+ *   10nn nnnn  credit - the Arduino pulled n bytes out of its receive buffer
+ *   1100 0001  sync - followed by SYNC_MAGIC, a nonce and the capabilities
+ *              the Linino side would like to use
+ *   1100 0010  sync ack - the sync frame echoed back by the Arduino with the
+ *              capabilities it agreed to
+ *   1100 0011  baud - followed by a speed index and its complement, asks the
+ *              Arduino to switch speed
+ *   1100 0100  baud ack - followed by the speed index the Arduino is about
+ *              to switch to, or BAUD_REFUSED, sent at the old speed
+ *   1100 0101  resync - the Arduino started up, or got a bad frame before
+ *              any sync frame, and wants the link opened again
+ */
+#define CTRL_FLAG 0x80
+#define CTRL_TYPE_MASK 0xc0
+#define CTRL_CREDIT 0x80
+#define CREDIT_MASK 0x3f
+#define CTRL_SYNC 0xc1
+#define CTRL_SYNC_ACK 0xc2
+#define CTRL_BAUD 0xc3
+#define CTRL_BAUD_ACK 0xc4
+#define BAUD_REFUSED 0xff
+#define CTRL_RESYNC 0xc5
+
+/*
+ * The sync handshake is retried every SYNC_TO microseconds, at most
+ * SYNC_TRIES times, so opening the link never takes much more than 80 ms.
+ */
+#define SYNC_LEN 6
+#define SYNC_TO 20000
+#define SYNC_TRIES 4
+
+static const uint8_t SYNC_MAGIC[] = { 'S', 'y', 'n' };
+
+/*
+ * Capabilities offered in the sync frame.
+ *
+ *   CAP_CRC16  frames end with a CRC-16 instead of the position weighted sum
+ *   CAP_FRAG   messages up to MAX_LARGE_MSG_LEN may be sent as fragments
+ *   CAP_BAUD   the link speed may be changed
+ *   CAP_BATCH  short messages may be coalesced into TYPE_BATCH frames
+ *   CAP_PACK   the Arduino takes TYPE_PACKED frames
+ */
+#define CAP_CRC16 0x01
+#define CAP_FRAG 0x02
+#define CAP_BAUD 0x04
+#define CAP_BATCH 0x08
+#define CAP_PACK 0x10
+
+#define LINK_CAPS (CAP_CRC16 | CAP_FRAG | CAP_BAUD | CAP_BATCH | CAP_PACK)
+
+/*
+ * A new speed is only kept once BAUD_PROBES sync handshakes in a row have
+ * gone through cleanly at it.  The Arduino switches back to the base rate on
+ * its own if no sync frame reaches it at a new speed within 100 ms, so after
+ * BAUD_FALLBACK_TO microseconds it is either back there or still at the last
+ * speed a sync frame reached it at.  BAUD_SETTLE gives it time to reprogram
+ * its UART after acking a change.
+ */
+#define BAUD_PROBES 4
+#define BAUD_FALLBACK_TO 150000
+#define BAUD_FALLBACK_TRIES 3
+#define BAUD_SETTLE 1000
+
+/*
+ * The Arduino's hardware serial receive buffer is 64 bytes.  Never have more
+ * than that outstanding without getting credits back.  If credits stop
+ * coming back (lost bytes, sketch restarted), assume the Arduino has drained
+ * its buffer after CREDIT_TO microseconds.
+ */
+#define TX_WINDOW 64
+#define CREDIT_TO 20000
+
+/*
+ * An Arduino that resets comes back at the base rate with the plain sum and
+ * no idea the link was ever synced, while this side carries on with what was
+ * negotiated.  Everything it sends then looks like garbage, and everything
+ * sent to it goes nowhere.  So the link is synced again, starting at the
+ * base rate, once RESYNC_ERRORS bad frames have come in without a good one
+ * between them, or once RESYNC_STALLS credit timeouts have passed without
+ * a good frame, or a credit while no bad frame was pending, coming in
+ * between them.  An Arduino that reset and is back at the same speed
+ * asks for this itself (see CTRL_RESYNC).  A link that is not synced tries
+ * again every RESYNC_HOLDOFF microseconds for as long as it is in use.
+ */
+#define RESYNC_ERRORS 16
+#define RESYNC_STALLS 4
+#define RESYNC_HOLDOFF 1000000
+
+/*
+ * Most frames handed to the tty in one system call.  Each may wrap around
+ * its ring and need two iovecs.
+ */
+#define TX_BATCH 16
+
+/*
+ * Most urgent frames sent in a row while a bulk frame waits.
+ */
+#define URGENT_RUN_MAX 8
+
+#define IDLE_POLL_TO 50000
+#define TX_POLL_TO 5000
+
+#define FRAME_OVERHEAD 4
+
+using namespace std;
+
+/*
+ * Run-length encode len bytes of in into out, which must have room for
+ * len + 1 bytes.  Returns the encoded length.
+ */
+static uint8_t PackRLE(const uint8_t* in, uint8_t len, uint8_t* out)
+{
+    uint8_t n = 0;
+    int lit = -1;       // control byte of the open run of literals, if any
+
+    for (uint8_t i = 0; i < len;) {
+        uint8_t run = 1;
+        while (((i + run) < len) && (in[i + run] == in[i]) && (run < RLE_MAX_RUN)) {
+            ++run;
+        }
+        if ((in[i] == 0) && ((run > 1) || (lit < 0))) {
+            out[n++] = RLE_ZEROS | (run - 1);
+            lit = -1;
+        } else if (run > 2) {
+            out[n++] = RLE_REPEAT | (run - 2);
+            out[n++] = in[i];
+            lit = -1;
+        } else {
+            run = 1;
+            if (lit < 0) {
+                lit = n++;
+                out[lit] = 0;
+            } else {
+                ++out[lit];
+            }
+            out[n++] = in[i];
+        }
+        i += run;
+    }
+    return n;
+}
+
+/*
+ * Tag for a delta reference, so that the receiver can tell whether it has
+ * the same one.
+ */
+static uint8_t RefTag(const uint8_t* ref, uint8_t len)
+{
+    uint8_t tag = len;
+    for (uint8_t i = 0; i < len; ++i) {
+        tag = ((tag << 1) | (tag >> 7)) ^ ref[i];
+    }
+    return tag;
+}
+
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, SMsgLink*> registry;
+
+SMsgLink* SMsgLink::Acquire(const char* dev, uint8_t channel, uint32_t maxBaud)
+{
+    if (channel >= SMsg::MAX_CHANNELS) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryLock);
+    SMsgLink*& link = registry[dev];
+    if (!link) {
+        link = new SMsgLink(dev, maxBaud);
+    }
+
+    pthread_mutex_lock(&link->lock);
+    ++link->refs;
+    if (!link->channels[channel]) {
+        link->channels[channel] = new Channel();
+    }
+    ++link->channels[channel]->refs;
+    pthread_mutex_unlock(&link->lock);
+
+    pthread_mutex_unlock(&registryLock);
+    return link;
+}
+
+void SMsgLink::Release(uint8_t channel)
+{
+    pthread_mutex_lock(&registryLock);
+    pthread_mutex_lock(&lock);
+
+    Channel* ch = channels[channel];
+    if (--ch->refs == 0) {
+        if (fd > 0) {
+            CloseBatch(channel);
+            WaitForTx(*ch, 0, ch->txQueued);
+        }
+        if (txCur == channel) {
+            txCur = -1;
+            txPaid = 0;
+        }
+        channels[channel] = NULL;
+        delete ch;
+    }
+    bool last = (--refs == 0);
+    pthread_mutex_unlock(&lock);
+
+    if (last) {
+        registry.erase(device);
+        delete this;
+    }
+    pthread_mutex_unlock(&registryLock);
+}
+
+
+SMsgLink::Channel::Channel():
+    refs(0),
+    rxQueueHead(0),
+    rxQueueCount(0),
+    rxError(false),
+    rxFragBuf(NULL),
+    rxFragLen(0),
+    rxFragId(0),
+    rxFragNext(0),
+    rxFragActive(false),
+    txHead(0),
+    txTail(0),
+    txQueued(0),
+    txSent(0),
+    txFragId(0),
+    txFragging(false),
+    txBatchLen(0),
+    txBatchCount(0),
+    txBatchTime(0),
+    batchWindow(0),
+    txRefLen(0),
+    txRefUses(0),
+    txPack(false),
+    priority(SMsg::PRIORITY_BULK)
+{
+    for (uint8_t i = 0; i < RX_QUEUE_SIZE; ++i) {
+        rxQueue[i].errorBefore = false;
+        rxQueue[i].large = NULL;
+    }
+}
+
+SMsgLink::Channel::~Channel()
+{
+    for (uint8_t i = 0; i < RX_QUEUE_SIZE; ++i) {
+        delete [] rxQueue[i].large;
+    }
+    delete [] rxFragBuf;
+}
+
+SMsgLink::SMsgLink(const char* dev, uint32_t maxBaud):
+    device(dev),
+    refs(0),
+    fd(-1),
+    rxReading(false),
+    rxHead(0),
+    rxTail(0),
+    rxMark(0),
+    rxRescanning(false),
+    rxScanEnd(0),
+    txCur(-1),
+    txPaid(0),
+    txUrgentRun(0),
+    txCredits(TX_WINDOW),
+    txCreditTime(GetTimeUS()),
+    baud(BAUD_BASE_INDEX),
+    rdTimeout(RD_TO_MIN),
+    caps(0),
+    sumMode(CheckSum::SUM),
+    synced(false),
+    syncNonce(GetTimeUS() >> 10),
+    syncTime(0),
+    rxDiscarded(0),
+    connStep(CONNECT_DONE),
+    connTime(0),
+    connTimeout(0),
+    connTries(0),
+    connChecks(0),
+    connIndex(0),
+    connGood(BAUD_BASE_INDEX),
+    connFrom(BAUD_BASE_INDEX),
+    connFallbacks(0),
+    connFalling(false),
+    connDiscarded(0),
+    replyLen(0),
+    replyMatch(0),
+    statsDiscarded(0),
+    statsPeriod(0),
+    statsTime(GetTimeUS()),
+    rxTime(0),
+    rxLastFrameTime(0),
+    rxHadFrame(false),
+    txWritten(0),
+    txAcked(0),
+    ackHead(0),
+    ackCount(0),
+    maxBaud(maxBaud),
+    rxErrorRun(0),
+    txStallRun(0),
+    resyncTime(0),
+    resyncAsked(false)
+{
+    uint32_t start = GetTimeUS();
+    pthread_condattr_t attr;
+
+    const char* period = getenv("SMSG_STATS");
+    if (period) {
+        statsPeriod = atoi(period) * 1000000;
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rxCond, &attr);
+    pthread_condattr_destroy(&attr);
+    memset(channels, 0, sizeof(channels));
+    memset(txNext, 0, sizeof(txNext));
+    SetBaud(baud);
+
+    // Host builds leave dev empty unless they are pointed at a simulator.
+    if (dev[0] != '\0') {
+        fd = open(dev, O_RDWR | O_NONBLOCK | O_NOCTTY);
+        if (fd < 0) {
+            perror(dev);
+        } else {
+            struct termios tio;
+            memset(&tio, 0, sizeof(tio));
+            tio.c_iflag = 0;
+            tio.c_oflag = 0;
+            tio.c_cflag = CS8 | CREAD | CLOCAL;
+            tio.c_lflag = 0;
+            tio.c_cc[VMIN] = 0;
+            tio.c_cc[VTIME] = 5;
+            cfsetspeed(&tio, BAUD_RATES[baud].speed);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+    }
+
+    ResetRx();
+    if (fd > 0) {
+        Connect();
+    }
+    syncTime = GetTimeUS() - start;
+}
+
+SMsgLink::~SMsgLink()
+{
+    if (fd > 0) {
+        if (synced && (baud != BAUD_BASE_INDEX)) {
+            // Leave the Arduino at the base rate for whoever opens the link
+            // next.
+            uint8_t req[] = { CTRL_BAUD, BAUD_BASE_INDEX, (uint8_t)~BAUD_BASE_INDEX };
+            if (write(fd, req, sizeof(req)) == sizeof(req)) {
+                tcdrain(fd);
+            }
+        }
+        close(fd);
+    }
+    pthread_cond_destroy(&rxCond);
+    pthread_mutex_destroy(&lock);
+}
+
+
+int SMsgLink::Read(uint8_t channel, uint8_t* buf, uint16_t len)
+{
+    int ret = -1;
+
+    if (fd <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    Channel& ch = *channels[channel];
+    while (true) {
+        ParseRx();
+
+        ret = PopMsg(ch, buf, len);
+        if (ret != 0) {
+            break;
+        }
+        if (!WaitForInput(IDLE_POLL_TO)) {
+            ret = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int SMsgLink::WriteV(uint8_t channel, const struct iovec* iov, int iovcnt, bool wait)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+
+    if ((len < 1) || (len > SMsg::MAX_LARGE_MSG_LEN) || (fd <= 0)) {
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&lock);
+    Channel& ch = *channels[channel];
+    bool ok = WaitForWriter(ch);
+    if (ok && (len <= SMsg::MAX_MSG_LEN)) {
+        ok = MakeRoom(channel, len, true);
+        if (ok) {
+            QueueMsg(channel, iov, len);
+        }
+    } else if (ok) {
+        ok = (caps & CAP_FRAG) && CloseBatch(channel) && QueueFragments(channel, iov, len);
+    }
+    if (ok && (wait ? (CloseBatch(channel) && WaitForTx(ch, 0, ch.txQueued)) : ServiceTx())) {
+        ret = len;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int SMsgLink::TryRead(uint8_t channel, uint8_t* buf, uint16_t len)
+{
+    int ret = 0;
+
+    if (fd <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    ssize_t rret = FillRxRing();
+    if ((rret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        ret = -1;
+    } else {
+        ParseRx();
+        if ((rxState != RX_LENGTH) && ((GetTimeUS() - rxTime) >= rdTimeout)) {
+            RxTimedOut();
+        }
+        ServiceTx();
+        DumpStatsIfDue();
+        ret = PopMsg(*channels[channel], buf, len);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int SMsgLink::TryWrite(uint8_t channel, const uint8_t* buf, uint8_t len)
+{
+    if ((len < 1) || (len > SMsg::MAX_MSG_LEN) || (fd <= 0)) {
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(buf);
+    iov.iov_len = len;
+
+    int ret = 0;
+    pthread_mutex_lock(&lock);
+    Channel& ch = *channels[channel];
+    if (connStep != CONNECT_DONE) {
+        FillRxRing();
+    }
+    if (ch.txFragging || !ServiceConnect()) {
+        // Another thread is partway through a fragmented message, or the
+        // link is being opened again.
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    bool room = MakeRoom(channel, len, false);
+    if (!room) {
+        // Pick up any credits that came in and try to make room.
+        FillRxRing();
+        ParseRx();
+        if (!ServiceTx()) {
+            ret = -1;
+        } else {
+            room = MakeRoom(channel, len, false);
+        }
+    }
+    if ((ret == 0) && room) {
+        QueueMsg(channel, &iov, len);
+        ret = ServiceTx() ? len : -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SMsgLink::TryFlush(uint8_t channel)
+{
+    if (fd <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    Channel& ch = *channels[channel];
+    FillRxRing();
+    ParseRx();
+    bool ret = ServiceTx() && (ch.txHead == ch.txTail) && (ch.txBatchCount == 0);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SMsgLink::Flush(uint8_t channel)
+{
+    if (fd <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    Channel& ch = *channels[channel];
+    bool ret = CloseBatch(channel) && WaitForTx(ch, 0, ch.txQueued);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SMsgLink::SetCoalescing(uint8_t channel, uint32_t window)
+{
+    if (fd <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool ret = (window == 0) || (caps & CAP_BATCH);
+    if (ret) {
+        channels[channel]->batchWindow = window;
+        ret = CloseBatch(channel);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SMsgLink::SetCompression(uint8_t channel, bool on)
+{
+    if (fd <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool ret = !on || (caps & CAP_PACK);
+    if (ret) {
+        // The next message goes out on its own, which brings the Arduino's
+        // reference into step.
+        Channel& ch = *channels[channel];
+        ch.txPack = on;
+        ch.txRefLen = 0;
+        ch.txRefUses = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void SMsgLink::SetPriority(uint8_t channel, SMsg::Priority priority)
+{
+    pthread_mutex_lock(&lock);
+    channels[channel]->priority = priority;
+    pthread_mutex_unlock(&lock);
+}
+
+bool SMsgLink::RxBuffered(uint8_t channel) const
+{
+    pthread_mutex_lock(&lock);
+    bool ret = (channels[channel]->rxQueueCount > 0) || (rxHead != rxTail);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SMsgLink::TxPending(uint8_t channel) const
+{
+    pthread_mutex_lock(&lock);
+    const Channel& ch = *channels[channel];
+    bool ret = (ch.txHead != ch.txTail) || (ch.txBatchCount > 0) || (rxState != RX_LENGTH) ||
+               (connStep != CONNECT_DONE);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+/*
+ * Frame hdrLen bytes of hdr followed by len bytes gathered from iov, starting
+ * iovOff bytes into it, into the channel's txRing, computing the checksum as
+ * the payload is copied.  iov and iovOff are left pointing just past the
+ * bytes taken.  The caller must hold the lock and have made sure there is
+ * room.
+ */
+void SMsgLink::QueueFrame(uint8_t channel, uint8_t flags, const uint8_t* hdr, uint8_t hdrLen,
+                          const struct iovec*& iov, size_t& iovOff, uint8_t len)
+{
+    Channel& ch = *channels[channel];
+    CheckSum sum(sumMode);
+    uint8_t frameLen = hdrLen + len;
+    uint8_t type = flags | channel;
+
+    ch.txRing[ch.txHead++] = frameLen;
+    sum.AddByte(frameLen);
+    ch.txRing[ch.txHead++] = type;
+    sum.AddByte(type);
+
+    sum.Add(hdr, hdrLen);
+    for (uint8_t i = 0; i < hdrLen; ++i) {
+        ch.txRing[ch.txHead++] = hdr[i];
+    }
+
+    while (len > 0) {
+        const uint8_t* buf = static_cast<const uint8_t*>(iov->iov_base) + iovOff;
+        size_t n = iov->iov_len - iovOff;
+        if (n > len) {
+            n = len;
+        }
+        sum.Add(buf, n);
+        for (size_t j = 0; j < n; ++j) {
+            ch.txRing[ch.txHead++] = buf[j];
+        }
+        len -= n;
+        iovOff += n;
+        if (iovOff == iov->iov_len) {
+            ++iov;
+            iovOff = 0;
+        }
+    }
+
+    ch.txRing[ch.txHead++] = sum.GetSumMSB();
+    ch.txRing[ch.txHead++] = sum.GetSumLSB();
+
+    ch.txQueued += frameLen + FRAME_OVERHEAD;
+}
+
+/*
+ * Queue a message too long for one frame as a run of fragments, waiting for
+ * room in the channel's txRing as needed.  Other writers on the channel are
+ * held off until the last fragment is queued so that their messages do not
+ * land in the middle.  The caller must hold the lock.
+ */
+bool SMsgLink::QueueFragments(uint8_t channel, const struct iovec* iov, size_t len)
+{
+    Channel& ch = *channels[channel];
+    uint8_t hdr[FRAG_HEADER_LEN] = { ch.txFragId++, 0 };
+    size_t off = 0;
+    bool ok = true;
+
+    ch.txFragging = true;
+    while (ok && (len > 0)) {
+        uint8_t n = (len > FRAG_DATA_LEN) ? FRAG_DATA_LEN : len;
+        uint8_t flags = TYPE_FRAG | ((n == len) ? TYPE_FRAG_LAST : 0);
+        ok = WaitForTx(ch, FRAG_HEADER_LEN + n + FRAME_OVERHEAD, ch.txSent);
+        if (ok) {
+            QueueFrame(channel, flags, hdr, sizeof(hdr), iov, off, n);
+            ++hdr[1];
+            len -= n;
+        }
+    }
+    ch.txFragging = false;
+    return ok;
+}
+
+/*
+ * Get ready to queue a message of up to MAX_MSG_LEN bytes on the channel.  A
+ * message that is to be coalesced needs room in the open batch, which gets
+ * closed if the message won't fit.  Any other message needs the batch
+ * closed, so that messages stay in order, and room for its own frame.
+ * Without wait nothing that would block is tried.  The caller must hold the
+ * lock.
+ *
+ * Returns true once the message can be queued with QueueMsg().
+ */
+bool SMsgLink::MakeRoom(uint8_t channel, uint8_t len, bool wait)
+{
+    Channel& ch = *channels[channel];
+
+    while (true) {
+        bool coalesce = (ch.batchWindow > 0) && (len < SMsg::MAX_MSG_LEN);
+        if (coalesce ? ((ch.txBatchLen + 1 + len) <= SMsg::MAX_MSG_LEN) :
+            ((ch.txBatchCount == 0) && (ch.TxRoom() >= len + FRAME_OVERHEAD))) {
+            return true;
+        }
+        uint8_t room = ((ch.txBatchCount > 0) ? ch.txBatchLen : len) + FRAME_OVERHEAD;
+        if ((ch.txBatchCount > 0) && (ch.TxRoom() >= room)) {
+            QueueBatch(channel);
+        } else if (!wait || !WaitForTx(ch, room, ch.txSent)) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Queue a message that MakeRoom() made room for, either in the channel's
+ * batch or as a frame of its own.  The caller must hold the lock.
+ */
+void SMsgLink::QueueMsg(uint8_t channel, const struct iovec* iov, uint8_t len)
+{
+    Channel& ch = *channels[channel];
+
+    if ((ch.batchWindow == 0) || (len == SMsg::MAX_MSG_LEN)) {
+        if (!ch.txPack) {
+            size_t off = 0;
+            QueueFrame(channel, 0, NULL, 0, iov, off, len);
+            return;
+        }
+        uint8_t msg[SMsg::MAX_MSG_LEN];
+        for (uint8_t n = 0; n < len; ++iov) {
+            uint8_t chunk = (iov->iov_len > (size_t)(len - n)) ? (len - n) : iov->iov_len;
+            memcpy(&msg[n], iov->iov_base, chunk);
+            n += chunk;
+        }
+        QueueMsgFrame(channel, msg, len);
+        return;
+    }
+
+    if (ch.txBatchCount == 0) {
+        ch.txBatchTime = GetTimeUS();
+    }
+    ch.txBatch[ch.txBatchLen++] = len;
+    while (len > 0) {
+        uint8_t n = (iov->iov_len > len) ? len : iov->iov_len;
+        memcpy(&ch.txBatch[ch.txBatchLen], iov->iov_base, n);
+        ch.txBatchLen += n;
+        len -= n;
+        ++iov;
+    }
+    ++ch.txBatchCount;
+}
+
+/*
+ * Move the channel's batch to its txRing as a single frame.  A batch of one
+ * goes as a plain frame.  The caller must hold the lock and have made sure
+ * there is room.
+ */
+void SMsgLink::QueueBatch(uint8_t channel)
+{
+    Channel& ch = *channels[channel];
+    struct iovec iov;
+    const struct iovec* piov = &iov;
+    size_t off = 0;
+
+    if (ch.txBatchCount == 1) {
+        QueueMsgFrame(channel, &ch.txBatch[1], ch.txBatchLen - 1);
+    } else {
+        iov.iov_base = ch.txBatch;
+        iov.iov_len = ch.txBatchLen;
+        QueueFrame(channel, TYPE_BATCH, NULL, 0, piov, off, iov.iov_len);
+        stats.txCoalesced += ch.txBatchCount;
+    }
+    TRACE("smsg batch", ch.txBatchCount);
+    ch.txBatchLen = 0;
+    ch.txBatchCount = 0;
+}
+
+/*
+ * Queue a message of up to MAX_MSG_LEN bytes in a frame of its own.  With
+ * compression on, it goes run-length encoded, or as the difference from the
+ * last such message, if either is shorter, and it becomes the reference for
+ * the next one.  The caller must hold the lock and have made sure there is
+ * room for the message unpacked.
+ */
+void SMsgLink::QueueMsgFrame(uint8_t channel, const uint8_t* msg, uint8_t len)
+{
+    Channel& ch = *channels[channel];
+    uint8_t rle[SMsg::MAX_MSG_LEN + 1];
+    uint8_t delta[SMsg::MAX_MSG_LEN + 1];
+    uint8_t tag = 0;
+    uint8_t flags = 0;
+    struct iovec iov;
+    const struct iovec* piov = &iov;
+    size_t off = 0;
+
+    iov.iov_base = const_cast<uint8_t*>(msg);
+    iov.iov_len = len;
+    if (ch.txPack) {
+        uint8_t n = PackRLE(msg, len, rle);
+        if (n < iov.iov_len) {
+            flags = TYPE_PACKED;
+            iov.iov_base = rle;
+            iov.iov_len = n;
+        }
+
+        if ((len == ch.txRefLen) && (ch.txRefUses < PACK_KEY_EVERY)) {
+            uint8_t diff[SMsg::MAX_MSG_LEN];
+            for (uint8_t i = 0; i < len; ++i) {
+                diff[i] = msg[i] ^ ch.txRef[i];
+            }
+            n = PackRLE(diff, len, delta);
+            if ((size_t)(n + 1) < iov.iov_len) {
+                flags = TYPE_PACKED | TYPE_PACKED_DELTA;
+                tag = RefTag(ch.txRef, len);
+                iov.iov_base = delta;
+                iov.iov_len = n;
+            }
+        }
+
+        ch.txRefUses = (flags & TYPE_PACKED_DELTA) ? (ch.txRefUses + 1) : 0;
+        memcpy(ch.txRef, msg, len);
+        ch.txRefLen = len;
+        if (flags) {
+            uint8_t hdrLen = (flags & TYPE_PACKED_DELTA) ? 1 : 0;
+            ++stats.txPacked;
+            stats.txPackSaved += len - (hdrLen + iov.iov_len);
+        }
+    }
+
+    QueueFrame(channel, flags, &tag, (flags & TYPE_PACKED_DELTA) ? 1 : 0, piov, off, iov.iov_len);
+}
+
+/*
+ * Queue the channel's batch now rather than when it is due, waiting for room
+ * in its txRing as needed.  The caller must hold the lock.
+ */
+bool SMsgLink::CloseBatch(uint8_t channel)
+{
+    Channel& ch = *channels[channel];
+
+    // Others may add to the batch while the lock is dropped waiting for room.
+    while (ch.txBatchCount > 0) {
+        uint8_t room = ch.txBatchLen + FRAME_OVERHEAD;
+        if (ch.TxRoom() >= room) {
+            QueueBatch(channel);
+        } else if (!WaitForTx(ch, room, ch.txSent)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Cut a wait short so that it ends when the next batch still inside its
+ * window is due.  Batches already due are waiting for room, and that comes
+ * with input anyway.  The caller must hold the lock.
+ */
+uint32_t SMsgLink::BatchTimeout(uint32_t timeout) const
+{
+    uint32_t now = GetTimeUS();
+    for (uint8_t i = 0; i < SMsg::MAX_CHANNELS; ++i) {
+        const Channel* ch = channels[i];
+        if (ch && (ch->txBatchCount > 0)) {
+            uint32_t age = now - ch->txBatchTime;
+            if ((age < ch->batchWindow) && ((ch->batchWindow - age) < timeout)) {
+                timeout = ch->batchWindow - age;
+            }
+        }
+    }
+    return timeout;
+}
+
+/*
+ * Wait for any other thread queueing fragments on the channel to finish.  The
+ * caller must hold the lock.
+ */
+bool SMsgLink::WaitForWriter(Channel& ch)
+{
+    while (ch.txFragging) {
+        if (!WaitForInput(TX_POLL_TO)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Pick the channel to take the next frame from, going round robin from
+ * cursor within each priority.  Urgent channels go first unless
+ * URGENT_RUN_MAX urgent frames in a row have already gone ahead of a bulk
+ * frame.  offsets says how much of each channel's txRing has been taken
+ * already.  passed is set if the pick goes ahead of a waiting bulk frame.
+ * Returns -1 if there is nothing left to send.
+ */
+int SMsgLink::PickTxChannel(const uint8_t* offsets, const uint8_t* cursor, bool& passed) const
+{
+    int found[SMsg::PRIORITY_COUNT];
+    for (uint8_t p = 0; p < SMsg::PRIORITY_COUNT; ++p) {
+        found[p] = -1;
+        for (uint8_t i = 0; i < SMsg::MAX_CHANNELS; ++i) {
+            uint8_t c = (cursor[p] + i) % SMsg::MAX_CHANNELS;
+            const Channel* ch = channels[c];
+            if (ch && (ch->priority == p) && ((uint8_t)(ch->txTail + offsets[c]) != ch->txHead)) {
+                found[p] = c;
+                break;
+            }
+        }
+    }
+
+    int bulk = found[SMsg::PRIORITY_BULK];
+    int urgent = found[SMsg::PRIORITY_URGENT];
+    passed = (urgent >= 0) && (bulk >= 0);
+    if (passed && (txUrgentRun >= URGENT_RUN_MAX)) {
+        passed = false;
+        return bulk;
+    }
+    return (urgent >= 0) ? urgent : bulk;
+}
+
+/*
+ * Push as many whole queued frames as the Arduino has credits for to the tty
+ * in a single system call, taking one frame from each channel in turn,
+ * urgent channels first (see PickTxChannel()).  Frames are never started
+ * without credit for the whole frame since the Arduino only returns credits
+ * once it has read a complete message, and a frame that the tty only took
+ * part of is finished before any other.  Nothing goes out while the link is
+ * being opened, and a link that needs opening again only starts on that
+ * here (see Resync()).  The caller must hold the lock.
+ */
+bool SMsgLink::ServiceTx()
+{
+    struct {
+        uint8_t channel;
+        uint8_t offset;     // from the channel's txTail
+        uint8_t size;
+    } batch[TX_BATCH];
+    uint8_t offsets[SMsg::MAX_CHANNELS];
+    uint8_t count = 0;
+    uint8_t c;
+
+    if (!ServiceConnect()) {
+        return true;
+    }
+
+    uint32_t now = GetTimeUS();
+    if ((txCredits < TX_WINDOW) && ((now - txCreditTime) > CREDIT_TO)) {
+        ++txStallRun;
+        txCredits = TX_WINDOW;
+        txCreditTime = now;
+        ++stats.creditTimeouts;
+        TRACE("smsg credit timeout", txCredits);
+        ResetAckTracking();
+    }
+
+    if (resyncAsked ||
+        (synced ? ((rxErrorRun >= RESYNC_ERRORS) || (txStallRun >= RESYNC_STALLS)) :
+         ((now - resyncTime) >= RESYNC_HOLDOFF))) {
+        Resync();
+        return true;
+    }
+
+    // Queue batches that are full or whose window is up.
+    for (c = 0; c < SMsg::MAX_CHANNELS; ++c) {
+        Channel* ch = channels[c];
+        if (!ch || (ch->txBatchCount == 0) || (ch->TxRoom() < ch->txBatchLen + FRAME_OVERHEAD)) {
+            continue;
+        }
+        if (((ch->txBatchLen + 2) > SMsg::MAX_MSG_LEN) || ((now - ch->txBatchTime) >= ch->batchWindow)) {
+            QueueBatch(c);
+        }
+    }
+
+    memset(offsets, 0, sizeof(offsets));
+    if (txCur >= 0) {
+        batch[count].channel = txCur;
+        batch[count].offset = 0;
+        batch[count].size = txPaid;
+        offsets[txCur] = txPaid;
+        ++count;
+    }
+
+    uint8_t cursor[SMsg::PRIORITY_COUNT];
+    memcpy(cursor, txNext, sizeof(cursor));
+    while (count < TX_BATCH) {
+        bool passed;
+        int next = PickTxChannel(offsets, cursor, passed);
+        if (next < 0) {
+            break;
+        }
+        c = next;
+        Channel* ch = channels[c];
+        uint8_t size = ch->txRing[(uint8_t)(ch->txTail + offsets[c])] + FRAME_OVERHEAD;
+        if (size > txCredits) {
+            break;
+        }
+        txCredits -= size;
+        txCreditTime = now;
+        batch[count].channel = c;
+        batch[count].offset = offsets[c];
+        batch[count].size = size;
+        offsets[c] += size;
+        ++count;
+        cursor[ch->priority] = (c + 1) % SMsg::MAX_CHANNELS;
+        txUrgentRun = passed ? (txUrgentRun + 1) : 0;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    struct iovec iov[2 * TX_BATCH];
+    int iovcnt = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        Channel& ch = *channels[batch[i].channel];
+        uint8_t start = ch.txTail + batch[i].offset;
+        iov[iovcnt].iov_base = &ch.txRing[start];
+        if ((size_t)start + batch[i].size > sizeof(ch.txRing)) {
+            iov[iovcnt].iov_len = sizeof(ch.txRing) - start;
+            ++iovcnt;
+            iov[iovcnt].iov_base = &ch.txRing[0];
+            iov[iovcnt].iov_len = batch[i].size - iov[iovcnt - 1].iov_len;
+        } else {
+            iov[iovcnt].iov_len = batch[i].size;
+        }
+        ++iovcnt;
+    }
+
+    ssize_t ret = writev(fd, iov, iovcnt);
+    TRACE("smsg writev", ret);
+    if (ret < 0) {
+        if ((errno != EAGAIN) && (errno != EINTR)) {
+            return false;
+        }
+        ret = 0;
+    }
+    stats.txBytes += ret;
+
+    // Account for what the tty took.  Frames it did not start on get their
+    // credits back and wait for the next turn.
+    bool continuing = (txCur >= 0);
+    bool stalled = false;
+    txCur = -1;
+    txPaid = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (stalled) {
+            txCredits += batch[i].size;
+            continue;
+        }
+
+        Channel& ch = *channels[batch[i].channel];
+        uint8_t sent = ((size_t)ret < batch[i].size) ? ret : batch[i].size;
+        ret -= sent;
+        ch.txTail += sent;
+        ch.txSent += sent;
+        txWritten += sent;
+
+        if (sent == batch[i].size) {
+            txNext[ch.priority] = (batch[i].channel + 1) % SMsg::MAX_CHANNELS;
+            TrackFrameSent(now);
+        } else {
+            stalled = true;
+            if ((sent == 0) && !((i == 0) && continuing)) {
+                txCredits += batch[i].size;
+            } else {
+                txCur = batch[i].channel;
+                txPaid = batch[i].size - sent;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Keep the transmit side moving until there are at least room bytes free in
+ * the channel's txRing and its byte count sent has reached sent.  The caller
+ * must hold the lock.
+ */
+bool SMsgLink::WaitForTx(Channel& ch, uint8_t room, uint32_t sent)
+{
+    while (true) {
+        if (!ServiceTx()) {
+            return false;
+        }
+        if ((ch.TxRoom() >= room) && ((int32_t)(ch.txSent - sent) >= 0)) {
+            return true;
+        }
+        if (!WaitForInput(TX_POLL_TO)) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Wait up to timeout microseconds for something to happen on the link.  Only
+ * one thread waits on the tty at a time.  It reads and parses whatever comes
+ * in for everybody, and other threads wait on rxCond to check their own
+ * channels.  The lock is dropped while waiting.  The caller must hold the
+ * lock.
+ *
+ * Returns false if the tty failed.
+ */
+bool SMsgLink::WaitForInput(uint32_t timeout)
+{
+    timeout = BatchTimeout(timeout);
+    if (txCredits < TX_WINDOW) {
+        // Wake up in time to give up on credits that are not coming, rather
+        // than leave output waiting for the whole timeout.
+        uint32_t waited = GetTimeUS() - txCreditTime;
+        uint32_t left = (waited < CREDIT_TO) ? (CREDIT_TO - waited + 1) : 1;
+        if (left < timeout) {
+            timeout = left;
+        }
+    }
+    if (connStep != CONNECT_DONE) {
+        uint32_t waited = GetTimeUS() - connTime;
+        uint32_t left = (waited < connTimeout) ? (connTimeout - waited + 1) : 1;
+        if (left < timeout) {
+            timeout = left;
+        }
+    }
+    if (rxReading) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += timeout * 1000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&rxCond, &lock, &ts);
+        return true;
+    }
+
+    bool midMsg = (rxState != RX_LENGTH);
+    bool kernelFull = (txCur >= 0);
+    fd_set rfds;
+    fd_set wfds;
+    struct timeval to = { 0, (midMsg && (timeout > rdTimeout)) ? rdTimeout : timeout };
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(fd, &rfds);
+    FD_SET(fd, &wfds);
+
+    rxReading = true;
+    pthread_mutex_unlock(&lock);
+    int ret = select(fd + 1, &rfds, kernelFull ? &wfds : NULL, NULL, &to);
+    pthread_mutex_lock(&lock);
+    rxReading = false;
+
+    bool ok = true;
+    if (ret < 0) {
+        ok = (errno == EINTR);
+    } else if ((ret > 0) && FD_ISSET(fd, &rfds)) {
+        ssize_t rret = FillRxRing();
+        ok = ((rret > 0) || ((rret < 0) && ((errno == EAGAIN) || (errno == EINTR))));
+    } else if ((ret == 0) && midMsg) {
+        RxTimedOut();
+    }
+
+    ParseRx();
+    ServiceTx();
+    DumpStatsIfDue();
+    pthread_cond_broadcast(&rxCond);
+    return ok;
+}
+
+
+/*
+ * Pull everything the tty has ready into rxRing with a single system call.
+ * The frame being parsed stays in rxRing until it turns out good, in case
+ * it has to be gone back over.
+ */
+ssize_t SMsgLink::FillRxRing()
+{
+    struct iovec iov[2];
+    int iovcnt = 1;
+    uint8_t start = (rxState == RX_LENGTH) ? rxTail : rxMark;
+    // Keep one slot open to tell full from empty.
+    uint8_t space = start - rxHead - 1;
+
+    if ((fd <= 0) || (space == 0)) {
+        return 0;
+    }
+
+    iov[0].iov_base = &rxRing[rxHead];
+    if ((size_t)rxHead + space > sizeof(rxRing)) {
+        iov[0].iov_len = sizeof(rxRing) - rxHead;
+        iov[1].iov_base = &rxRing[0];
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    } else {
+        iov[0].iov_len = space;
+    }
+
+    ssize_t ret = readv(fd, iov, iovcnt);
+    if (ret > 0) {
+        rxHead += ret;
+        rxTime = GetTimeUS();
+        stats.rxBytes += ret;
+        TRACE("smsg read", ret);
+    }
+    return ret;
+}
+
+/*
+ * Run the buffered bytes through the receive state machine.  Credits are
+ * applied as they come in and completed messages go to their channel's
+ * queue.  Messages for channels nobody has open are dropped.  A bad frame
+ * sends the parser back over its bytes to find where the next one starts
+ * (see Rescan()).  While the link is being opened the bytes go to the
+ * handshake instead.  The caller must hold the lock.
+ */
+void SMsgLink::ParseRx()
+{
+    bool queued = false;
+
+    if (!ServiceConnect()) {
+        return;
+    }
+
+    while (rxTail != rxHead) {
+        if (rxState == RX_LENGTH) {
+            rxMark = rxTail;
+        }
+        uint8_t b = rxRing[rxTail++];
+
+        switch (rxState) {
+        case RX_LENGTH:
+            if (rxRescanning && (b & CTRL_FLAG) && ((int8_t)(rxMark - rxScanEnd) < 0)) {
+                // Most likely part of the bad frame rather than a control
+                // byte of its own.  A credit taken from it could overrun
+                // the Arduino, while a real one missed is made up for by
+                // CREDIT_TO.
+                ++rxDiscarded;
+                break;
+            }
+            if ((b & CTRL_TYPE_MASK) == CTRL_CREDIT) {
+                uint16_t credits = txCredits + (b & CREDIT_MASK);
+                txCredits = (credits > TX_WINDOW) ? TX_WINDOW : credits;
+                txCreditTime = GetTimeUS();
+                if (rxErrorRun == 0) {
+                    txStallRun = 0;
+                }
+                TrackCredits(b & CREDIT_MASK, txCreditTime);
+                TRACE("smsg credit", b & CREDIT_MASK);
+                break;
+            }
+            if (b == CTRL_SYNC_ACK) {
+                // Late reply to a sync attempt that was already given up on.
+                ++rxDiscarded;
+                rxPos = 1;
+                rxState = RX_SYNC_ACK;
+                break;
+            }
+            if (b == CTRL_RESYNC) {
+                // Only taken at its word while the input is in step.  After
+                // a bad frame it may be part of one whose start was missed.
+                TRACE("smsg resync asked", rxErrorRun);
+                if (rxErrorRun == 0) {
+                    resyncAsked = true;
+                } else {
+                    ++rxErrorRun;
+                }
+                break;
+            }
+            if (b > SMsg::MAX_MSG_LEN) {
+                if (Rescan()) {
+                    ++stats.rxLengthErrors;
+                    TRACE_ERROR("smsg rx bad length", b);
+                }
+                break;
+            }
+            rxLen = b;
+            rxState = RX_TYPE;
+            break;
+
+        case RX_TYPE:
+            rxType = b;
+            rxPos = 0;
+            rxState = (rxLen > 0) ? RX_PAYLOAD : RX_SUM_MSB;
+            break;
+
+        case RX_PAYLOAD:
+            rxFrame[rxPos++] = b;
+            if (rxPos == rxLen) {
+                rxState = RX_SUM_MSB;
+            }
+            break;
+
+        case RX_SUM_MSB:
+            rxSumMSB = b;
+            rxState = RX_SUM_LSB;
+            break;
+
+        case RX_SYNC_ACK:
+            ++rxDiscarded;
+            if (++rxPos == SYNC_LEN) {
+                ResetRx();
+            }
+            break;
+
+        case RX_SUM_LSB: {
+            CheckSum sum(sumMode);
+            sum.AddByte(rxLen);
+            sum.AddByte(rxType);
+            sum.Add(rxFrame, rxLen);
+            rxState = RX_LENGTH;
+
+            if ((sum.GetSumMSB() != rxSumMSB) || (sum.GetSumLSB() != b)) {
+                if (Rescan()) {
+                    ++stats.rxChecksumErrors;
+                    TRACE_ERROR("smsg rx bad checksum", rxType);
+                }
+                break;
+            }
+
+            ++stats.rxFrames;
+            rxErrorRun = 0;
+            txStallRun = 0;
+            rxRescanning = false;
+            TRACE("smsg rx frame", (rxType << 8) | rxLen);
+            if (rxHadFrame) {
+                stats.rxGap.Record(rxTime - rxLastFrameTime);
+            }
+            rxLastFrameTime = rxTime;
+            rxHadFrame = true;
+
+            Channel* ch = channels[rxType & TYPE_CHANNEL_MASK];
+            uint8_t flags = rxType & TYPE_FLAGS_MASK;
+            if (!ch) {
+                break;
+            }
+            if ((flags == 0) || (flags == TYPE_BATCH)) {
+                if (ch->rxFragActive) {
+                    // The rest of a fragmented message is not coming.
+                    ch->rxFragActive = false;
+                    ch->rxError = true;
+                    ++stats.rxDropped;
+                }
+                if (flags == TYPE_BATCH) {
+                    queued = UnpackBatch(*ch) || queued;
+                } else if (rxLen > 0) {
+                    PushMsg(*ch, rxLen, rxFrame, NULL);
+                    queued = true;
+                }
+            } else if ((flags & ~TYPE_FRAG_LAST) == TYPE_FRAG) {
+                queued = AddFragment(*ch, (flags & TYPE_FRAG_LAST) != 0) || queued;
+            }
+            break;
+        }
+        }
+    }
+
+    if (queued) {
+        pthread_cond_broadcast(&rxCond);
+    }
+}
+
+/*
+ * Add the fragment in rxFrame to the message being put back together on the
+ * channel.  A fragment that does not follow on from the ones before it, or
+ * that would make the message longer than MAX_LARGE_MSG_LEN, throws the
+ * whole message away.  The caller must hold the lock.
+ *
+ * Returns true if this completed a message and it was queued.
+ */
+bool SMsgLink::AddFragment(Channel& ch, bool last)
+{
+    if (rxLen < FRAG_HEADER_LEN) {
+        ch.rxFragActive = false;
+        ch.rxError = true;
+        ++stats.rxDropped;
+        return false;
+    }
+
+    uint8_t id = rxFrame[0];
+    uint8_t index = rxFrame[1];
+    uint8_t len = rxLen - FRAG_HEADER_LEN;
+
+    if (index == 0) {
+        if (ch.rxFragActive) {
+            ch.rxError = true;
+            ++stats.rxDropped;
+        }
+        if (!ch.rxFragBuf) {
+            ch.rxFragBuf = new uint8_t[SMsg::MAX_LARGE_MSG_LEN];
+        }
+        ch.rxFragActive = true;
+        ch.rxFragId = id;
+        ch.rxFragLen = 0;
+        ch.rxFragNext = 0;
+    } else if (!ch.rxFragActive) {
+        // The start of this message was lost and has already been reported.
+        return false;
+    }
+
+    if ((id != ch.rxFragId) || (index != ch.rxFragNext) ||
+        ((ch.rxFragLen + len) > SMsg::MAX_LARGE_MSG_LEN)) {
+        ch.rxFragActive = false;
+        ch.rxError = true;
+        ++stats.rxDropped;
+        return false;
+    }
+
+    memcpy(&ch.rxFragBuf[ch.rxFragLen], &rxFrame[FRAG_HEADER_LEN], len);
+    ch.rxFragLen += len;
+    ++ch.rxFragNext;
+
+    if (!last) {
+        return false;
+    }
+
+    // The queue entry takes over the buffer.
+    ch.rxFragActive = false;
+    PushMsg(ch, ch.rxFragLen, NULL, ch.rxFragBuf);
+    ch.rxFragBuf = NULL;
+    return true;
+}
+
+/*
+ * Queue each message coalesced into the batch frame in rxFrame.  A length
+ * that is 0 or runs past the end of the frame throws away the rest of the
+ * batch.  The caller must hold the lock.
+ *
+ * Returns true if any messages were queued.
+ */
+bool SMsgLink::UnpackBatch(Channel& ch)
+{
+    uint8_t pos = 0;
+    bool queued = false;
+
+    while (pos < rxLen) {
+        uint8_t len = rxFrame[pos++];
+        if ((len == 0) || (len > (rxLen - pos))) {
+            ch.rxError = true;
+            ++stats.rxDropped;
+            break;
+        }
+        PushMsg(ch, len, &rxFrame[pos], NULL);
+        pos += len;
+        ++stats.rxCoalesced;
+        queued = true;
+    }
+    return queued;
+}
+
+/*
+ * Queue a received message on a channel, dropping the oldest one if the
+ * queue is full.  Every channel's messages are parsed by whichever thread
+ * reads, and nothing tells the Arduino to hold off, so a channel that is not
+ * being read loses messages this way.  Its reader gets an error where they
+ * went missing.  Short messages are copied from data.  Put back together
+ * ones hand over their buffer in large.  This bounds the memory held for a
+ * channel to RX_QUEUE_SIZE + 1 buffers of MAX_LARGE_MSG_LEN bytes.  An
+ * error pending on the channel goes with the message so that the reader
+ * sees it between the messages it fell between.  The caller must hold the
+ * lock.
+ */
+void SMsgLink::PushMsg(Channel& ch, uint16_t len, const uint8_t* data, uint8_t* large)
+{
+    if (ch.rxQueueCount == RX_QUEUE_SIZE) {
+        Msg& old = ch.rxQueue[ch.rxQueueHead];
+        delete [] old.large;
+        old.large = NULL;
+        ch.rxQueueHead = (ch.rxQueueHead + 1) % RX_QUEUE_SIZE;
+        --ch.rxQueueCount;
+        ch.rxQueue[ch.rxQueueHead].errorBefore = true;
+        ++stats.rxDropped;
+    }
+    Msg& msg = ch.rxQueue[(ch.rxQueueHead + ch.rxQueueCount) % RX_QUEUE_SIZE];
+    msg.len = len;
+    msg.errorBefore = ch.rxError;
+    ch.rxError = false;
+    msg.large = large;
+    if (!large) {
+        memcpy(msg.data, data, len);
+    }
+    ++ch.rxQueueCount;
+}
+
+/*
+ * A bad message can't be pinned on any one channel, so report it on all of
+ * them.  The caller must hold the lock.
+ */
+void SMsgLink::SetRxError()
+{
+    for (uint8_t i = 0; i < SMsg::MAX_CHANNELS; ++i) {
+        if (channels[i]) {
+            channels[i]->rxError = true;
+        }
+    }
+}
+
+/*
+ * Hand the oldest message received on a channel to the caller.  A message
+ * too big for the caller's buffer is dropped.  The caller must hold the lock.
+ *
+ * Returns the payload length, 0 if nothing is queued, or -1 if the message
+ * was dropped or a bad message was discarded since the last call.
+ */
+int SMsgLink::PopMsg(Channel& ch, uint8_t* buf, uint16_t len)
+{
+    if (ch.rxQueueCount == 0) {
+        if (ch.rxError) {
+            ch.rxError = false;
+            return -1;
+        }
+        return 0;
+    }
+
+    Msg& msg = ch.rxQueue[ch.rxQueueHead];
+    if (msg.errorBefore) {
+        msg.errorBefore = false;
+        return -1;
+    }
+    ch.rxQueueHead = (ch.rxQueueHead + 1) % RX_QUEUE_SIZE;
+    --ch.rxQueueCount;
+
+    int ret = -1;
+    if (msg.len <= len) {
+        memcpy(buf, msg.large ? msg.large : msg.data, msg.len);
+        ret = msg.len;
+    } else {
+        ++stats.rxDropped;
+    }
+    delete [] msg.large;
+    msg.large = NULL;
+    return ret;
+}
+
+uint16_t SMsgLink::GetMaxMsgLen() const
+{
+    return (caps & CAP_FRAG) ? SMsg::MAX_LARGE_MSG_LEN : SMsg::MAX_MSG_LEN;
+}
+
+uint32_t SMsgLink::GetBaudRate() const
+{
+    return BAUD_RATES[baud].bps;
+}
+
+void SMsgLink::ResetRx()
+{
+    rxState = RX_LENGTH;
+    rxLen = 0;
+    rxPos = 0;
+}
+
+/*
+ * The frame that started at rxMark turned out bad, or the byte there was
+ * not the start of a frame at all.  Throw that byte away and go back over
+ * the ones after it, since they may hold the start of the next frame, or
+ * frames and credits for other channels.  Nothing else is thrown away and
+ * nothing waits on the tty.  Until a good frame turns up, further bad
+ * frames and stray bytes are only the same error seen again.  rxScanEnd
+ * follows the end of what was thrown away so far, so that control bytes
+ * before it can be told apart from ones that came after.  The caller must
+ * hold the lock.
+ *
+ * Returns true if this is a new error rather than more of the last one.
+ */
+bool SMsgLink::Rescan()
+{
+    bool fresh = !rxRescanning;
+    rxRescanning = true;
+    if (fresh || ((int8_t)(rxMark - rxScanEnd) >= 0)) {
+        rxScanEnd = rxTail;
+    }
+    if (fresh) {
+        ++rxErrorRun;
+        ++stats.resyncs;
+        SetRxError();
+    }
+    TRACE("smsg rescan", (uint8_t)(rxTail - rxMark));
+    ++rxDiscarded;
+    rxTail = rxMark + 1;
+    ResetRx();
+    return fresh;
+}
+
+/*
+ * Nothing more has come in for a frame that is part way in.  Go back over
+ * its bytes, and over those of any other frame that they then seem to
+ * start, until the parser is no longer waiting in the middle of one.  The
+ * caller must hold the lock.
+ */
+void SMsgLink::RxTimedOut()
+{
+    bool fresh = false;
+    while (rxState != RX_LENGTH) {
+        fresh = Rescan() || fresh;
+        ParseRx();
+    }
+    if (fresh) {
+        ++stats.rxTimeouts;
+        TRACE_ERROR("smsg rx timeout", rxMark);
+    }
+}
+
+/*
+ * Open the link and wait until that is done, however it turns out.  Only
+ * the constructor waits like this.  Everything else lets ServiceConnect()
+ * move the link along as replies come in and timeouts pass.
+ */
+void SMsgLink::Connect()
+{
+    StartConnect();
+    while (!ServiceConnect()) {
+        uint32_t waited = GetTimeUS() - connTime;
+        if ((waited < connTimeout) && WaitForMsg(connTimeout - waited)) {
+            FillRxRing();
+        }
+    }
+}
+
+/*
+ * Start opening the link from the speed the tty is at: sync with the
+ * Arduino side, then move the link to the fastest speed up to maxBaud that
+ * works.  Nothing waits here.  The caller must hold the lock, or be the
+ * constructor.
+ */
+void SMsgLink::StartConnect()
+{
+    connIndex = 0;
+    connFalling = false;
+    StartSync(CONNECT_SYNC, SYNC_TRIES);
+}
+
+/*
+ * The Arduino reset or otherwise lost track of the link (see RESYNC_ERRORS).
+ * Throw away the rest of any partly written frame, since the Arduino would
+ * only take it for garbage, and ask the Arduino to go to the base rate in
+ * case it is still listening at this speed.  Then open the link again from
+ * the base rate, which starts the credit window over, goes back to the plain
+ * sum until the capabilities have been agreed to again, and makes every
+ * compressed channel send a frame that stands on its own next.  Every
+ * channel is held up while this goes on, but nothing waits for it here.
+ * The caller must hold the lock.
+ */
+void SMsgLink::Resync()
+{
+    TRACE_ERROR("smsg resync", rxErrorRun);
+    ++stats.reconnects;
+
+    if (txCur >= 0) {
+        Channel& ch = *channels[txCur];
+        ch.txTail += txPaid;
+        ch.txSent += txPaid;
+        txCur = -1;
+        txPaid = 0;
+    }
+    for (uint8_t i = 0; i < SMsg::MAX_CHANNELS; ++i) {
+        Channel* ch = channels[i];
+        if (ch) {
+            ch->txRefLen = 0;
+            ch->txRefUses = 0;
+            if (ch->rxFragActive) {
+                ch->rxFragActive = false;
+                ++stats.rxDropped;
+            }
+        }
+    }
+    SetRxError();
+
+    bool asked = false;
+    if (synced && (baud != BAUD_BASE_INDEX)) {
+        uint8_t req[] = { CTRL_BAUD, BAUD_BASE_INDEX, (uint8_t)~BAUD_BASE_INDEX };
+        if (write(fd, req, sizeof(req)) == sizeof(req)) {
+            tcdrain(fd);
+            asked = true;
+        }
+    }
+    SetBaud(BAUD_BASE_INDEX);
+    synced = false;
+    txCredits = TX_WINDOW;
+    txCreditTime = GetTimeUS();
+    ResetAckTracking();
+    ResetRx();
+    if (asked) {
+        connStep = CONNECT_DROP;
+        WaitFor(NULL, 0, BAUD_SETTLE);
+    } else {
+        StartConnect();
+    }
+}
+
+/*
+ * Move the link along as far as the replies that came in and the timeouts
+ * that passed allow.  While the link is being opened every byte that comes
+ * in belongs to the handshake, and no message goes out.  The caller must
+ * hold the lock.
+ *
+ * Returns true once the link is open, false while it is still being opened.
+ */
+bool SMsgLink::ServiceConnect()
+{
+    while (connStep != CONNECT_DONE) {
+        int reply = ScanReply();
+        if ((reply < 0) && ((GetTimeUS() - connTime) < connTimeout)) {
+            return false;
+        }
+
+        switch (connStep) {
+        case CONNECT_DROP:
+            StartConnect();
+            break;
+
+        case CONNECT_SYNC:
+        case CONNECT_PROBE:
+        case CONNECT_CHECK:
+        case CONNECT_RESYNC:
+            if ((reply < 0) && (connTries > 0)) {
+                SendSync();
+            } else {
+                SyncDone(reply);
+            }
+            break;
+
+        case CONNECT_BAUD:
+            if (reply == connIndex) {
+                tcdrain(fd);
+                SetBaud(connIndex);
+                connStep = CONNECT_SETTLE;
+                WaitFor(NULL, 0, BAUD_SETTLE);
+            } else {
+                BaudFailed();
+            }
+            break;
+
+        case CONNECT_SETTLE:
+            connChecks = BAUD_PROBES;
+            connDiscarded = rxDiscarded;
+            StartSync(CONNECT_CHECK, 1);
+            break;
+
+        case CONNECT_FALLBACK:
+            StartSync(CONNECT_RESYNC, SYNC_TRIES);
+            break;
+
+        case CONNECT_DONE:
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Resynchronize with the Arduino side.  Send a sync frame and throw away
+ * everything up to the matching sync ack.  The Arduino sends the ack once it
+ * has read the sync frame, so anything after it is new, and the Arduino's
+ * receive buffer is empty at that point so the credit window starts over.
+ * A sketch that is not running, or that was built against an older SMsg
+ * library, never answers, so give up after the given number of attempts.
+ */
+void SMsgLink::StartSync(ConnectStep step, uint8_t tries)
+{
+    ResetRx();
+    rxRescanning = false;
+    synced = false;
+    caps = 0;
+    sumMode = CheckSum::SUM;
+    connStep = step;
+    connTries = tries;
+    SendSync();
+}
+
+void SMsgLink::SendSync()
+{
+    uint8_t frame[SYNC_LEN];
+
+    // A new nonce each try keeps a slow ack to an earlier try from being
+    // mistaken for this one.
+    frame[0] = CTRL_SYNC;
+    memcpy(&frame[1], SYNC_MAGIC, sizeof(SYNC_MAGIC));
+    frame[SYNC_LEN - 2] = syncNonce++;
+    frame[SYNC_LEN - 1] = LINK_CAPS;
+    --connTries;
+    if (write(fd, frame, sizeof(frame)) != sizeof(frame)) {
+        connTries = 0;
+        WaitFor(NULL, 0, 0);
+        return;
+    }
+
+    frame[0] = CTRL_SYNC_ACK;
+    WaitFor(frame, SYNC_LEN - 1, SYNC_TO);
+}
+
+/*
+ * A sync handshake is over.  reply holds the capabilities the Arduino agreed
+ * to, or is -1 if it never answered.  Decide what comes next.
+ */
+void SMsgLink::SyncDone(int reply)
+{
+    ResetRx();
+    if (reply >= 0) {
+        caps = reply & LINK_CAPS;
+        sumMode = (caps & CAP_CRC16) ? CheckSum::CRC16 : CheckSum::SUM;
+        synced = true;
+        txCredits = TX_WINDOW;
+        txCreditTime = GetTimeUS();
+        ++stats.syncs;
+        TRACE("smsg synced", caps);
+        ResetAckTracking();
+    }
+
+    switch (connStep) {
+    case CONNECT_SYNC:
+    case CONNECT_PROBE:
+        if (synced) {
+            Negotiate();
+        } else {
+            // A process that died without closing the link properly may
+            // have left the Arduino at another speed.
+            Probe();
+        }
+        break;
+
+    case CONNECT_CHECK:
+        if (!synced || (rxDiscarded != connDiscarded)) {
+            BaudFailed();
+        } else if (--connChecks > 0) {
+            StartSync(CONNECT_CHECK, 1);
+        } else if (connFalling) {
+            ConnectDone();
+        } else {
+            Negotiate();
+        }
+        break;
+
+    case CONNECT_RESYNC:
+        if (!synced) {
+            SetBaud(connFrom);
+            FallBack();
+        } else if (connGood == BAUD_BASE_INDEX) {
+            ConnectDone();
+        } else {
+            ChangeBaud(connGood);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * Try a single sync handshake at the next speed other than the base rate,
+ * and settle for the base rate once they have all been tried.
+ */
+void SMsgLink::Probe()
+{
+    if (connIndex == BAUD_BASE_INDEX) {
+        ++connIndex;
+    }
+    if (connIndex < BAUD_COUNT) {
+        SetBaud(connIndex++);
+        StartSync(CONNECT_PROBE, 1);
+    } else {
+        SetBaud(BAUD_BASE_INDEX);
+        ConnectDone();
+    }
+}
+
+/*
+ * Read and throw away buffered input until the reply being waited for shows
+ * up, and return the byte that follows it, or -1 if it has not come yet.
+ * Everything but the reply itself counts as discarded.
+ */
+int SMsgLink::ScanReply()
+{
+    while (rxTail != rxHead) {
+        uint8_t b = rxRing[rxTail++];
+        ++rxDiscarded;
+        if (replyLen == 0) {
+            continue;
+        }
+        if (replyMatch == replyLen) {
+            rxDiscarded -= replyLen + 1;
+            return b;
+        }
+        if (b == reply[replyMatch]) {
+            ++replyMatch;
+        } else {
+            replyMatch = (b == reply[0]) ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Wait timeout microseconds for prefix and the byte that follows it, or
+ * just for the time to pass if len is 0.
+ */
+void SMsgLink::WaitFor(const uint8_t* prefix, uint8_t len, uint32_t timeout)
+{
+    if (len > 0) {
+        memcpy(reply, prefix, len);
+    }
+    replyLen = len;
+    replyMatch = 0;
+    connTime = GetTimeUS();
+    connTimeout = timeout;
+}
+
+/*
+ * The link is as open as it is going to get.
+ */
+void SMsgLink::ConnectDone()
+{
+    connStep = CONNECT_DONE;
+    rxErrorRun = 0;
+    txStallRun = 0;
+    resyncTime = GetTimeUS();
+    resyncAsked = false;
+}
+
+/*
+ * Switch the tty to one of the link speeds and scale the inter-byte timeout
+ * to match.
+ */
+bool SMsgLink::SetBaud(uint8_t index)
+{
+    TRACE("smsg baud", BAUD_RATES[index].bps);
+    baud = index;
+    rdTimeout = (RD_TO_BITS * 1000000) / BAUD_RATES[index].bps;
+    if (rdTimeout < RD_TO_MIN) {
+        rdTimeout = RD_TO_MIN;
+    }
+
+    if (fd > 0) {
+        struct termios tio;
+        if (tcgetattr(fd, &tio) != 0) {
+            return false;
+        }
+        cfsetspeed(&tio, BAUD_RATES[index].speed);
+        return (tcsetattr(fd, TCSANOW, &tio) == 0);
+    }
+    return true;
+}
+
+/*
+ * Move the link one speed closer to the fastest one up to maxBaud.  Going
+ * up is done one speed at a time so that the link ends up at the fastest
+ * one that both sides handle cleanly.  A link that came up above maxBaud
+ * goes straight down to it.
+ */
+void SMsgLink::Negotiate()
+{
+    if (!synced || !(caps & CAP_BAUD)) {
+        ConnectDone();
+        return;
+    }
+
+    uint8_t target = 0;
+    while (((target + 1) < BAUD_COUNT) && (BAUD_RATES[target + 1].bps <= maxBaud)) {
+        ++target;
+    }
+
+    connFalling = false;
+    if (target == baud) {
+        ConnectDone();
+    } else if (target < baud) {
+        connGood = BAUD_BASE_INDEX;
+        ChangeBaud(target);
+    } else {
+        connGood = baud;
+        ChangeBaud(baud + 1);
+    }
+}
+
+/*
+ * Ask the Arduino to switch to another speed.  Once it acks, follow it
+ * there and check the new speed with a few sync handshakes.
+ */
+void SMsgLink::ChangeBaud(uint8_t index)
+{
+    static const uint8_t ack[] = { CTRL_BAUD_ACK };
+    uint8_t req[] = { CTRL_BAUD, index, (uint8_t)~index };
+
+    connStep = CONNECT_BAUD;
+    connIndex = index;
+    if (write(fd, req, sizeof(req)) != sizeof(req)) {
+        WaitFor(NULL, 0, 0);
+    } else {
+        WaitFor(ack, sizeof(ack), SYNC_TO);
+    }
+}
+
+/*
+ * A speed change went wrong.  If it was part of a fallback already, the
+ * speed it went for does not work after all, so only the base rate is left.
+ */
+void SMsgLink::BaudFailed()
+{
+    if (connFalling) {
+        connGood = BAUD_BASE_INDEX;
+    } else {
+        connFalling = true;
+        connFallbacks = BAUD_FALLBACK_TRIES;
+    }
+    FallBack();
+}
+
+/*
+ * A speed change went wrong, so the Arduino may be at the old speed, at the
+ * new one, or on its way back to the base rate.  Tell it to go to the base
+ * rate in case it is listening at the speed the tty is at, wait out its own
+ * fallback and resynchronize at the base rate.  If that does not work the
+ * Arduino missed the request, so go back and ask again.  Once at the base
+ * rate, go straight to connGood, the fastest speed already known to work,
+ * and if even that fails this time, settle for the base rate.
+ */
+void SMsgLink::FallBack()
+{
+    uint8_t req[] = { CTRL_BAUD, BAUD_BASE_INDEX, (uint8_t)~BAUD_BASE_INDEX };
+
+    if (connFallbacks == 0) {
+        SetBaud(BAUD_BASE_INDEX);
+        ConnectDone();
+        return;
+    }
+    --connFallbacks;
+
+    connFrom = baud;
+    if (write(fd, req, sizeof(req)) == sizeof(req)) {
+        tcdrain(fd);
+    }
+    SetBaud(BAUD_BASE_INDEX);
+    connStep = CONNECT_FALLBACK;
+    WaitFor(NULL, 0, BAUD_FALLBACK_TO);
+}
+
+
+bool SMsgLink::WaitForMsg(uint32_t timeout)
+{
+    if (fd > 0) {
+        fd_set rfds;
+        struct timeval to = { 0, timeout };
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        return (select(fd + 1, &rfds, NULL, NULL, &to) > 0);
+    }
+    return false;
+}
+
+
+void SMsgLink::GetStats(SMsg::Stats& out)
+{
+    pthread_mutex_lock(&lock);
+    out = stats;
+    out.flushedBytes = rxDiscarded - statsDiscarded;
+    pthread_mutex_unlock(&lock);
+}
+
+void SMsgLink::ResetStats()
+{
+    pthread_mutex_lock(&lock);
+    stats.Reset();
+    statsDiscarded = rxDiscarded;
+    statsTime = GetTimeUS();
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Remember when a whole frame finished going to the tty.  Only the last
+ * ACK_TRACK_SIZE frames are tracked, which is more than fit in the credit
+ * window.  The caller must hold the lock.
+ */
+void SMsgLink::TrackFrameSent(uint32_t now)
+{
+    ++stats.txFrames;
+    if (ackCount == ACK_TRACK_SIZE) {
+        ackHead = (ackHead + 1) % ACK_TRACK_SIZE;
+        --ackCount;
+    }
+    uint8_t i = (ackHead + ackCount) % ACK_TRACK_SIZE;
+    ackTrack[i].end = txWritten;
+    ackTrack[i].time = now;
+    ++ackCount;
+}
+
+/*
+ * Credits come back in the order the bytes were sent, so every tracked frame
+ * that the running credited count has now passed has been read by the
+ * sketch.  The caller must hold the lock.
+ */
+void SMsgLink::TrackCredits(uint8_t credits, uint32_t now)
+{
+    txAcked += credits;
+    if ((int32_t)(txAcked - txWritten) > 0) {
+        // Credits for bytes already written off by a timeout or a sync.
+        txAcked = txWritten;
+    }
+    while ((ackCount > 0) && ((int32_t)(txAcked - ackTrack[ackHead].end) >= 0)) {
+        stats.ackLatency.Record(now - ackTrack[ackHead].time);
+        ackHead = (ackHead + 1) % ACK_TRACK_SIZE;
+        --ackCount;
+    }
+}
+
+/*
+ * The credit window started over without the credits for what was sent, so
+ * the frames in flight can no longer be timed.  The caller must hold the
+ * lock.
+ */
+void SMsgLink::ResetAckTracking()
+{
+    ackHead = 0;
+    ackCount = 0;
+    txAcked = txWritten;
+}
+
+/*
+ * Print the statistics if SMSG_STATS asked for them and they are due.  The
+ * caller must hold the lock.
+ */
+void SMsgLink::DumpStatsIfDue()
+{
+    if (statsPeriod == 0) {
+        return;
+    }
+    uint32_t now = GetTimeUS();
+    if ((now - statsTime) >= statsPeriod) {
+        statsTime = now;
+        SMsg::Stats snapshot = stats;
+        snapshot.flushedBytes = rxDiscarded - statsDiscarded;
+        fprintf(stderr, "SMsg %s at %u bps:\n", device.c_str(), BAUD_RATES[baud].bps);
+        snapshot.Print(stderr);
+    }
+}
@@ -0,0 +1,311 @@
+/**
+ * @file
+ * Shared serial link behind SMsg channels - Linino side.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef _SMSGLINK_H_
+#define _SMSGLINK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <string>
+
+#include <aj_tutorial/checksum.h>
+#include <aj_tutorial/smsg.h>
+
+/*
+ * One SMsgLink exists per tty no matter how many SMsg objects use it.  The
+ * link owns the file descriptor, the receive parser and the flow control
+ * credits.  Each open channel has its own receive queue and transmit ring.
+ * Whichever thread needs input reads the tty for everybody and files
+ * messages by channel.  Queued output goes out round robin, one frame per
+ * channel per turn, so a busy channel cannot starve the others.  Urgent
+ * channels get their turns ahead of bulk ones, though never so many in a
+ * row that bulk output stalls.  Messages too long for one frame are queued
+ * as a run of fragments and put back together per channel on the way in.
+ * A channel with coalescing turned on collects short messages in a batch
+ * that goes out as a single frame once it is full or its window is up.  A
+ * channel with compression turned on sends messages run-length encoded, or
+ * as the difference from the one before, whenever that makes the frame
+ * shorter.
+ */
+class SMsgLink {
+  public:
+    /*
+     * Get the link for a device, opening it if no channel is using it yet,
+     * and add a reference to one of its channels.  maxBaud only matters
+     * when the link gets opened.
+     */
+    static SMsgLink* Acquire(const char* dev, uint8_t channel, uint32_t maxBaud);
+
+    /*
+     * Drop a channel reference taken by Acquire().  The channel's queued
+     * output is flushed first.  The link closes when its last channel
+     * reference goes away.
+     */
+    void Release(uint8_t channel);
+
+    int Read(uint8_t channel, uint8_t* buf, uint16_t len);
+    int WriteV(uint8_t channel, const struct iovec* iov, int iovcnt, bool wait);
+    int TryRead(uint8_t channel, uint8_t* buf, uint16_t len);
+    int TryWrite(uint8_t channel, const uint8_t* buf, uint8_t len);
+    bool TryFlush(uint8_t channel);
+    bool Flush(uint8_t channel);
+    bool SetCoalescing(uint8_t channel, uint32_t window);
+    bool SetCompression(uint8_t channel, bool on);
+    void SetPriority(uint8_t channel, SMsg::Priority priority);
+
+    bool RxBuffered(uint8_t channel) const;
+    bool TxPending(uint8_t channel) const;
+
+    uint16_t GetMaxMsgLen() const;
+    uint32_t GetBaudRate() const;
+    bool IsSynced() const { return synced; }
+    uint32_t GetSyncTime() const { return syncTime; }
+    uint32_t GetDiscardedBytes() const { return rxDiscarded; }
+    void GetStats(SMsg::Stats& out);
+    void ResetStats();
+    int GetFD() const { return fd; }
+
+  private:
+    // Room for a full batch of 1 byte messages.
+    static const uint8_t RX_QUEUE_SIZE = 16;
+    static const uint8_t ACK_TRACK_SIZE = 16;
+
+    /*
+     * Receive parser states.  Bytes are pulled off the tty in bulk into
+     * rxRing and fed through this state machine one at a time.
+     */
+    enum RxState {
+        RX_LENGTH,
+        RX_TYPE,
+        RX_PAYLOAD,
+        RX_SUM_MSB,
+        RX_SUM_LSB,
+        RX_SYNC_ACK
+    };
+
+    /*
+     * Steps in opening the link (see ServiceConnect()).  Each one waits for
+     * a reply or for time to pass.
+     */
+    enum ConnectStep {
+        CONNECT_DONE,
+        CONNECT_DROP,           // the Arduino is going to the base rate
+        CONNECT_SYNC,           // sync handshakes at the speed the tty is at
+        CONNECT_PROBE,          // a sync handshake at another speed
+        CONNECT_BAUD,           // waiting for the ack to a speed change
+        CONNECT_SETTLE,         // the Arduino is switching speed
+        CONNECT_CHECK,          // sync handshakes at the new speed
+        CONNECT_FALLBACK,       // waiting out the Arduino's own fallback
+        CONNECT_RESYNC          // sync handshakes at the base rate after that
+    };
+
+    /*
+     * A received message.  Messages that came in fragments own the buffer
+     * they were put back together in.
+     */
+    struct Msg {
+        uint16_t len;
+        bool errorBefore;       // a bad message was thrown away just before
+        uint8_t* large;
+        uint8_t data[SMsg::MAX_MSG_LEN];
+    };
+
+    struct Channel {
+        Channel();
+        ~Channel();
+
+        uint8_t TxRoom() const { return txTail - txHead - 1; }
+
+        unsigned int refs;
+
+        Msg rxQueue[RX_QUEUE_SIZE];
+        uint8_t rxQueueHead;
+        uint8_t rxQueueCount;
+        bool rxError;
+
+        uint8_t* rxFragBuf;     // MAX_LARGE_MSG_LEN bytes, allocated on demand
+        uint16_t rxFragLen;
+        uint8_t rxFragId;
+        uint8_t rxFragNext;     // index of the next fragment expected
+        bool rxFragActive;      // a fragmented message is being put together
+
+        uint8_t txRing[256];    // indexed by uint8_t so wrap around is free
+        uint8_t txHead;
+        uint8_t txTail;
+        uint32_t txQueued;      // running byte counts used to tell when a
+        uint32_t txSent;        // given message has gone out
+        uint8_t txFragId;       // message ID for the next fragmented message
+        bool txFragging;        // a writer is queueing fragments
+
+        // Short messages waiting to share a frame, each as [length][message].
+        uint8_t txBatch[SMsg::MAX_MSG_LEN];
+        uint8_t txBatchLen;
+        uint8_t txBatchCount;
+        uint32_t txBatchTime;   // when the first message in the batch came
+        uint32_t batchWindow;   // microseconds, 0 when coalescing is off
+
+        // Last message sent in a frame of its own, which the next one may
+        // be sent as the difference from.
+        uint8_t txRef[SMsg::MAX_MSG_LEN];
+        uint8_t txRefLen;
+        uint8_t txRefUses;      // delta frames sent since the last key frame
+        bool txPack;            // compression is on
+
+        SMsg::Priority priority;
+    };
+
+    std::string device;
+    unsigned int refs;
+    int fd;
+    mutable pthread_mutex_t lock;
+    pthread_cond_t rxCond;      // signaled when messages get queued
+    bool rxReading;             // a thread is waiting on the tty for input
+
+    Channel* channels[SMsg::MAX_CHANNELS];
+
+    uint8_t rxRing[256];        // indexed by uint8_t so wrap around is free
+    uint8_t rxHead;
+    uint8_t rxTail;
+    uint8_t rxMark;             // where the frame being parsed started
+    bool rxRescanning;          // no good frame since a bad one
+    uint8_t rxScanEnd;          // just past the bytes thrown away since
+
+    RxState rxState;
+    uint8_t rxLen;
+    uint8_t rxType;
+    uint8_t rxPos;
+    uint8_t rxSumMSB;
+    uint8_t rxFrame[SMsg::MAX_MSG_LEN];
+
+    int txCur;                  // channel with a partly written frame or -1
+    uint8_t txPaid;             // bytes of that frame still to be written
+    uint8_t txNext[SMsg::PRIORITY_COUNT];   // channel to look at first for
+                                            // the next frame, per priority
+    uint8_t txUrgentRun;        // urgent frames sent in a row ahead of bulk
+    uint8_t txCredits;
+    uint32_t txCreditTime;
+
+    uint8_t baud;               // index into the table of link speeds
+    uint32_t rdTimeout;         // inter-byte timeout, scaled to the speed
+    uint8_t caps;               // capabilities agreed to in the sync handshake
+    CheckSum::Mode sumMode;
+    bool synced;
+    uint8_t syncNonce;
+    uint32_t syncTime;
+    uint32_t rxDiscarded;
+
+    ConnectStep connStep;
+    uint32_t connTime;          // when the current step started waiting
+    uint32_t connTimeout;       // how long it waits
+    uint8_t connTries;          // sync frames left to send in this step
+    uint8_t connChecks;         // sync handshakes left to check a new speed
+    uint8_t connIndex;          // speed being probed or switched to
+    uint8_t connGood;           // fastest speed known to work
+    uint8_t connFrom;           // speed the tty was at before falling back
+    uint8_t connFallbacks;      // fallback attempts left
+    bool connFalling;           // the speed change is part of a fallback
+    uint32_t connDiscarded;     // rxDiscarded when the checks started
+    uint8_t reply[8];           // what the reply waited for starts with
+    uint8_t replyLen;
+    uint8_t replyMatch;         // bytes of it seen so far
+
+    /*
+     * Statistics.  Frames handed to the tty are remembered by the running
+     * byte count at their end so that the credits covering them can be
+     * timed.
+     */
+    SMsg::Stats stats;
+    uint32_t statsDiscarded;    // rxDiscarded when the stats were reset
+    uint32_t statsPeriod;       // microseconds between dumps, 0 for none
+    uint32_t statsTime;
+    uint32_t rxTime;            // when rxRing was last filled
+    uint32_t rxLastFrameTime;
+    bool rxHadFrame;
+    uint32_t txWritten;         // running count of bytes handed to the tty
+    uint32_t txAcked;           // running count of bytes credited back
+    struct {
+        uint32_t end;           // txWritten at the end of the frame
+        uint32_t time;
+    } ackTrack[ACK_TRACK_SIZE];
+    uint8_t ackHead;
+    uint8_t ackCount;
+
+    uint32_t maxBaud;
+    uint32_t rxErrorRun;        // bad frames since the last good one
+    uint8_t txStallRun;         // credit timeouts since anything sensible
+                                // came in
+    uint32_t resyncTime;        // when the link was last (re)opened
+    bool resyncAsked;           // the Arduino sent CTRL_RESYNC
+
+    SMsgLink(const char* dev, uint32_t maxBaud);
+    ~SMsgLink();
+
+    void QueueFrame(uint8_t channel, uint8_t flags, const uint8_t* hdr, uint8_t hdrLen,
+                    const struct iovec*& iov, size_t& iovOff, uint8_t len);
+    bool QueueFragments(uint8_t channel, const struct iovec* iov, size_t len);
+    bool MakeRoom(uint8_t channel, uint8_t len, bool wait);
+    void QueueMsg(uint8_t channel, const struct iovec* iov, uint8_t len);
+    void QueueBatch(uint8_t channel);
+    void QueueMsgFrame(uint8_t channel, const uint8_t* msg, uint8_t len);
+    bool CloseBatch(uint8_t channel);
+    uint32_t BatchTimeout(uint32_t timeout) const;
+    bool WaitForWriter(Channel& ch);
+    bool WaitForTx(Channel& ch, uint8_t room, uint32_t sent);
+    bool ServiceTx();
+    int PickTxChannel(const uint8_t* offsets, const uint8_t* cursor, bool& passed) const;
+    bool WaitForInput(uint32_t timeout);
+    ssize_t FillRxRing();
+    void ParseRx();
+    bool AddFragment(Channel& ch, bool last);
+    bool UnpackBatch(Channel& ch);
+    void PushMsg(Channel& ch, uint16_t len, const uint8_t* data, uint8_t* large);
+    void SetRxError();
+    int PopMsg(Channel& ch, uint8_t* buf, uint16_t len);
+    void ResetRx();
+    bool Rescan();
+    void RxTimedOut();
+    void Connect();
+    void StartConnect();
+    void Resync();
+    bool ServiceConnect();
+    void StartSync(ConnectStep step, uint8_t tries);
+    void SendSync();
+    void SyncDone(int reply);
+    void Probe();
+    int ScanReply();
+    void WaitFor(const uint8_t* prefix, uint8_t len, uint32_t timeout);
+    void ConnectDone();
+    bool SetBaud(uint8_t index);
+    void Negotiate();
+    void ChangeBaud(uint8_t index);
+    void BaudFailed();
+    void FallBack();
+    bool WaitForMsg(uint32_t timeout);
+    void TrackFrameSent(uint32_t now);
+    void TrackCredits(uint8_t credits, uint32_t now);
+    void ResetAckTracking();
+    void DumpStatsIfDue();
+};
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file
+ * CheckSum microbenchmark
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <aj_tutorial/checksum.h>
+
+#define BYTES_PER_RUN (4 * 1024 * 1024)
+
+static uint8_t frame[255];
+static volatile uint16_t sink;
+
+static uint64_t GetTimeNS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static uint16_t RunStreaming(const uint8_t* buf, size_t len)
+{
+    CheckSum sum;
+    for (size_t i = 0; i < len; ++i) {
+        sum.AddByte(buf[i]);
+    }
+    return sum.GetSum();
+}
+
+static uint16_t RunScalar(const uint8_t* buf, size_t len)
+{
+    return CheckSum::SumScalar(buf, len);
+}
+
+static uint16_t RunBlocked(const uint8_t* buf, size_t len)
+{
+    return CheckSum::SumBlocked(buf, len);
+}
+
+static uint16_t RunCrc16(const uint8_t* buf, size_t len)
+{
+    return CheckSum::Crc16(buf, len);
+}
+
+/*
+ * Nanoseconds per frame of len bytes.
+ */
+static double Time(uint16_t (*fn)(const uint8_t*, size_t), size_t len)
+{
+    uint32_t iterations = BYTES_PER_RUN / len;
+    uint64_t start = GetTimeNS();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        sink = fn(frame, len);
+    }
+    return (double)(GetTimeNS() - start) / iterations;
+}
+
+static bool Verify()
+{
+    static const uint8_t crcCheck[] = "123456789";
+    bool ok = true;
+
+    if (CheckSum::Crc16(crcCheck, 9) != 0x29b1) {
+        printf("CRC-16 check value mismatch: %04x\n", CheckSum::Crc16(crcCheck, 9));
+        ok = false;
+    }
+
+    // Lengths past 255 and odd starting positions exercise position wrap.
+    uint8_t buf[1024];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = random();
+    }
+    for (size_t len = 0; len <= sizeof(buf); len += 1 + (len / 64)) {
+        for (unsigned int pos = 0; pos < 256; pos += 51) {
+            uint16_t ref = CheckSum::SumScalar(buf, len, 0x1234, pos);
+            uint16_t blk = CheckSum::SumBlocked(buf, len, 0x1234, pos);
+            if (ref != blk) {
+                printf("Blocked sum mismatch at len %u pos %u: %04x != %04x\n",
+                       (unsigned int)len, pos, blk, ref);
+                ok = false;
+            }
+        }
+        CheckSum split;
+        split.Add(buf, len / 3);
+        split.Add(&buf[len / 3], len - (len / 3));
+        if (split.GetSum() != CheckSum::SumScalar(buf, len)) {
+            printf("Split sum mismatch at len %u\n", (unsigned int)len);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(void)
+{
+    double total[4] = { 0, 0, 0, 0 };
+
+    for (size_t i = 0; i < sizeof(frame); ++i) {
+        frame[i] = random();
+    }
+
+    if (!Verify()) {
+        return 1;
+    }
+
+    printf("ns/frame  %9s %9s %9s %9s\n", "streaming", "scalar", "blocked", "crc16");
+    for (size_t len = 1; len <= sizeof(frame); ++len) {
+        double t[4];
+        t[0] = Time(RunStreaming, len);
+        t[1] = Time(RunScalar, len);
+        t[2] = Time(RunBlocked, len);
+        t[3] = Time(RunCrc16, len);
+        for (int i = 0; i < 4; ++i) {
+            total[i] += t[i];
+        }
+        if ((len <= 4) || ((len & (len - 1)) == 0) || ((len & (len + 1)) == 0)) {
+            printf("%3u bytes %9.1f %9.1f %9.1f %9.1f\n",
+                   (unsigned int)len, t[0], t[1], t[2], t[3]);
+        }
+    }
+    printf("1-255 sum %9.0f %9.0f %9.0f %9.0f\n", total[0], total[1], total[2], total[3]);
+
+    return 0;
+}
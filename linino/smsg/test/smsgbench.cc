@@ -0,0 +1,101 @@
+/**
+ * @file
+ * SMsg throughput and latency benchmark
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * Runs against the smsgtest sketch on a Yun, or on any host under the link
+ * simulator:
+ *
+ *   linksim -- smsgbench -o csv > smsg.csv
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <aj_tutorial/linkbench.h>
+#include <aj_tutorial/smsg.h>
+
+typedef LinkBench<SMsg> Bench;
+
+static void Usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    Bench::PrintOptions(stderr, Bench::Config());
+    fprintf(stderr,
+            "  -c CHANNEL      channel to use (default 0)\n"
+            "  -B BPS          fastest link speed to try (default %u)\n"
+            "  -k US           coalesce messages for up to US microseconds (default 0)\n"
+            "  -z              compress messages\n"
+            "Payloads over %u bytes need a sketch that takes fragments.\n",
+            SMsg::BAUD_MAX, SMsg::MAX_MSG_LEN);
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Config config;
+    uint8_t channel = SMsg::CHANNEL_DEFAULT;
+    uint32_t maxBaud = SMsg::BAUD_MAX;
+    uint32_t coalesce = 0;
+    bool compress = false;
+    std::string opts = std::string(Bench::OPTIONS) + "c:B:k:z";
+    int c;
+
+    while ((c = getopt(argc, argv, opts.c_str())) != -1) {
+        if (c == 'c') {
+            channel = atoi(optarg);
+        } else if (c == 'B') {
+            maxBaud = strtoul(optarg, NULL, 0);
+        } else if (c == 'k') {
+            coalesce = strtoul(optarg, NULL, 0);
+        } else if (c == 'z') {
+            compress = true;
+        } else if (!Bench::ParseOption(c, optarg, config)) {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    SMsg smsg(channel, maxBaud);
+    if ((config.minLen < 1) || (config.minLen > config.maxLen) ||
+        (config.maxLen > smsg.GetMaxMsgLen())) {
+        fprintf(stderr, "Payloads must be 1 to %u bytes\n", smsg.GetMaxMsgLen());
+        return 2;
+    }
+    fprintf(stderr, "Link %s at %u baud\n", smsg.IsSynced() ? "synced" : "not synced",
+            smsg.GetBaudRate());
+    if (coalesce && !smsg.SetCoalescing(coalesce)) {
+        fprintf(stderr, "The sketch does not coalesce messages\n");
+        return 1;
+    }
+    if (compress && !smsg.SetCompression(true)) {
+        fprintf(stderr, "The sketch does not take compressed messages\n");
+        return 1;
+    }
+
+    Bench bench(smsg, config);
+    uint32_t lost = bench.Run(stdout, "smsg");
+    smsg.DumpStats(stderr);
+
+    return lost ? 1 : 0;
+}
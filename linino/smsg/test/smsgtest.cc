@@ -19,15 +19,20 @@
  *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  ******************************************************************************/
 
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <aj_tutorial/clock.h>
 #include <aj_tutorial/smsg.h>
 
 #define ITERATIONS 10000
 
+#define READ_TIMEOUT 250    // milliseconds to wait for an echo
+#define POLL_MS 10          // keeps retransmissions going while waiting
+
 void DumpBuf(const char* name, const uint8_t* buf, size_t len)
 {
     size_t i;
@@ -46,35 +51,76 @@ void invert(uint8_t* buffer, int size)
   }
 }
 
+/*
+ * Read() with a timeout, so that an echo the Arduino lost (a fault on its
+ * write, a bad frame, or a reset) counts as a failure instead of hanging
+ * the test.  -1 only reports a bad frame, and the echo may still be on its
+ * way behind it, so it is counted in errors and waited through.
+ *
+ * @return  The length of the echo, or 0 if it didn't come in time.
+ */
+static int ReadEcho(SMsg& smsg, uint8_t* buf, uint16_t len, uint32_t& errors)
+{
+    uint32_t start = GetTimeUS();
+    int ret;
+
+    while ((ret = smsg.TryRead(buf, len)) <= 0) {
+        if (ret < 0) {
+            ++errors;
+        }
+        if ((GetTimeUS() - start) >= (READ_TIMEOUT * 1000)) {
+            return 0;
+        }
+        struct pollfd pfd = { smsg.GetFD(), POLLIN, 0 };
+        poll(&pfd, 1, POLL_MS);
+    }
+    return ret;
+}
+
 int main(void)
 {
     SMsg smsg;
     uint8_t txbuf[SMsg::MAX_MSG_LEN + 10];
     uint8_t rxbuf[sizeof(txbuf)];
+    uint16_t maxLen = smsg.GetMaxMsgLen();
     uint32_t i;
+    uint32_t failures = 0;
+    uint32_t errors = 0;
+    uint32_t late = 0;
     int ret;
 
+    printf("Link %s at %u baud in %u us, %u stale bytes discarded, messages up to %u bytes\n",
+           smsg.IsSynced() ? "synced" : "not synced", smsg.GetBaudRate(),
+           smsg.GetSyncTime(), smsg.GetDiscardedBytes(), maxLen);
+
     for (i = 0; i < sizeof(txbuf); ++i) {
         printf("\rFill %u: ", i); fflush(stdout);
         txbuf[i] = (i & 0xff);
         memset(rxbuf, 0, sizeof(rxbuf));
         if (i > 0) {
             ret = smsg.Write(txbuf, i);
-            if ((ret < 0) && (i <= SMsg::MAX_MSG_LEN)) {
+            if ((ret < 0) && (i <= maxLen)) {
+                ++failures;
                 printf("Failed to send %u bytes: %d\n", i, ret);
                 sleep(1);
-            } else if ((ret > 0) && (i > SMsg::MAX_MSG_LEN)) {
+            } else if ((ret > 0) && (i > maxLen)) {
+                ++failures;
                 printf("Sent too large buffer: %d bytes\n", ret);
                 sleep(1);
             }
-            if ((ret > 0) && (i <= SMsg::MAX_MSG_LEN)) {
+            if ((ret > 0) && (i <= maxLen)) {
                 invert(txbuf, i);
-                ret = smsg.Read(rxbuf, sizeof(rxbuf));
-                if (ret < 0) {
-                    printf("Failed to read message: %d\n", ret);
-                } else if (ret == 0) {
+                ret = ReadEcho(smsg, rxbuf, sizeof(rxbuf), errors);
+                while ((ret > 0) && (ret < (int)i)) {
+                    // The echo of an earlier message that was given up on.
+                    ++late;
+                    ret = ReadEcho(smsg, rxbuf, sizeof(rxbuf), errors);
+                }
+                if (ret == 0) {
+                    ++failures;
                     printf("Read timed out\n");
                 } else if ((ret > 0) && (memcmp(txbuf, rxbuf, ret) != 0)) {
+                    ++failures;
                     printf("Data received does not match data sent.\n");
                     DumpBuf("tx", txbuf, i);
                     DumpBuf("rx", rxbuf, ret);
@@ -90,22 +136,31 @@ int main(void)
         memset(rxbuf, 0, sizeof(rxbuf));
         ret = smsg.Write(txbuf, SMsg::MAX_MSG_LEN);
         if (ret < 0) {
+            ++failures;
             printf("Failed to send sequence %u\n", i);
             sleep(1);
             continue;
         }
         invert(txbuf, SMsg::MAX_MSG_LEN);
-        ret = smsg.Read(rxbuf, sizeof(rxbuf));
+        ret = ReadEcho(smsg, rxbuf, sizeof(rxbuf), errors);
+        while ((ret > 0) && ((ret < SMsg::MAX_MSG_LEN) || (~*(uint32_t*)rxbuf < i))) {
+            // The echo of an earlier message that was given up on.
+            ++late;
+            ret = ReadEcho(smsg, rxbuf, sizeof(rxbuf), errors);
+        }
         if (ret < SMsg::MAX_MSG_LEN) {
+            ++failures;
             printf("Failed to receive message sequence %u: %d\n", i, ret);
         } else if ((ret > 0) && (memcmp(txbuf, rxbuf, ret) != 0)) {
+            ++failures;
             printf("Data received does not match data sent for sequence %u\n", i);
             DumpBuf("tx", txbuf, SMsg::MAX_MSG_LEN);
             DumpBuf("rx", rxbuf, ret);
         }
-        invert(txbuf, i);
+        invert(txbuf, SMsg::MAX_MSG_LEN);
     }
-    printf("Done\n");
+    printf("Done, %u failures, %u bad frames reported, %u late echoes skipped\n", failures, errors, late);
+    smsg.DumpStats(stdout);
 
-    return 0;
+    return failures ? 1 : 0;
 }
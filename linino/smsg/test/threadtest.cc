@@ -0,0 +1,172 @@
+/**
+ * @file
+ * LinkThread test: several threads write to SMsg at once through an I/O
+ * thread and check the echoes the smsgtest sketch sends back.
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <aj_tutorial/linkthread.h>
+#include <aj_tutorial/smsg.h>
+
+#define PRODUCERS 4
+#define ITERATIONS 2000
+
+/*
+ * Each producer waits for every WAIT_EVERY'th message to be queued so that
+ * submissions can't run away from the link.
+ */
+#define WAIT_EVERY 8
+
+#define IDLE_TIMEOUT 5      // seconds without an echo before giving up
+
+/*
+ * Messages carry the producer number and a sequence number.  Echoes come
+ * back inverted, and in order for each producer.
+ */
+class Checker : public FrameListener, public SubmitListener {
+  public:
+    Checker() : received(0), failures(0), submitFailures(0)
+    {
+        memset(next, 0, sizeof(next));
+    }
+
+    void FrameReceived(Reactor::Endpoint& ep, const uint8_t* buf, int len)
+    {
+        (void)ep;
+        uint8_t msg[SMsg::MAX_MSG_LEN];
+        for (int i = 0; i < len; ++i) {
+            msg[i] = ~buf[i];
+        }
+        uint8_t producer = msg[0];
+        uint16_t seq = msg[1] | (msg[2] << 8);
+        if ((len != SMsg::MAX_MSG_LEN) || (producer >= PRODUCERS)) {
+            printf("Bad message, %d bytes from producer %u\n", len, producer);
+            __sync_fetch_and_add(&failures, 1);
+        } else if (seq != next[producer]) {
+            printf("Producer %u: got sequence %u, expected %u\n", producer, seq, next[producer]);
+            __sync_fetch_and_add(&failures, 1);
+            next[producer] = seq + 1;
+        } else {
+            ++next[producer];
+        }
+        __sync_fetch_and_add(&received, 1);
+    }
+
+    // For the messages nobody waits on.
+    void SubmitDone(int status, void* context)
+    {
+        (void)context;
+        if (status < 0) {
+            __sync_fetch_and_add(&submitFailures, 1);
+        }
+    }
+
+    volatile uint32_t received;
+    volatile uint32_t failures;
+    volatile uint32_t submitFailures;
+
+  private:
+    uint16_t next[PRODUCERS];
+};
+
+struct Producer {
+    uint8_t id;
+    LinkThread<SMsg>* lt;
+    Checker* checker;
+    uint32_t failures;
+};
+
+static void* Produce(void* arg)
+{
+    Producer* p = reinterpret_cast<Producer*>(arg);
+    uint8_t buf[SMsg::MAX_MSG_LEN];
+
+    for (uint16_t i = 0; i < ITERATIONS; ++i) {
+        memset(buf, p->id, sizeof(buf));
+        buf[0] = p->id;
+        buf[1] = i & 0xff;
+        buf[2] = i >> 8;
+        if ((i % WAIT_EVERY) == (WAIT_EVERY - 1)) {
+            SubmitFuture done;
+            p->lt->Submit(buf, sizeof(buf), &done);
+            if (done.Get() != sizeof(buf)) {
+                printf("Producer %u: failed to queue sequence %u\n", p->id, i);
+                ++p->failures;
+            }
+        } else {
+            p->lt->Submit(buf, sizeof(buf), p->checker);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    SMsg smsg;
+    Checker checker;
+    LinkThread<SMsg> lt(smsg, checker);
+    Producer producers[PRODUCERS];
+    pthread_t threads[PRODUCERS];
+    uint32_t failures = 0;
+    uint8_t i;
+
+    printf("Link %s at %u baud\n", smsg.IsSynced() ? "synced" : "not synced", smsg.GetBaudRate());
+    if (!lt.Start()) {
+        printf("Failed to start the link thread\n");
+        return 1;
+    }
+
+    for (i = 0; i < PRODUCERS; ++i) {
+        producers[i].id = i;
+        producers[i].lt = &lt;
+        producers[i].checker = &checker;
+        producers[i].failures = 0;
+        pthread_create(&threads[i], NULL, Produce, &producers[i]);
+    }
+    for (i = 0; i < PRODUCERS; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += producers[i].failures;
+    }
+
+    uint32_t total = PRODUCERS * ITERATIONS;
+    uint32_t last = 0;
+    uint32_t idle = 0;
+    while ((checker.received < total) && (idle < IDLE_TIMEOUT)) {
+        printf("\rReceived %u of %u", checker.received, total); fflush(stdout);
+        sleep(1);
+        idle = (checker.received == last) ? (idle + 1) : 0;
+        last = checker.received;
+    }
+    lt.Stop();
+
+    if (checker.received < total) {
+        printf("\nMissing %u echoes\n", total - checker.received);
+        failures += total - checker.received;
+    }
+    failures += checker.failures + checker.submitFailures;
+    printf("\nDone, %u failures\n", failures);
+    smsg.DumpStats(stdout);
+
+    return failures ? 1 : 0;
+}
@@ -22,12 +22,41 @@
 #ifndef _SPICOM_H_
 #define _SPICOM_H_
 
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 
 class SPICom {
   public:
     static const uint8_t MAX_MSG_LEN = 63;
 
-    SPICom();
+    /*
+     * Number of messages that may be sent before the first of them is
+     * acknowledged.  A window of 1 is plain stop-and-wait.
+     */
+    static const uint8_t DEFAULT_WINDOW = 4;
+    static const uint8_t MAX_WINDOW = 16;
+
+    /*
+     * Message priorities.  An urgent message is sent ahead of bulk messages
+     * that are still waiting for their first turn on the wire, though no
+     * bulk message is passed more than a few times.  Messages that have been
+     * sent once keep their place, since their sequence numbers are already
+     * out.  A few queue slots are kept free for urgent messages so that
+     * they need not wait for a full queue of bulk ones to drain.
+     */
+    enum Priority {
+        PRIORITY_BULK,
+        PRIORITY_URGENT
+    };
+
+    /**
+     * Open the link to the Arduino.
+     *
+     * @param window    Most messages in flight at once, 1 to MAX_WINDOW.
+     */
+    SPICom(uint8_t window = DEFAULT_WINDOW);
     ~SPICom();
 
     /**
@@ -41,14 +70,88 @@ class SPICom {
     int Read(uint8_t* buf, uint8_t len);
 
     /**
-     * Send a message to the Arduino side of the SPI bus.
+     * Send a message to the Arduino side of the SPI bus.  This blocks until
+     * the message has been acknowledged.
      *
      * @param buf   Pointer to a buffer with the message payload to send.
      * @param len   Size of the message payload to send.
+     * @param prio  PRIORITY_URGENT to go ahead of queued bulk messages.
      *
      * @return  The actual number of bytes sent or -1 on error.
      */
-    int Write(const uint8_t* buf, uint8_t len);
+    int Write(const uint8_t* buf, uint8_t len, Priority prio = PRIORITY_BULK);
+
+    /**
+     * Queue a message for the Arduino side and return without waiting for
+     * it to be acknowledged.  Queued messages are sent back-to-back, up to
+     * the window size ahead of the oldest unacknowledged one.  This only
+     * blocks if the transmit queue is full.
+     *
+     * @param buf   Pointer to a buffer with the message payload to send.
+     * @param len   Size of the message payload to send.
+     * @param prio  PRIORITY_URGENT to go ahead of queued bulk messages.
+     *
+     * @return  The number of bytes queued or -1 on error.
+     */
+    int WriteAsync(const uint8_t* buf, uint8_t len, Priority prio = PRIORITY_BULK);
+
+    /**
+     * Read a message if one can be had without blocking.  Pairs with
+     * select()/epoll() on GetFD().
+     *
+     * @param[out] buf  Pointer to a buffer to store the message payload.
+     * @param[in]  len  Size of the buffer for storing the message payload.
+     *
+     * @return  The actual number of bytes read, 0 if no complete message is
+     *          available yet, or -1 on error.
+     */
+    int TryRead(uint8_t* buf, uint8_t len);
+
+    /**
+     * Queue a message without blocking.  Queued messages are sent and
+     * retransmitted as acks come back; call TryFlush() (or Read()/TryRead())
+     * to keep them moving.
+     *
+     * @param buf   Pointer to a buffer with the message payload to send.
+     * @param len   Size of the message payload to send.
+     * @param prio  PRIORITY_URGENT to go ahead of queued bulk messages.
+     *
+     * @return  The number of bytes queued, 0 if the queue is full, or -1 on
+     *          error.
+     */
+    int TryWrite(const uint8_t* buf, uint8_t len, Priority prio = PRIORITY_BULK);
+
+    /**
+     * Send queued messages and handle acks and retransmissions without
+     * blocking.
+     *
+     * @return  true if nothing is left waiting to be sent or acknowledged.
+     */
+    bool TryFlush();
+
+    /**
+     * Wait for every queued message to be acknowledged or given up on.
+     *
+     * @return  true if all of them were acknowledged, false otherwise.
+     */
+    bool Flush();
+
+    /**
+     * Check if received messages or bytes have already been pulled off the
+     * tty.  select() and epoll() will not report these so callers that wait
+     * on GetFD() must drain them with Read() or TryRead() first.
+     *
+     * @return  true if buffered data is pending, false otherwise
+     */
+    bool RxBuffered() const;
+
+    /**
+     * Check if messages are still waiting to be sent or acknowledged, or if
+     * an ack for a partly received message is still to go out.
+     *
+     * @return  true if output is pending, false otherwise
+     */
+    bool TxPending() const;
 
     /**
      * Get access to the underlying file descriptor used to communicate with
@@ -58,17 +161,120 @@ class SPICom {
      */
     int GetFD() const { return fd; }
 
+    /**
+     * Get the smoothed round trip time from sending a message to getting
+     * its ack.
+     *
+     * @return  time in microseconds, or 0 if nothing has been measured yet
+     */
+    uint32_t GetRTT() const { return srtt; }
+
+    /**
+     * Get the current retransmission timeout, which is derived from the
+     * measured round trip times.
+     *
+     * @return  time in microseconds
+     */
+    uint32_t GetRTO() const { return rto; }
+
   private:
-    uint8_t txseq;
-    uint8_t rxseq;
+    static const uint8_t RX_QUEUE_SIZE = 4;
+    static const uint8_t URGENT_SLOTS = 2;
+    static const uint8_t TX_QUEUE_SIZE = MAX_WINDOW + URGENT_SLOTS;
+
+    /*
+     * Receive parser states.  Bytes are pulled off the tty in bulk into
+     * rxRing and fed through this state machine one at a time.
+     */
+    enum RxState {
+        RX_LENGTH,
+        RX_SEQ,
+        RX_ACK,
+        RX_PAYLOAD,
+        RX_SUM_MSB,
+        RX_SUM_LSB,
+        RX_SKIP,
+        RX_DISCARD
+    };
+
+    struct Msg {
+        uint8_t len;
+        uint8_t data[MAX_MSG_LEN];
+    };
+
+    struct TxMsg {
+        uint8_t len;
+        uint8_t seq;
+        uint8_t tries;          // 0 until first sent
+        uint8_t timeouts;       // times its ack was overdue
+        bool urgent;
+        uint8_t passed;         // urgent messages queued ahead of it
+        uint32_t sendTime;      // when last sent
+        volatile int* status;   // set on completion if a Write() is waiting
+        uint8_t data[MAX_MSG_LEN];
+    };
+
+    uint8_t txseq;              // sequence number of the message at txQueueHead
+    uint8_t rxseq;              // sequence number expected next
     int fd;
+    mutable pthread_mutex_t lock;
+
+    uint8_t rxRing[256];        // indexed by uint8_t so wrap around is free
+    uint8_t rxHead;
+    uint8_t rxTail;
+
+    RxState rxState;
+    uint8_t rxLen;
+    uint8_t rxPos;
+    uint8_t rxSumMSB;
+    bool rxAckFollows;          // the message carries an ack for our side
+    uint8_t rxAck;
+    uint8_t rxFrame[MAX_MSG_LEN];
+    uint32_t rxTime;            // when the last byte came in
+    uint8_t rxNack;             // sent once a bad message has been discarded
+    bool rxNacked;              // the gap in the sequence was already reported
+    bool rxError;
+
+    Msg rxQueue[RX_QUEUE_SIZE];
+    uint8_t rxQueueHead;
+    uint8_t rxQueueCount;
+
+    TxMsg txQueue[TX_QUEUE_SIZE];
+    uint8_t txQueueHead;        // oldest message not yet acknowledged
+    uint8_t txCount;
+    uint8_t txNext;             // offset from txQueueHead of the next to send
+    uint8_t txSent;             // messages from txQueueHead sent at least once
+    uint8_t txWindow;
+    bool txFailed;              // a message was given up on since Flush()
+
+    uint8_t txOut[128];         // framed bytes the tty hasn't taken yet
+    uint8_t txOutLen;
+
+    uint32_t srtt;              // smoothed round trip time, 0 until measured
+    uint32_t rttvar;            // round trip time variation
+    uint32_t rto;               // retransmission timeout
+
+    static uint8_t TxLimit(Priority prio)
+    {
+        return (prio == PRIORITY_URGENT) ? TX_QUEUE_SIZE : (TX_QUEUE_SIZE - URGENT_SLOTS);
+    }
 
-    int ReadMsg(uint8_t* buf, uint8_t len);
-    int WriteMsg(const uint8_t* buf, uint8_t len);
-    bool ReadByte(uint8_t* buf);
-    bool WriteByte(const uint8_t buf);
-    void FlushRead();
-    bool WaitForMsg();
+    void QueueMsg(const uint8_t* buf, uint8_t len, volatile int* status, Priority prio);
+    bool ServiceTx();
+    void CompleteTx(bool success);
+    void HandleAck(uint8_t ack);
+    void UpdateRTT(uint32_t rtt);
+    uint32_t PollTimeout(uint32_t timeout) const;
+    void SendFrame(const TxMsg& msg);
+    bool SendAck(uint8_t ack);
+    bool FlushOut();
+    bool WaitForTx(volatile int* status, uint8_t queued);
+    ssize_t FillRxRing();
+    void ParseRx();
+    void RxFailed(uint8_t nack);
+    int PopMsg(uint8_t* buf, uint8_t len);
+    void ResetRx();
+    bool WaitForMsg(uint32_t timeout);
 };
 
 
@@ -36,9 +36,15 @@
  *   ack/nack message.
  *
  * - Sequence byte.  This is just a simple incrementing number.  This allows
- *   the receiver to determine if it receives a duplicate payload message.
- *   This number rolls over at 63.  This is so that the ack/nack message can
- *   indicate the message being acknowlegded.
+ *   the receiver to determine if it receives a duplicate payload message or
+ *   missed one.  This number rolls over at 63.  This is so that the ack/nack
+ *   message can indicate the message being acknowlegded.  Bit 6 is set if an
+ *   ack byte follows.
+ *
+ * - Ack byte, only if bit 6 of the sequence byte is set.  An ack/nack message
+ *   (see below) riding along with the payload, so that a side with data to
+ *   send does not need a separate message to answer the other side.  It is
+ *   only acted on once the checksum has been verified.
  *
  * - Payload.  This will consist of 0 to 63 bytes.  The meaning of the contents
  *   are defined by the code that uses this driver.
@@ -58,22 +64,48 @@
  *
  * ack = 1 for success; ack = 0 for failure
  *
+ * Acks are cumulative: an ack says that every message up to and including
+ * its sequence number has been received.  A nack carries the sequence number
+ * the receiver expects next, so it also acknowledges everything before that.
+ *
  *
  * Checksum Calculation:
  *
  * The checksum will be a sum of each byte multiplied by its position starting
- * with the length byte and each payload byte in sequence.  The position count
- * will start with 1 to prevent the length value from always adding 0.
+ * with the length byte and each header and payload byte in sequence.  The
+ * position count will start with 1 to prevent the length value from always
+ * adding 0.
  *
  *
  * Message exchange:
  *
- * The initiating side shall send payload messages.  The responding side must
- * respond with an ack/nack message within 40 ms of receiving the message.  If
- * the initiating side does not receive an ack/nack within 40 ms, it is free
- * to resend the payload message.  The receiving side will have a 20 ms timeout
- * on receiving characters so that it can detect lost characters in a message
- * and send an appropriate nack.
+ * The initiating side may send up to a window's worth of payload messages
+ * before the first of them is acknowledged (go-back-N).  The responding side
+ * must respond to each message with an ack/nack message within 40 ms of
+ * receiving it.  Messages are only accepted in order.  A message with a
+ * sequence number the receiver has already seen is skipped and acked again
+ * in case the earlier ack was lost.  One from further ahead means messages
+ * were lost, so it is skipped and, once per gap, nacked.  On a nack, or if
+ * the oldest outstanding message is not acknowledged within the
+ * retransmission timeout, the initiating side resends everything from the
+ * oldest unacknowledged message on.  The retransmission timeout starts at
+ * 40 ms and then follows the measured round trip time, so a slow receiver
+ * is not flooded with resends.  The receiving side will have a timeout on
+ * receiving characters so that it can detect lost characters in a message
+ * and send an appropriate nack: 5 ms on the Arduino side, which gets each
+ * message in one piece, and 20 ms on this side, which sees the Arduino's
+ * bytes only as often as the driver hands them over.
+ *
+ * The Arduino side may hold an ack back for a few milliseconds in case it
+ * has a message of its own to send it with.  It acks right away when a
+ * second message arrives before the first has been acked, so a window of
+ * messages from this side is answered with about half as many acks.  This
+ * side always acks straight away since the Arduino side waits for each
+ * message's ack before doing anything else.
+ *
+ * An ack or nack that could not have come from any message in flight means
+ * one side restarted, so the sender renumbers its outstanding messages to
+ * carry on from the sequence number the receiver expects.
  */
 
 #include <errno.h>
@@ -81,15 +113,20 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <aj_tutorial/checksum.h>
+#include <aj_tutorial/clock.h>
 #include <aj_tutorial/spicom.h>
+#include <aj_tutorial/trace.h>
 
 #define TTY_DEV "/dev/ttySPI0"
 
@@ -100,26 +137,93 @@
 #define ACK_MASK (ACK | NACK)
 #define SEQ_MASK ((~ACK_MASK) & 0xff)
 
-#define RD_TO 20
+#define ACK_FOLLOWS 0x40
+
+/*
+ * A message numbered up to SEQ_BEHIND before the expected one is taken to be
+ * a duplicate.  This has to cover the largest window.
+ */
+#define SEQ_BEHIND 32
+
+/*
+ * Timeouts in microseconds.  RD_TO is this side's inter-byte timeout and
+ * ACK_TO the longest a receiver may take to answer a message.  The Arduino
+ * side gives up on a frame after ARDUINO_RD_TO without a byte and nacks it
+ * once the line has been quiet for ARDUINO_QUIET_TO.
+ */
+#define RD_TO 20000
+#define ACK_TO (2 * RD_TO)
+#define ARDUINO_RD_TO 5000
+#define ARDUINO_QUIET_TO 2000
+#define MAX_TRIES 3
+
+/*
+ * The sender's retransmission timeout adapts to the measured round trip
+ * time the way TCP's does (RFC 6298): RTO = SRTT + 4 * RTTVAR, doubled on
+ * each timeout until a fresh measurement comes in.  Messages that had to be
+ * resent are not measured since it can't be told which copy the ack was for.
+ * It starts out at ACK_TO and is kept between RTO_MIN and RTO_MAX.
+ *
+ * The floor covers how long the Arduino takes to nack a damaged frame: up
+ * to its inter-byte timeout to notice, then its quiet time on the line
+ * before it answers.  Resending any sooner only keeps it from getting back
+ * in step.
+ */
+#define RTO_MIN (ARDUINO_RD_TO + ARDUINO_QUIET_TO)
+#define RTO_MAX (4 * ACK_TO)
+
+#define IDLE_POLL_TO 50000
 
-class CheckSum {
-  public:
-    CheckSum() : sum(0), pos(0) { }
+#define FRAME_OVERHEAD 4
+
+/*
+ * Most urgent messages one bulk message can be passed by.
+ */
+#define URGENT_PASS_MAX 8
 
-    void AddByte(uint8_t b) { sum += (++pos * b); }
-    uint8_t GetSumMSB() const { return (sum >> 8) & 0xff; }
-    uint8_t GetSumLSB() const { return sum & 0xff; }
+/* Status values for a blocking Write() waiting on its message. */
+#define TX_PENDING 0
+#define TX_DONE 1
+#define TX_FAILED -1
 
-  private:
-    uint16_t sum;
-    uint8_t pos;
-};
+/*
+ * SPICOM_DEV points the driver at another tty, such as the pty the link
+ * simulator (linksim) plays the Arduino side on.
+ */
+static const char* GetDevice()
+{
+    const char* dev = getenv("SPICOM_DEV");
+    return dev ? dev : TTY_DEV;
+}
 
 
-SPICom::SPICom(void): txseq(0), rxseq(0), fd(open(TTY_DEV, O_RDWR | O_NONBLOCK | O_NOCTTY))
+SPICom::SPICom(uint8_t window):
+    txseq(0),
+    rxseq(0),
+    fd(open(GetDevice(), O_RDWR | O_NONBLOCK | O_NOCTTY)),
+    rxHead(0),
+    rxTail(0),
+    rxTime(0),
+    rxNacked(false),
+    rxError(false),
+    rxQueueHead(0),
+    rxQueueCount(0),
+    txQueueHead(0),
+    txCount(0),
+    txNext(0),
+    txSent(0),
+    txWindow((window < 1) ? 1 : ((window > MAX_WINDOW) ? MAX_WINDOW : window)),
+    txFailed(false),
+    txOutLen(0),
+    srtt(0),
+    rttvar(0),
+    rto(ACK_TO)
 {
+    pthread_mutex_init(&lock, NULL);
+    ResetRx();
+
     if (fd < 0) {
-        perror("opening " TTY_DEV);
+        perror(GetDevice());
     } else {
         struct termios tio;
         memset(&tio, 0, sizeof(tio));
@@ -136,198 +240,670 @@ SPICom::SPICom(void): txseq(0), rxseq(0), fd(open(TTY_DEV, O_RDWR | O_NONBLOCK |
 SPICom::~SPICom(void)
 {
     close(fd);
+    pthread_mutex_destroy(&lock);
 }
 
 
 int SPICom::Read(uint8_t* buf, uint8_t len)
 {
-    int ret;
+    int ret = -1;
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
-    ret = select(fd + 1, &rfds, NULL, NULL, NULL);
+    pthread_mutex_lock(&lock);
+    TRACE("spicom read", len);
+    while (true) {
+        ParseRx();
+        ServiceTx();
 
-    if (ret > 0) {
-        printf("RD:");
-        ret = ReadMsg(buf, len);
-        printf("\n");
+        ret = PopMsg(buf, len);
+        if (ret != 0) {
+            break;
+        }
+        ret = -1;
+
+        // Another thread may queue a message while we wait, so never block
+        // for too long while idle.
+        bool midMsg = (rxState != RX_LENGTH);
+        pthread_mutex_unlock(&lock);
+        bool ready = WaitForMsg(PollTimeout(midMsg ? RD_TO : IDLE_POLL_TO));
+        pthread_mutex_lock(&lock);
+
+        if (ready) {
+            ssize_t rret = FillRxRing();
+            if ((rret == 0) && (rxState == RX_LENGTH)) {
+                // no flushing, no acking
+                ret = 0;
+                break;
+            }
+            if ((rret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+                break;
+            }
+        }
     }
+    TRACE("spicom read done", ret);
+    pthread_mutex_unlock(&lock);
     return ret;
 }
 
-int SPICom::Write(const uint8_t* buf, uint8_t len)
+int SPICom::Write(const uint8_t* buf, uint8_t len, Priority prio)
 {
     if ((len < 1) || (len > MAX_MSG_LEN)) {
         return -1;
     }
-    printf("WR:");
-    int ret = WriteMsg(buf, len);
-    printf("\n");
+
+    volatile int status = TX_PENDING;
+    pthread_mutex_lock(&lock);
+    TRACE("spicom write", len);
+    if (WaitForTx(NULL, TxLimit(prio) - 1)) {
+        QueueMsg(buf, len, &status, prio);
+        WaitForTx(&status, 0);
+    }
+    TRACE("spicom write done", status);
+    pthread_mutex_unlock(&lock);
+    return (status == TX_DONE) ? len : -1;
+}
+
+int SPICom::WriteAsync(const uint8_t* buf, uint8_t len, Priority prio)
+{
+    if ((len < 1) || (len > MAX_MSG_LEN)) {
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&lock);
+    if (WaitForTx(NULL, TxLimit(prio) - 1)) {
+        QueueMsg(buf, len, NULL, prio);
+        if (ServiceTx()) {
+            ret = len;
+        }
+    }
+    pthread_mutex_unlock(&lock);
     return ret;
 }
 
-int SPICom::ReadMsg(uint8_t* buf, uint8_t len)
+int SPICom::TryRead(uint8_t* buf, uint8_t len)
 {
-    uint8_t plen;
-    uint8_t pseq;
-    uint8_t ack = NACK | rxseq;
-    uint8_t psumbuf;
-    CheckSum sum;
-    uint8_t i;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+    ssize_t rret = FillRxRing();
+    if ((rret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        ret = -1;
+    } else {
+        ParseRx();
+        ServiceTx();
+        ret = PopMsg(buf, len);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
 
+int SPICom::TryWrite(const uint8_t* buf, uint8_t len, Priority prio)
+{
+    if ((len < 1) || (len > MAX_MSG_LEN)) {
+        return -1;
+    }
 
-    if (!ReadByte(&plen)) {
-        // no flushing, no acking
-        return 0;
+    int ret = 0;
+    uint8_t limit = TxLimit(prio);
+    pthread_mutex_lock(&lock);
+    if (txCount >= limit) {
+        // Pick up any acks that came in and try to make room.
+        FillRxRing();
+        ParseRx();
+        if (!ServiceTx()) {
+            ret = -1;
+        }
     }
-    if ((plen > MAX_MSG_LEN) || (plen > len)) {
-        //printf("error: plen = %02x\n", plen);
-        goto exit;
+    if ((ret == 0) && (txCount < limit)) {
+        QueueMsg(buf, len, NULL, prio);
+        ret = ServiceTx() ? len : -1;
     }
-    sum.AddByte(plen);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SPICom::TryFlush()
+{
+    pthread_mutex_lock(&lock);
+    FillRxRing();
+    ParseRx();
+    bool ret = ServiceTx() && (txCount == 0);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SPICom::Flush()
+{
+    pthread_mutex_lock(&lock);
+    bool ret = WaitForTx(NULL, 0) && !txFailed;
+    txFailed = false;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+bool SPICom::RxBuffered() const
+{
+    pthread_mutex_lock(&lock);
+    bool ret = (rxQueueCount > 0) || (rxHead != rxTail);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
 
-    if (!ReadByte(&pseq)) {
-        //printf("error: read pseq\n");
-        goto exit;
+bool SPICom::TxPending() const
+{
+    pthread_mutex_lock(&lock);
+    bool ret = (txCount > 0) || (txOutLen > 0) || (rxState != RX_LENGTH);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+/*
+ * Add a message to the transmit queue.  An urgent message goes in ahead of
+ * the bulk messages that have not been sent yet, stopping at one that has
+ * been passed URGENT_PASS_MAX times already.  Sequence numbers are only
+ * given out as messages are sent, so nothing already on the wire moves.
+ * The caller must hold the lock and have made sure there is room.
+ */
+void SPICom::QueueMsg(const uint8_t* buf, uint8_t len, volatile int* status, Priority prio)
+{
+    uint8_t pos = txCount;
+    if (prio == PRIORITY_URGENT) {
+        while (pos > txSent) {
+            const TxMsg& prev = txQueue[(txQueueHead + pos - 1) % TX_QUEUE_SIZE];
+            if (prev.urgent || (prev.passed >= URGENT_PASS_MAX)) {
+                break;
+            }
+            --pos;
+        }
+        for (uint8_t i = txCount; i > pos; --i) {
+            TxMsg& moved = txQueue[(txQueueHead + i) % TX_QUEUE_SIZE];
+            moved = txQueue[(txQueueHead + i - 1) % TX_QUEUE_SIZE];
+            ++moved.passed;
+        }
     }
-    if (pseq != rxseq) {
-        //printf("error: pseq = %02x  (rxseq = %02x)\n", pseq, rxseq);
-        if (pseq <= MAX_SEQ_NUMBER) {
-            rxseq = pseq;  // assume that our rxseq value is wrong.
+
+    TxMsg& msg = txQueue[(txQueueHead + pos) % TX_QUEUE_SIZE];
+    msg.len = len;
+    msg.tries = 0;
+    msg.timeouts = 0;
+    msg.urgent = (prio == PRIORITY_URGENT);
+    msg.passed = 0;
+    msg.status = status;
+    memcpy(msg.data, buf, len);
+    ++txCount;
+}
+
+/*
+ * Send queued messages until the window is full.  If the oldest one's ack is
+ * overdue, go back and resend everything from it on.  A message is dropped
+ * once its ack has been overdue MAX_TRIES times.  Resends after a nack don't
+ * count since they happen whenever anything earlier in the window was lost.
+ * The caller must hold the lock.
+ */
+bool SPICom::ServiceTx()
+{
+    if (!FlushOut()) {
+        return false;
+    }
+
+    uint32_t now = GetTimeUS();
+    if ((txNext > 0) && ((now - txQueue[txQueueHead].sendTime) >= rto)) {
+        txNext = 0;
+        rto = (rto > RTO_MAX / 2) ? RTO_MAX : (rto * 2);
+        TRACE("spicom ack overdue", txQueue[txQueueHead].seq);
+        if (++txQueue[txQueueHead].timeouts >= MAX_TRIES) {
+            TRACE_ERROR("spicom tx gave up", txQueue[txQueueHead].seq);
+            CompleteTx(false);
         }
-        goto exit;
     }
-    sum.AddByte(pseq);
 
-    for (i = 0; i < plen; ++i) {
-        if (!ReadByte(&buf[i])) {
-            //printf("error: read payload byte %d\n", i);
-            goto exit;
+    while ((txNext < txCount) && (txNext < txWindow)) {
+        TxMsg& msg = txQueue[(txQueueHead + txNext) % TX_QUEUE_SIZE];
+        if ((size_t)txOutLen + msg.len + FRAME_OVERHEAD > sizeof(txOut)) {
+            // The tty is backed up.  Try again once it has taken some.
+            break;
+        }
+        msg.seq = (txseq + txNext) & MAX_SEQ_NUMBER;
+        SendFrame(msg);
+        ++msg.tries;
+        msg.sendTime = now;
+        if (++txNext > txSent) {
+            txSent = txNext;
+        }
+        if (!FlushOut()) {
+            return false;
         }
-        sum.AddByte(buf[i]);
     }
+    return true;
+}
 
-    if (!ReadByte(&psumbuf)) {
-        //printf("error: read sum high\n");
-        goto exit;
+/*
+ * Retire the message at the head of the transmit queue.  Its sequence number
+ * is used up either way: if the receiver never got it, the next message
+ * draws a nack that puts the sender back in step.  The caller must hold the
+ * lock.
+ */
+void SPICom::CompleteTx(bool success)
+{
+    TxMsg& msg = txQueue[txQueueHead];
+
+    ++txseq;
+    txseq &= MAX_SEQ_NUMBER;
+    if (!success) {
+        txFailed = true;
     }
-    if (sum.GetSumMSB() != psumbuf) {
-        //printf("error: high sum = %d  (%02x)\n", psumbuf, sum.GetSumMSB());
-        goto exit;
+    if (msg.status) {
+        *msg.status = success ? TX_DONE : TX_FAILED;
     }
-
-    if (!ReadByte(&psumbuf)) {
-        //printf("error: read sum low\n");
-        goto exit;
+    txQueueHead = (txQueueHead + 1) % TX_QUEUE_SIZE;
+    --txCount;
+    if (txNext > 0) {
+        --txNext;
     }
-    if (sum.GetSumLSB() != psumbuf) {
-        //printf("error: low sum = %02x  (%02x)\n", psumbuf, sum.GetSumLSB());
-        goto exit;
+    if (txSent > 0) {
+        --txSent;
     }
+}
 
-    ack |= ACK;
-    ++rxseq;
-    rxseq &= MAX_SEQ_NUMBER;
+/*
+ * Handle an ack/nack byte.  Everything before the sequence number the
+ * receiver expects next has made it.  A nack means the rest has to be sent
+ * again.  The caller must hold the lock.
+ */
+void SPICom::HandleAck(uint8_t ack)
+{
+    bool isAck = ((ack & ACK_MASK) == ACK);
+    uint8_t expected = (ack + (isAck ? 1 : 0)) & SEQ_MASK;
+    uint8_t received = (expected - txseq) & MAX_SEQ_NUMBER;
+
+    if (received > txSent) {
+        // Not a reply to anything sent, so the receiver lost track (e.g. it
+        // restarted).  Carry on from where it is.
+        TRACE("spicom renumber", expected);
+        txseq = expected;
+        txNext = 0;
+        txSent = 0;
+    } else {
+        if (received > 0) {
+            // Time the newest message acked.  Older ones may have waited on
+            // a lost ack.
+            const TxMsg& msg = txQueue[(txQueueHead + received - 1) % TX_QUEUE_SIZE];
+            if (msg.tries == 1) {
+                UpdateRTT(GetTimeUS() - msg.sendTime);
+            }
+        }
+        while (received-- > 0) {
+            CompleteTx(true);
+        }
+        if (!isAck) {
+            // Go back N.
+            TRACE("spicom go back", expected);
+            txNext = 0;
+        }
+    }
+    ServiceTx();
+}
 
-exit:
-    FlushRead();
-    WriteByte(ack);
+/*
+ * Fold a round trip time measurement into the smoothed RTT and its
+ * variation, and recompute the retransmission timeout from them.
+ */
+void SPICom::UpdateRTT(uint32_t rtt)
+{
+    if (srtt == 0) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    } else {
+        uint32_t err = (rtt > srtt) ? (rtt - srtt) : (srtt - rtt);
+        rttvar = rttvar - (rttvar / 4) + (err / 4);
+        srtt = srtt - (srtt / 8) + (rtt / 8);
+    }
+    if (srtt == 0) {
+        srtt = 1;  // 0 means no measurement yet
+    }
 
-    return ((ack & ACK_MASK) == ACK) ? plen : -1;
+    rto = srtt + (4 * rttvar);
+    if (rto < RTO_MIN) {
+        rto = RTO_MIN;
+    } else if (rto > RTO_MAX) {
+        rto = RTO_MAX;
+    }
+    TRACE("spicom rtt", rtt);
 }
 
+/*
+ * Cut a wait for input short if the oldest message's ack falls due first.
+ */
+uint32_t SPICom::PollTimeout(uint32_t timeout) const
+{
+    if (txNext > 0) {
+        uint32_t waited = GetTimeUS() - txQueue[txQueueHead].sendTime;
+        uint32_t left = (waited < rto) ? (rto - waited) : 0;
+        if (left < timeout) {
+            return left;
+        }
+    }
+    return timeout;
+}
 
-int SPICom::WriteMsg(const uint8_t* buf, uint8_t len)
+/*
+ * Frame a message into txOut.  The caller must have made sure there is room.
+ */
+void SPICom::SendFrame(const TxMsg& msg)
 {
+    uint8_t* out = &txOut[txOutLen];
+
+    *out++ = msg.len;
+    *out++ = msg.seq;
+    memcpy(out, msg.data, msg.len);
+    out += msg.len;
+
     CheckSum sum;
-    ssize_t ret;
-    uint8_t sumbuf;
-    uint8_t ack = 0;
-    uint8_t i;
+    sum.Add(&txOut[txOutLen], msg.len + 2);
+    *out++ = sum.GetSumMSB();
+    *out++ = sum.GetSumLSB();
 
-    sum.AddByte(len);
-    if (!WriteByte(len)) {
-        return -1;
-    }
+    txOutLen += msg.len + FRAME_OVERHEAD;
+}
 
-    sum.AddByte(txseq);
-    if (!WriteByte(txseq)) {
-        return -1;
+bool SPICom::SendAck(uint8_t ack)
+{
+    if (txOutLen < sizeof(txOut)) {
+        txOut[txOutLen++] = ack;
     }
+    return FlushOut();
+}
 
-    for (i = 0; i < len; ++i) {
-        sum.AddByte(buf[i]);
-        if (!WriteByte(buf[i])) {
-            return -1;
-        }
+/*
+ * Hand as much of txOut to the tty as it will take in one system call.
+ */
+bool SPICom::FlushOut()
+{
+    if (txOutLen == 0) {
+        return true;
     }
 
-    sumbuf = sum.GetSumMSB();
-    if (!WriteByte(sumbuf)) {
-        return -1;
+    ssize_t ret = write(fd, txOut, txOutLen);
+    if (ret < 0) {
+        return ((errno == EAGAIN) || (errno == EINTR));
     }
-    
-    sumbuf = sum.GetSumLSB();
-    if (!WriteByte(sumbuf)) {
-        return -1;
-    }
-
-    // Get the ack/nack
-    WaitForMsg(); //  TO for ACK/NACK is 2x normal TO
-    if (!ReadByte(&ack)) {
-        return -1;
+    for (ssize_t i = 0; i < ret; ++i) {
+        TRACE("spicom w", txOut[i]);
     }
+    txOutLen -= ret;
+    memmove(txOut, &txOut[ret], txOutLen);
+    return true;
+}
 
-    if (((ack & ACK_MASK) != ACK) || ((ack & SEQ_MASK) != txseq)) {
-        if ((ack & ACK_MASK) == 0) {
-            FlushRead();
+/*
+ * Keep servicing the link until the given message has completed, or if
+ * status is NULL, until no more than queued messages are left in the
+ * transmit queue.  The lock is
+ * dropped while waiting so that readers can make progress.  The caller must
+ * hold the lock.
+ */
+bool SPICom::WaitForTx(volatile int* status, uint8_t queued)
+{
+    while (true) {
+        if (!ServiceTx()) {
+            return false;
+        }
+        if (status ? (*status != TX_PENDING) : (txCount <= queued)) {
+            return true;
         }
-        return -1;
-    }
 
-    ++txseq;
-    txseq &= MAX_SEQ_NUMBER;
+        pthread_mutex_unlock(&lock);
+        bool ready = WaitForMsg(PollTimeout(RD_TO));
+        pthread_mutex_lock(&lock);
 
-    return len;
+        if (ready) {
+            FillRxRing();
+        }
+        ParseRx();
+    }
 }
 
 
-bool SPICom::ReadByte(uint8_t* buf)
+/*
+ * Pull everything the tty has ready into rxRing with a single system call.
+ */
+ssize_t SPICom::FillRxRing()
 {
-    if (WaitForMsg()) {
-        int ret = read(fd, buf, 1);
-        if (ret > 0) {
-            printf(" r%02x", *buf);
-            return true;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    // Keep one slot open to tell full from empty.
+    uint8_t space = rxTail - rxHead - 1;
+
+    if ((fd < 0) || (space == 0)) {
+        return 0;
+    }
+
+    iov[0].iov_base = &rxRing[rxHead];
+    if ((size_t)rxHead + space > sizeof(rxRing)) {
+        iov[0].iov_len = sizeof(rxRing) - rxHead;
+        iov[1].iov_base = &rxRing[0];
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    } else {
+        iov[0].iov_len = space;
+    }
+
+    ssize_t ret = readv(fd, iov, iovcnt);
+    if (ret > 0) {
+        for (ssize_t i = 0; i < ret; ++i) {
+            TRACE("spicom r", rxRing[(uint8_t)(rxHead + i)]);
         }
+        rxHead += ret;
+        rxTime = GetTimeUS();
     }
-    return false;
+    return ret;
 }
 
-bool SPICom::WriteByte(const uint8_t buf)
+/*
+ * Run the buffered bytes through the receive state machine.  Good messages
+ * are acked as soon as they are complete and go to rxQueue, unless it is
+ * full.  Then the message is left unacked for the sender to send again once
+ * the queue has been read from.  Messages out of sequence are skipped.
+ * After a bad message everything is discarded until the line has been quiet
+ * for RD_TO, then the nack goes out.  The caller must hold the lock.
+ */
+void SPICom::ParseRx()
 {
-    printf(" w%02x", buf);
-    int ret = write(fd, &buf, 1);
-    return (ret > 0);
+    if ((rxState != RX_LENGTH) && ((GetTimeUS() - rxTime) >= RD_TO)) {
+        if (rxState == RX_DISCARD) {
+            SendAck(rxNack);
+            rxNacked = true;
+            ResetRx();
+        } else if (rxHead == rxTail) {
+            if (rxState != RX_SKIP) {
+                // Inter-byte timeout in the middle of a message.
+                TRACE_ERROR("spicom rx timeout", rxState);
+                rxNack = NACK | rxseq;
+                SendAck(rxNack);
+                rxNacked = true;
+                rxError = true;
+            }
+            ResetRx();
+        }
+    }
+
+    while (rxTail != rxHead) {
+        uint8_t b = rxRing[rxTail++];
+
+        switch (rxState) {
+        case RX_LENGTH:
+            if (b & NACK) {
+                HandleAck(b);
+                break;
+            }
+            if (b > MAX_MSG_LEN) {
+                RxFailed(NACK | rxseq);
+                break;
+            }
+            rxLen = b;
+            rxState = RX_SEQ;
+            break;
+
+        case RX_SEQ:
+            rxAckFollows = ((b & ACK_FOLLOWS) != 0);
+            b &= ~ACK_FOLLOWS;
+            if (b > MAX_SEQ_NUMBER) {
+                RxFailed(NACK | rxseq);
+                break;
+            }
+            if (b != rxseq) {
+                if (((rxseq - b) & MAX_SEQ_NUMBER) <= SEQ_BEHIND) {
+                    // Already have it, so the ack must have been lost.
+                    SendAck(ACK | ((rxseq - 1) & MAX_SEQ_NUMBER));
+                } else if (!rxNacked) {
+                    // Messages were lost.  Ask for them once.
+                    TRACE("spicom rx gap", b);
+                    SendAck(NACK | rxseq);
+                    rxNacked = true;
+                    rxError = true;
+                }
+                rxPos = 0;
+                rxState = RX_SKIP;
+                break;
+            }
+            rxPos = 0;
+            if (rxAckFollows) {
+                rxState = RX_ACK;
+            } else {
+                rxState = (rxLen > 0) ? RX_PAYLOAD : RX_SUM_MSB;
+            }
+            break;
+
+        case RX_ACK:
+            if (!(b & NACK)) {
+                RxFailed(NACK | rxseq);
+                break;
+            }
+            rxAck = b;
+            rxState = (rxLen > 0) ? RX_PAYLOAD : RX_SUM_MSB;
+            break;
+
+        case RX_PAYLOAD:
+            rxFrame[rxPos++] = b;
+            if (rxPos == rxLen) {
+                rxState = RX_SUM_MSB;
+            }
+            break;
+
+        case RX_SUM_MSB:
+            rxSumMSB = b;
+            rxState = RX_SUM_LSB;
+            break;
+
+        case RX_SUM_LSB: {
+            CheckSum sum;
+            sum.AddByte(rxLen);
+            if (rxAckFollows) {
+                sum.AddByte(rxseq | ACK_FOLLOWS);
+                sum.AddByte(rxAck);
+            } else {
+                sum.AddByte(rxseq);
+            }
+            sum.Add(rxFrame, rxLen);
+
+            if ((sum.GetSumMSB() != rxSumMSB) || (sum.GetSumLSB() != b)) {
+                RxFailed(NACK | rxseq);
+                break;
+            }
+
+            if ((rxLen > 0) && (rxQueueCount == RX_QUEUE_SIZE)) {
+                // The Arduino side sends one message at a time, so its
+                // write() just fails once its wait for the ack runs out, and
+                // the sketch can send it again.
+                TRACE("spicom rx full", rxseq);
+            } else {
+                SendAck(ACK | rxseq);
+                ++rxseq;
+                rxseq &= MAX_SEQ_NUMBER;
+                rxNacked = false;
+
+                if (rxLen > 0) {
+                    Msg& msg = rxQueue[(rxQueueHead + rxQueueCount) % RX_QUEUE_SIZE];
+                    msg.len = rxLen;
+                    memcpy(msg.data, rxFrame, rxLen);
+                    ++rxQueueCount;
+                }
+            }
+            if (rxAckFollows) {
+                HandleAck(rxAck);
+            }
+            ResetRx();
+            break;
+        }
+
+        case RX_SKIP:
+            // The ack byte, if any, is skipped along with the rest since it
+            // can't be checked.
+            if (++rxPos == rxLen + (rxAckFollows ? 3 : 2)) {
+                ResetRx();
+            }
+            break;
+
+        case RX_DISCARD:
+            TRACE("spicom f", b);
+            break;
+        }
+    }
 }
 
+/*
+ * Start discarding input after a bad message.  The nack goes out once the
+ * line goes quiet.  The caller must hold the lock.
+ */
+void SPICom::RxFailed(uint8_t nack)
+{
+    TRACE_ERROR("spicom rx bad", rxState);
+    rxState = RX_DISCARD;
+    rxNack = nack;
+    rxError = true;
+}
 
-void SPICom::FlushRead()
+/*
+ * Hand the oldest received message to the caller.  A message too big for
+ * the caller's buffer is dropped.  The caller must hold the lock.
+ *
+ * Returns the payload length, 0 if nothing is queued, or -1 if the message
+ * was dropped or a bad message was discarded since the last call.
+ */
+int SPICom::PopMsg(uint8_t* buf, uint8_t len)
 {
-    uint8_t buf;
+    if (rxQueueCount == 0) {
+        if (rxError) {
+            rxError = false;
+            return -1;
+        }
+        return 0;
+    }
 
-    while (WaitForMsg()) {
-        read(fd, &buf, 1);
-        printf(" f%02x", buf);
+    const Msg& msg = rxQueue[rxQueueHead];
+    rxQueueHead = (rxQueueHead + 1) % RX_QUEUE_SIZE;
+    --rxQueueCount;
+    if (msg.len > len) {
+        return -1;
     }
+    memcpy(buf, msg.data, msg.len);
+    return msg.len;
+}
+
+void SPICom::ResetRx()
+{
+    rxState = RX_LENGTH;
+    rxLen = 0;
+    rxPos = 0;
+    rxAckFollows = false;
 }
 
 
-bool SPICom::WaitForMsg()
+bool SPICom::WaitForMsg(uint32_t timeout)
 {
     fd_set rfds;
-    struct timeval to = { 0, RD_TO * 1000 };
+    struct timeval to = { 0, timeout };
     FD_ZERO(&rfds);
     FD_SET(fd, &rfds);
     return (select(fd + 1, &rfds, NULL, NULL, &to) > 0);
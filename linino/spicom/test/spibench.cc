@@ -0,0 +1,86 @@
+/**
+ * @file
+ * SPICom throughput and latency benchmark
+ */
+
+/******************************************************************************
+ * Copyright (c) 2014, AllSeen Alliance. All rights reserved.
+ *
+ *    Permission to use, copy, modify, and/or distribute this software for any
+ *    purpose with or without fee is hereby granted, provided that the above
+ *    copyright notice and this permission notice appear in all copies.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * Runs against the spicomtest sketch on a Yun, or on any host under the link
+ * simulator:
+ *
+ *   linksim -p spicom -- spibench -o csv > spicom.csv
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <aj_tutorial/linkbench.h>
+#include <aj_tutorial/spicom.h>
+
+typedef LinkBench<SPICom> Bench;
+
+/*
+ * The Arduino side sends its messages stop-and-wait and takes anything other
+ * than an ack in reply as a failure, so echoes cannot be overlapped.
+ */
+static Bench::Config DefaultConfig()
+{
+    Bench::Config config;
+    config.depth = 1;
+    return config;
+}
+
+static void Usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    Bench::PrintOptions(stderr, DefaultConfig());
+    fprintf(stderr, "  -w WINDOW       send window (default %u)\n", SPICom::DEFAULT_WINDOW);
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Config config = DefaultConfig();
+    uint8_t window = SPICom::DEFAULT_WINDOW;
+    std::string opts = std::string(Bench::OPTIONS) + "w:";
+    int c;
+
+    while ((c = getopt(argc, argv, opts.c_str())) != -1) {
+        if (c == 'w') {
+            window = atoi(optarg);
+        } else if (!Bench::ParseOption(c, optarg, config)) {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((config.minLen < 1) || (config.minLen > config.maxLen) ||
+        (config.maxLen > SPICom::MAX_MSG_LEN)) {
+        fprintf(stderr, "Payloads must be 1 to %u bytes\n", SPICom::MAX_MSG_LEN);
+        return 2;
+    }
+
+    SPICom spicom(window);
+    Bench bench(spicom, config);
+    uint32_t lost = bench.Run(stdout, "spicom");
+    fprintf(stderr, "RTT %u us, RTO %u us\n", spicom.GetRTT(), spicom.GetRTO());
+
+    return lost ? 1 : 0;
+}